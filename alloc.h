@@ -0,0 +1,31 @@
+#ifndef ALLOC_H
+
+#define ALLOC_H
+
+#include <stddef.h>
+
+/* An allocator for the container templates, tree.h and dpx.h, to plug in
+ * arenas, pools, per thread caches or counting allocators. Select one for an
+ * instantiation by defining T_ALLOC or DPX_ALLOC, like T_TYPE or DPX_KT, as an
+ * expression giving a const Allocator *, e.g. the address of a global or
+ * thread local Allocator, which is evaluated on every call:
+ *
+ * 		#define T_ALLOC (&arena_allocator)
+ *
+ * ctx is passed to every callback. Sizes are passed back to realloc and free,
+ * so pools and arenas need not keep headers, and an arena may leave free empty
+ * to release everything at once. Instantiations without an allocator call
+ * malloc, realloc and free directly. */
+typedef struct {
+  void *ctx;
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *p, size_t old_size, size_t size);
+  void (*free)(void *ctx, void *p, size_t size);
+} Allocator;
+
+#define alloc_alloc(a, size) ((a)->alloc((a)->ctx, (size)))
+#define alloc_realloc(a, p, old_size, size)                                   \
+  ((a)->realloc((a)->ctx, (p), (old_size), (size)))
+#define alloc_free(a, p, size) ((a)->free((a)->ctx, (p), (size)))
+
+#endif
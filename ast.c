@@ -3,23 +3,210 @@
 #include "../c-generics/fat_pointer.h"
 #include "lexer.h"
 #include "symbols.h"
+#include "alloc.h"
 #include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+/* Nodes are allocated from the node pool of the expression they belong to,
+ * which the thread working on an expression enters first. See NODE POOLS. */
+static void *node_alloc(void *ctx, size_t size);
+static void node_free(void *ctx, void *p, size_t size);
+static const Allocator node_allocator = {NULL, node_alloc, NULL, node_free};
+
 #define T_TYPE Token
 #define T_PREFIX ast
 #define T_STRUCT_PREFIX Ast
+#define T_ALLOC (&node_allocator)
+#define T_HASH(token) tok_hash(token)
+#define T_FLAT
 #include "tree.h"
 
+/* ---------- *
+ * NODE POOLS *
+ * ---------- */
+
+/* Every expression owns a pool its nodes are carved from, in slabs of doubling
+ * size. Nodes freed while the expression is rewritten go on a free list for
+ * reuse, and destroying the expression frees its slabs, not its nodes one by
+ * one. Each pool is only used by one thread at a time, so takes no lock.
+ *
+ * ast_leaf and ast_join take no expression, so the pool nodes come from is
+ * whichever the thread has entered with pool_enter, as the functions taking an
+ * Expression do. Nodes are freed to the pool entered too, so must be freed in
+ * the pool they came from. With no pool entered, nodes are allocated with
+ * malloc, as any allocation of another size always is.
+ *
+ * The dummy parent of the expression lives in the pool itself, so stays put
+ * when pool_compact moves every other node. */
+typedef struct NodeSlab {
+  struct NodeSlab *next;
+  size_t cap;
+  Ast_Node nodes[];
+} NodeSlab;
+
+typedef struct {
+  NodeSlab *slabs;
+  size_t used;
+  Ast_Node *free_list;
+  Ast_Node dummy;
+} NodePool;
+
+#define POOL_SLAB_MIN 16
+#define POOL_SLAB_MAX 4096
+
+/* Pools are compacted once fewer than 1 in POOL_COMPACT_RATIO of the nodes
+ * carved from their slabs are still in the tree. */
+#define POOL_COMPACT_RATIO 2
+
+static _Thread_local NodePool *node_pool;
+
+static NodePool *pool_create(void) { return calloc(1, sizeof(NodePool)); }
+
+static void pool_free_slabs(NodePool *pool) {
+  while (pool->slabs) {
+    NodeSlab *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+}
+
+static void pool_destroy(NodePool *pool) {
+  pool_free_slabs(pool);
+  free(pool);
+}
+
+/* Enters pool, or leaves every pool for NULL, returning the pool entered
+ * before, to enter again after. */
+static NodePool *pool_enter(NodePool *pool) {
+  NodePool *prev = node_pool;
+  node_pool = pool;
+  return prev;
+}
+
+/* Nodes allocated with no pool entered are preceded by HEAP_NODE_TAG, so that
+ * freeing a node where it did not come from, which would corrupt the heap or
+ * the free list, fails an assertion instead. The word before a slab node is
+ * the slab's capacity or the hash and size of the node before it, whose size
+ * never reaches the top half of the tag. */
+#define HEAP_NODE_TAG UINT64_C(0xfffffffe9e3779b9)
+
+typedef struct {
+  uint64_t tag;
+  Ast_Node node;
+} HeapNode;
+
+static int node_is_heap(const void *p) {
+  uint64_t tag;
+  memcpy(&tag, (const char *)p - offsetof(HeapNode, node), sizeof(tag));
+  return tag == HEAP_NODE_TAG;
+}
+
+static void *node_alloc(void *ctx, size_t size) {
+  (void)ctx;
+  NodePool *pool = node_pool;
+  if (size != sizeof(Ast_Node)) {
+    return malloc(size);
+  }
+  if (!pool) {
+    HeapNode *heap = malloc(sizeof(*heap));
+    heap->tag = HEAP_NODE_TAG;
+    return &heap->node;
+  }
+  if (pool->free_list) {
+    Ast_Node *node = pool->free_list;
+    pool->free_list = node->parent;
+    return node;
+  }
+  if (!pool->slabs || pool->used == pool->slabs->cap) {
+    size_t cap = pool->slabs ? 2 * pool->slabs->cap : POOL_SLAB_MIN;
+    cap = cap < POOL_SLAB_MAX ? cap : POOL_SLAB_MAX;
+    NodeSlab *slab = malloc(sizeof(*slab) + cap * sizeof(Ast_Node));
+    slab->next = pool->slabs;
+    slab->cap = cap;
+    pool->slabs = slab;
+    pool->used = 0;
+  }
+  return &pool->slabs->nodes[pool->used++];
+}
+
+static void node_free(void *ctx, void *p, size_t size) {
+  (void)ctx;
+  NodePool *pool = node_pool;
+  if (size != sizeof(Ast_Node)) {
+    free(p);
+    return;
+  }
+  assert(node_is_heap(p) == !pool);
+  if (!pool) {
+    free((char *)p - offsetof(HeapNode, node));
+    return;
+  }
+  Ast_Node *node = p;
+  node->parent = pool->free_list;
+  pool->free_list = node;
+}
+
+/* Number of nodes carved from the slabs of pool, in the tree or freed. */
+static size_t pool_carved(const NodePool *pool) {
+  size_t carved = pool->used;
+  for (NodeSlab *slab = pool->slabs; slab && slab->next; slab = slab->next) {
+    carved += slab->next->cap;
+  }
+  return carved;
+}
+
+/* Moves the tree below the dummy parent into one slab of its size, in
+ * pre-order, so the left child of each node is next to it and traversals read
+ * the slab front to back, then frees the slabs the tree was scattered across,
+ * and with them the free list. Hashes are copied, as the tree is unchanged. */
+static void pool_compact(NodePool *pool) {
+  Ast_Node *root = pool->dummy.lchild;
+  size_t length = ast_size(root);
+  NodeSlab *slab = malloc(sizeof(*slab) + length * sizeof(Ast_Node));
+  slab->next = NULL;
+  slab->cap = length;
+  Ast_Node *nodes = slab->nodes;
+
+  /* Sizes are all fresh, so the right child of the node at i is at i + 1 past
+   * its left subtree. Parents are set when their children are placed. */
+  nodes[0].parent = &pool->dummy;
+  size_t i = 0;
+  Ast_Iter it;
+  ast_iter_init(&it, root, T_PRE);
+  for (Ast_Node *node = ast_begin(&it); !ast_end(&it);
+       node = ast_next(&it), i++) {
+    Ast_Node *parent = nodes[i].parent;
+    nodes[i] = *node;
+    nodes[i].parent = parent;
+    if (node->lchild) {
+      nodes[i].lchild = &nodes[i + 1];
+      nodes[i + 1].parent = &nodes[i];
+    }
+    if (node->rchild) {
+      size_t r = i + 1 + (node->lchild ? node->lchild->size : 0);
+      nodes[i].rchild = &nodes[r];
+      nodes[r].parent = &nodes[i];
+    }
+  }
+  pool->dummy.lchild = nodes;
+
+  pool_free_slabs(pool);
+  pool->slabs = slab;
+  pool->used = length;
+  pool->free_list = NULL;
+}
+
 /* ------------- *
  * HELPER MACROS *
  * ------------- */
 
 #define T_TYPE(node) (node->value.token_type)
-#define T_SCALAR(node) (node->value.scalar)
+#define T_NUM(node) (node->value.num)
 #define T_VAR(node) (node->value.var)
-#define T_OPR(node) (node->value.opr)
+#define T_OPR(node) (tok_opr(node->value))
 
 #define T_IS_SCALAR(node) (T_TYPE(node) == SCALAR)
 #define T_IS_VAR(node) (T_TYPE(node) == VAR)
@@ -36,9 +223,9 @@
 static void build(Ast_Node *out[], Token *oprs) {
   Token opr = fp_pop(oprs);
   Ast_Node *node = NULL;
-  if (opr.opr->arity == 1) {
+  if (tok_opr(opr)->arity == 1) {
     node = ast_join(opr, fp_pop(out), NULL);
-  } else if (opr.opr->arity == 2) {
+  } else if (tok_opr(opr)->arity == 2) {
     Ast_Node *rchild = fp_pop(out);
     Ast_Node *lchild = fp_pop(out);
     node = ast_join(opr, lchild, rchild);
@@ -47,13 +234,13 @@ static void build(Ast_Node *out[], Token *oprs) {
 }
 
 /* Shunting yard algorithm */
-static Ast_Node *shunting_yard(Token tokens[]) {
+static Ast_Node *shunting_yard(const Token tokens[], size_t length) {
   /* Initialises operator stack and output stack. Output stack consists of nodes
    * and should be at most 2 elements always? */
   Token *oprs = NULL;
   Ast_Node **out = NULL;
 
-  for (size_t i = 0; i < fp_length(tokens); i++) {
+  for (size_t i = 0; i < length; i++) {
     Token token = tokens[i];
 
     if (token.token_type != OPR) {
@@ -61,37 +248,37 @@ static Ast_Node *shunting_yard(Token tokens[]) {
       fp_push(node, out);
 
     } else if (token.token_type == OPR) {
-      if (token.opr->arity == 1) {
+      if (tok_opr(token)->arity == 1) {
         fp_push(token, oprs);
 
-      } else if (token.opr->arity == 2) {
-        while ((fp_length(oprs) > 0) && !(fp_peek(oprs).opr->repr[0] == '(') &&
-               (opr_cmp(fp_peek(oprs).opr, token.opr) >= 0)) {
+      } else if (tok_opr(token)->arity == 2) {
+        while ((fp_length(oprs) > 0) &&
+               !(tok_opr(fp_peek(oprs))->repr[0] == '(') &&
+               (opr_cmp(tok_opr(fp_peek(oprs)), tok_opr(token)) >= 0)) {
           build(out, oprs);
         }
         fp_push(token, oprs);
 
-      } else if (token.opr->repr[0] == '(') {
+      } else if (tok_opr(token)->repr[0] == '(') {
         fp_push(token, oprs);
 
-      } else if (token.opr->repr[0] == ')') {
+      } else if (tok_opr(token)->repr[0] == ')') {
         assert(fp_length(oprs) > 0);
-        while (fp_peek(oprs).opr->repr[0] != '(') {
+        while (tok_opr(fp_peek(oprs))->repr[0] != '(') {
           build(out, oprs);
         }
-        assert(fp_peek(oprs).opr->repr[0] == '(');
+        assert(tok_opr(fp_peek(oprs))->repr[0] == '(');
         (void)fp_pop(oprs);
 
-        if ((fp_length(oprs) > 0) && (fp_peek(oprs).opr->arity == 1)) {
+        if ((fp_length(oprs) > 0) && (tok_opr(fp_peek(oprs))->arity == 1)) {
           build(out, oprs);
         }
       }
     }
   }
-  fp_destroy(tokens);
 
   while (fp_length(oprs) > 0) {
-    assert(fp_peek(oprs).opr->repr[0] != '(');
+    assert(tok_opr(fp_peek(oprs))->repr[0] != '(');
     build(out, oprs);
   }
   fp_destroy(oprs);
@@ -101,14 +288,98 @@ static Ast_Node *shunting_yard(Token tokens[]) {
   return root;
 }
 
+/* Fused precedence climbing parser, which pulls tokens straight from the input
+ * and builds nodes as it goes, without the token and stack arrays of
+ * shunting_yard. Builds the same trees as shunting_yard: binary operators are
+ * left associative, and a unary operator takes everything to its right bound
+ * tighter than itself, or only the parenthesised group directly after it. */
+static Ast_Node *pratt_expr(TokenStream *ts, int min_precedence, int depth);
+
+/* Each nested group or unary operator takes a level of recursion, so deeper
+ * input is reported as a parse error rather than overflowing the stack. */
+#define PRATT_MAX_DEPTH 4096
+
+/* Returns 1 if token is the parenthesis c. */
+static int pratt_is_paren(Token token, char c) {
+  return token.token_type == OPR && tok_opr(token)->repr[0] == c;
+}
+
+static Ast_Node *pratt_operand(TokenStream *ts, int depth) {
+  Token token;
+  if (depth > PRATT_MAX_DEPTH || !token_stream_next(ts, &token)) {
+    return NULL;
+  }
+
+  if (token.token_type != OPR) {
+    return ast_leaf(token);
+
+  } else if (pratt_is_paren(token, '(')) {
+    Ast_Node *node = pratt_expr(ts, 0, depth + 1);
+    if (node &&
+        !(token_stream_next(ts, &token) && pratt_is_paren(token, ')'))) {
+      ast_destroy(node);
+      return NULL;
+    }
+    return node;
+
+  } else if (tok_opr(token)->arity == 1) {
+    Token next;
+    Ast_Node *operand;
+    if (token_stream_peek(ts, &next) && pratt_is_paren(next, '(')) {
+      operand = pratt_operand(ts, depth + 1);
+    } else {
+      operand = pratt_expr(ts, tok_opr(token)->precedence + 1, depth + 1);
+    }
+    return operand ? ast_join(token, operand, NULL) : NULL;
+  }
+  return NULL;
+}
+
+static Ast_Node *pratt_expr(TokenStream *ts, int min_precedence, int depth) {
+  Ast_Node *lhs = pratt_operand(ts, depth);
+  Token token;
+  while (lhs && token_stream_peek(ts, &token) && token.token_type == OPR &&
+         tok_opr(token)->arity == 2 &&
+         tok_opr(token)->precedence >= min_precedence) {
+    token_stream_next(ts, &token);
+    Ast_Node *rhs = pratt_expr(ts, tok_opr(token)->precedence + 1, depth);
+    if (!rhs) {
+      ast_destroy(lhs);
+      return NULL;
+    }
+    lhs = ast_join(token, lhs, rhs);
+  }
+  return lhs;
+}
+
+/* Returns NULL if the input is not one whole expression, e.g. on characters
+ * the lexer cannot analyse, a missing operand or parenthesis, tokens left over
+ * after a complete expression, or nesting past PRATT_MAX_DEPTH. */
+static Ast_Node *pratt_parse(const OprSet *oprs, const char *s0, const char *s1,
+                             int pattern) {
+  TokenStream ts;
+  token_stream_init(&ts, oprs, s0, s1, pattern);
+  Ast_Node *root = pratt_expr(&ts, 0, 0);
+  Token token;
+  if (root && (token_stream_peek(&ts, &token) || !token_stream_is_done(&ts))) {
+    ast_destroy(root);
+    root = NULL;
+  }
+  token_stream_cleanup(&ts);
+  return root;
+}
+
 /* ------------------- *
  * EXTRA AST FUNCTIONS *
  * ------------------- */
 
 static Ast_Node *ast_copy(Ast_Node *root) {
   Ast_Node *copy_root = ast_leaf(root->value);
-  Ast_Iter *it1 = ast_iter_create(root, T_PRE);
-  Ast_Iter *it2 = ast_iter_create(copy_root, T_PRE);
+  Ast_Iter iter1, iter2;
+  Ast_Iter *it1 = &iter1;
+  Ast_Iter *it2 = &iter2;
+  ast_iter_init(it1, root, T_PRE);
+  ast_iter_init(it2, copy_root, T_PRE);
   for (ast_start(it1), ast_start(it2), ast_traverse(it1); !ast_end(it1);
        ast_traverse(it1)) {
     switch (it1->dir) {
@@ -119,19 +390,19 @@ static Ast_Node *ast_copy(Ast_Node *root) {
       if (!it2->head->lchild) {
         it2->head->lchild = ast_leaf(it1->head->value);
         it2->head->lchild->parent = it2->head;
+        ast_touch(it2->head);
       }
       break;
     case RPARENT:
       if (!it2->head->rchild) {
         it2->head->rchild = ast_leaf(it1->head->value);
         it2->head->rchild->parent = it2->head;
+        ast_touch(it2->head);
       }
       break;
     }
     ast_traverse(it2);
   }
-  free(it1);
-  free(it2);
 
   return copy_root;
 }
@@ -153,6 +424,7 @@ static void ast_overwrite(Ast_Node *old, Ast_Node *new) {
   }
 
   old->value = new->value;
+  ast_touch(old);
 
   if ((temp = new->lchild)) {
     ast_detach(temp);
@@ -234,43 +506,548 @@ static void ast_swap(Ast_Node *node1, Ast_Node *node2) {
   ast_attach(node1, parent2);
 }
 
+/* ------------------ *
+ * SHARED EXPRESSIONS *
+ * ------------------ */
+
+/* A shared expression is a DAG in which equal subexpressions are one node.
+ * Nodes are only made by dag_intern, which looks them up in a hash table by
+ * value and children, and children are compared by address as they are unique
+ * too. So equal subexpressions are equal pointers, copying one is copying its
+ * pointer, and the transforms rewrite each distinct subexpression once however
+ * often it occurs, which keeps the derivatives of products, repeating their
+ * factors, small. Nodes are never changed once made, so the transforms build
+ * new ones, carved from slabs as pool nodes are. Nodes rewriting leaves
+ * unreachable stay in the table until shared_compact. */
+typedef struct DagNode DagNode;
+struct DagNode {
+  Token value;
+  const DagNode *lchild;
+  const DagNode *rchild;
+  DagNode *next;
+  size_t hash;
+};
+
+typedef struct DagSlab {
+  struct DagSlab *next;
+  size_t cap;
+  DagNode nodes[];
+} DagSlab;
+
+typedef struct {
+  atomic_size_t refs;
+  DagNode **buckets;
+  size_t cap;
+  size_t length;
+  DagSlab *slabs;
+  size_t used;
+} Dag;
+
+/* A shared expression is a root in a table. Copies share the table, so copying
+ * is O(1), until either is transformed, which first moves it to a table of its
+ * own: tables are only ever changed by one expression, as trees are. */
+typedef struct {
+  const DagNode *root;
+  Dag *dag;
+} Shared;
+
+#define DAG_BUCKETS_MIN 64
+
+/* Maps the nodes of a DAG to the nodes they are rewritten to, so shared nodes
+ * are rewritten once. Nodes of a table are mostly adjacent in its slabs, so
+ * their addresses divided by their size make dense hashes. */
+#define DPX_KT const DagNode *
+#define DPX_VT const DagNode *
+#define DPX_PFX memo
+#define DPX_STRUCT_PFX Memo
+#define DPX_HASH(node) ((size_t)(uintptr_t)(node) / sizeof(DagNode))
+#include "dpx.h"
+
+static Dag *dag_create(void) {
+  Dag *dag = calloc(1, sizeof(*dag));
+  atomic_init(&dag->refs, 1);
+  dag->cap = DAG_BUCKETS_MIN;
+  dag->buckets = calloc(dag->cap, sizeof(*dag->buckets));
+  return dag;
+}
+
+static void dag_destroy(Dag *dag) {
+  while (dag->slabs) {
+    DagSlab *next = dag->slabs->next;
+    free(dag->slabs);
+    dag->slabs = next;
+  }
+  free(dag->buckets);
+  free(dag);
+}
+
+static void dag_release(Dag *dag) {
+  if (atomic_fetch_sub(&dag->refs, 1) == 1) {
+    dag_destroy(dag);
+  }
+}
+
+static size_t dag_hash(Token value, const DagNode *lchild,
+                       const DagNode *rchild) {
+  uint64_t h = tok_hash(value);
+  h = (h ^ (uintptr_t)lchild) * 0x9E3779B97F4A7C15u;
+  h = (h ^ (uintptr_t)rchild) * 0x9E3779B97F4A7C15u;
+  return h ^ h >> 32;
+}
+
+static DagNode *dag_node_alloc(Dag *dag) {
+  if (!dag->slabs || dag->used == dag->slabs->cap) {
+    size_t cap = dag->slabs ? 2 * dag->slabs->cap : POOL_SLAB_MIN;
+    cap = cap < POOL_SLAB_MAX ? cap : POOL_SLAB_MAX;
+    DagSlab *slab = malloc(sizeof(*slab) + cap * sizeof(DagNode));
+    slab->next = dag->slabs;
+    slab->cap = cap;
+    dag->slabs = slab;
+    dag->used = 0;
+  }
+  return &dag->slabs->nodes[dag->used++];
+}
+
+static void dag_grow(Dag *dag) {
+  size_t cap = 2 * dag->cap;
+  DagNode **buckets = calloc(cap, sizeof(*buckets));
+  for (size_t i = 0; i < dag->cap; i++) {
+    DagNode *next;
+    for (DagNode *node = dag->buckets[i]; node; node = next) {
+      next = node->next;
+      node->next = buckets[node->hash & (cap - 1)];
+      buckets[node->hash & (cap - 1)] = node;
+    }
+  }
+  free(dag->buckets);
+  dag->buckets = buckets;
+  dag->cap = cap;
+}
+
+/* Returns the node with value and children, making it if there is none. */
+static const DagNode *dag_intern(Dag *dag, Token value, const DagNode *lchild,
+                                 const DagNode *rchild) {
+  size_t hash = dag_hash(value, lchild, rchild);
+  for (DagNode *node = dag->buckets[hash & (dag->cap - 1)]; node;
+       node = node->next) {
+    if (node->hash == hash && node->lchild == lchild &&
+        node->rchild == rchild && tok_is_equal(node->value, value)) {
+      return node;
+    }
+  }
+  if (dag->length == dag->cap) {
+    dag_grow(dag);
+  }
+  DagNode *node = dag_node_alloc(dag);
+  node->value = value;
+  node->lchild = lchild;
+  node->rchild = rchild;
+  node->hash = hash;
+  node->next = dag->buckets[hash & (dag->cap - 1)];
+  dag->buckets[hash & (dag->cap - 1)] = node;
+  dag->length++;
+  return node;
+}
+
+/* The walks over trees and DAGs below keep their own stack of frames rather
+ * than recursing, so the depth of an expression, e.g. a chain of 100000 sums,
+ * is only limited by memory. Each goes down the left children of a node,
+ * pushing a frame for every operator, to a leaf, then back up, popping each
+ * frame once its children are done, to the first with a right child left to
+ * do, which it goes down next. lchild holds the node made for the left child
+ * of a frame meanwhile, and step is set once its left child is done. top is
+ * what the node of a frame is rewritten to before its children are, for
+ * pre-order transforms. Frames are held inline unless the walk is unusually
+ * deep. */
+#define WALK_INLINE 64
+
+typedef struct {
+  const void *node;
+  const DagNode *top;
+  const DagNode *lchild;
+  int step;
+} WalkFrame;
+
+typedef struct {
+  WalkFrame *frames;
+  size_t length;
+  size_t cap;
+  WalkFrame inline_frames[WALK_INLINE];
+} Walk;
+
+static void walk_init(Walk *walk) {
+  walk->frames = walk->inline_frames;
+  walk->length = 0;
+  walk->cap = WALK_INLINE;
+}
+
+static void walk_cleanup(Walk *walk) {
+  if (walk->frames != walk->inline_frames) {
+    free(walk->frames);
+  }
+}
+
+/* Pushes a frame for node, with its left child done already if it has none. */
+static void walk_push(Walk *walk, const void *node, const DagNode *top,
+                      int has_lchild) {
+  if (walk->length == walk->cap) {
+    size_t size = walk->cap * sizeof(*walk->frames);
+    walk->frames = walk->frames == walk->inline_frames
+                       ? memcpy(malloc(2 * size), walk->frames, size)
+                       : realloc(walk->frames, 2 * size);
+    walk->cap *= 2;
+  }
+  walk->frames[walk->length++] = (WalkFrame){node, top, NULL, !has_lchild};
+}
+
+/* Returns the node of dag equal to the tree at node. */
+static const DagNode *dag_from_ast(Dag *dag, const Ast_Node *node) {
+  if (!node) {
+    return NULL;
+  }
+  Walk walk;
+  walk_init(&walk);
+  const Ast_Node *curr = node;
+  const DagNode *new;
+  for (;;) {
+    while (curr->lchild || curr->rchild) {
+      walk_push(&walk, curr, NULL, !!curr->lchild);
+      curr = curr->lchild ? curr->lchild : curr->rchild;
+    }
+    new = dag_intern(dag, curr->value, NULL, NULL);
+    curr = NULL;
+    while (walk.length) {
+      WalkFrame *frame = &walk.frames[walk.length - 1];
+      const Ast_Node *parent = frame->node;
+      if (!frame->step && parent->rchild) {
+        frame->lchild = new;
+        frame->step = 1;
+        curr = parent->rchild;
+        break;
+      }
+      const DagNode *lchild = frame->step ? frame->lchild : new;
+      const DagNode *rchild = frame->step ? new : NULL;
+      new = dag_intern(dag, parent->value, lchild, rchild);
+      walk.length--;
+    }
+    if (!curr) {
+      break;
+    }
+  }
+  walk_cleanup(&walk);
+  return new;
+}
+
+/* Returns the node of dag equal to node, of another DAG, visiting each node
+ * of that once. */
+static const DagNode *dag_import(Dag *dag, const DagNode *node,
+                                 MemoMap *memo) {
+  if (!node) {
+    return NULL;
+  }
+  Walk walk;
+  walk_init(&walk);
+  const DagNode *curr = node;
+  const DagNode *new;
+  for (;;) {
+    for (;;) {
+      const DagNode **done = memo_addr(curr, memo);
+      if (done) {
+        new = *done;
+        break;
+      }
+      if (!curr->lchild && !curr->rchild) {
+        new = dag_intern(dag, curr->value, NULL, NULL);
+        memo_add(curr, new, memo);
+        break;
+      }
+      walk_push(&walk, curr, NULL, !!curr->lchild);
+      curr = curr->lchild ? curr->lchild : curr->rchild;
+    }
+    curr = NULL;
+    while (walk.length) {
+      WalkFrame *frame = &walk.frames[walk.length - 1];
+      const DagNode *parent = frame->node;
+      if (!frame->step && parent->rchild) {
+        frame->lchild = new;
+        frame->step = 1;
+        curr = parent->rchild;
+        break;
+      }
+      const DagNode *lchild = frame->step ? frame->lchild : new;
+      const DagNode *rchild = frame->step ? new : NULL;
+      new = dag_intern(dag, parent->value, lchild, rchild);
+      memo_add(parent, new, memo);
+      walk.length--;
+    }
+    if (!curr) {
+      break;
+    }
+  }
+  walk_cleanup(&walk);
+  return new;
+}
+
+/* Moves what is reachable from the root of shared to a new table of its own,
+ * which frees the nodes left unreachable if no copy shares the old table. */
+static void shared_compact(Shared *shared) {
+  Dag *dag = dag_create();
+  MemoMap *memo = memo_create(DAG_BUCKETS_MIN);
+  shared->root = dag_import(dag, shared->root, memo);
+  memo_destroy(memo);
+  dag_release(shared->dag);
+  shared->dag = dag;
+}
+
+/* As recursive_print, printing shared subexpressions once per occurrence. Each
+ * frame is an operator, whose parenthesis is open and which is printed once
+ * its left child is. */
+static void dag_print(const DagNode *node) {
+  Walk walk;
+  walk_init(&walk);
+  const DagNode *curr = node;
+  for (;;) {
+    while (curr) {
+      if (!curr->lchild && !curr->rchild) {
+        printf(" ");
+        tok_print(curr->value);
+        printf(" ");
+        break;
+      }
+      printf("(");
+      walk_push(&walk, curr, NULL, 1);
+      curr = curr->lchild;
+    }
+    curr = NULL;
+    while (walk.length) {
+      WalkFrame *frame = &walk.frames[walk.length - 1];
+      const DagNode *parent = frame->node;
+      if (!frame->step) {
+        frame->step = 1;
+        printf(" ");
+        tok_print(parent->value);
+        printf(" ");
+        if (parent->rchild) {
+          curr = parent->rchild;
+          break;
+        }
+      }
+      printf(")");
+      walk.length--;
+    }
+    if (!curr) {
+      break;
+    }
+  }
+  walk_cleanup(&walk);
+}
+
 /* -------------------- *
  * EXPRESSION STRUCTURE *
  * -------------------- */
 
+/* pool is NULL for the static rule expressions, which are never destroyed.
+ * Shared expressions have shared and no tree. */
 struct Expression {
   Ast_Node *dummy_parent;
+  NodePool *pool;
+  Shared *shared;
 };
 
-Expression expr_create(char input[]) {
-  // Expression *p = malloc(sizeof(*p));
-  Ast_Node *ast_tree = shunting_yard(lexer(input));
+/* Everything an engine owns is built by engine_create, and only read after, so
+ * the transforms below take it as const. add and mul are cached from oprs for
+ * the transforms on them, and narys describes their chains. The first
+ * norm_static and diff_static rules are the precompiled defaults, whose
+ * expressions are static and never freed. flat holds the flattened
+ * replacements of the rest. */
+struct Engine {
+  const OprSet *oprs;
+  const Opr *add;
+  const Opr *mul;
+  Var *scalar_vars;
+  struct Simpl *simpls;
+  struct Nary *narys;
+  struct PatternRule *norm_rules;
+  struct PatternRule *denorm_rules;
+  struct PatternRule *diff_rules;
+  size_t norm_static;
+  size_t diff_static;
+  Ast_Flat *flat;
+};
+
+/* Number of tokens lexed onto the stack before expr_sy_create falls back to a
+ * heap buffer. */
+#define TOKEN_BUF_LENGTH 64
 
-  /* Give the AST root a dummy parent to simplify tree modification functions */
+/* Gives the AST root a dummy parent to simplify tree modification functions,
+ * the one of the pool entered. */
+static Expression expr_wrap(Ast_Node *ast_tree) {
   Token token;
   token.token_type = VAR;
-  token.var = '#';
-  // p->dummy_parent = ast_join(token, ast_tree, NULL);
+  token.var = VAR_ROOT;
+  Ast_Node *dummy = &node_pool->dummy;
+  *dummy = (Ast_Node){.value = token};
+  ast_attach(ast_tree, dummy);
+  Expression expr = {dummy, node_pool, NULL};
+  return expr;
+}
+
+Expression expr_create(const Engine *engine, char input[]) {
+  return expr_span_create(engine, input, input + strlen(input));
+}
+
+Expression expr_span_create(const Engine *engine, const char *s0,
+                            const char *s1) {
+  NodePool *prev = pool_enter(pool_create());
+  Ast_Node *root = pratt_parse(engine->oprs, s0, s1, 0);
+  Expression expr = {NULL, NULL, NULL};
+  if (root) {
+    expr = expr_wrap(root);
+  } else {
+    pool_destroy(node_pool);
+  }
+  pool_enter(prev);
+  return expr;
+}
+
+int expr_is_empty(Expression expr) {
+  return !expr.dummy_parent && !expr.shared;
+}
 
-  // return *p;
-  Expression expr = {ast_join(token, ast_tree, NULL)};
+static void scalar_var_apply(Ast_Node *node, void *ctx) {
+  const Engine *engine = ctx;
+  if (T_IS_VAR(node)) {
+    for (size_t i = 0; i < fp_length(engine->scalar_vars); i++) {
+      if (engine->scalar_vars[i] == T_VAR(node)) {
+        T_VAR(node) |= VAR_SCALAR;
+        ast_touch(node);
+      }
+    }
+  }
+}
+
+/* As expr_create, but every variable is a pattern variable, with VAR_SCALAR
+ * set on those the engine declares scalar. */
+static Expression patt_create(const Engine *engine, char input[]) {
+  NodePool *prev = pool_enter(pool_create());
+  Ast_Node *root = pratt_parse(engine->oprs, input, input + strlen(input), 1);
+  /* Rules are written with the program, so one which does not parse is a bug
+   * rather than bad input. */
+  assert(root);
+  Expression expr = expr_wrap(root);
+  pool_enter(prev);
+  ast_iter_apply(expr.dummy_parent->lchild, T_POST, scalar_var_apply,
+                 (void *)engine);
+  return expr;
+}
+
+/* Creates through the separate lexer and shunting yard passes, kept to test the
+ * fused parser against. */
+static Expression expr_sy_create(const Engine *engine, char input[]) {
+  Token buf[TOKEN_BUF_LENGTH];
+  Token *tokens = buf;
+  size_t length = lexer_buf(engine->oprs, input, buf, TOKEN_BUF_LENGTH);
+  if (length > TOKEN_BUF_LENGTH) {
+    tokens = malloc(length * sizeof(*tokens));
+    lexer_buf(engine->oprs, input, tokens, length);
+  }
+  NodePool *prev = pool_enter(pool_create());
+  Expression expr = expr_wrap(shunting_yard(tokens, length));
+  pool_enter(prev);
+  if (tokens != buf) {
+    free(tokens);
+  }
   return expr;
 }
 
-void expr_destroy(Expression expr) { ast_destroy(expr.dummy_parent); }
+/* Frees the pool's slabs, however many nodes are in them. */
+void expr_destroy(Expression expr) {
+  if (expr.shared) {
+    dag_release(expr.shared->dag);
+    free(expr.shared);
+  } else if (expr.pool) {
+    pool_destroy(expr.pool);
+  }
+}
 
 Ast_Node *get_root(Expression expr) { return expr.dummy_parent->lchild; }
 
+/* Returns the node of dag equal to expr, shared or not. */
+static const DagNode *dag_from_expr(Dag *dag, Expression expr) {
+  if (!expr.shared) {
+    return dag_from_ast(dag, get_root(expr));
+  }
+  MemoMap *memo = memo_create(DAG_BUCKETS_MIN);
+  const DagNode *root = dag_import(dag, expr.shared->root, memo);
+  memo_destroy(memo);
+  return root;
+}
+
+Expression expr_share(Expression expr) {
+  Expression copy = {NULL, NULL, malloc(sizeof(Shared))};
+  if (expr.shared) {
+    atomic_fetch_add(&expr.shared->dag->refs, 1);
+    *copy.shared = *expr.shared;
+  } else {
+    copy.shared->dag = dag_create();
+    copy.shared->root = dag_from_expr(copy.shared->dag, expr);
+  }
+  return copy;
+}
+
+/* Shared expressions in one table are equal if their roots are. Otherwise
+ * they are compared by moving both into one table, in time linear in their
+ * distinct subexpressions, not their size as trees. */
 int expr_is_equal(Expression expr1, Expression expr2) {
-  return ast_is_equal(expr1.dummy_parent, expr2.dummy_parent, tok_is_equal);
+  if (!expr1.shared && !expr2.shared) {
+    return ast_is_equal(expr1.dummy_parent, expr2.dummy_parent, tok_is_equal);
+  }
+  if (expr1.shared && expr2.shared && expr1.shared->dag == expr2.shared->dag) {
+    return expr1.shared->root == expr2.shared->root;
+  }
+  Dag *dag = dag_create();
+  int equal = dag_from_expr(dag, expr1) == dag_from_expr(dag, expr2);
+  dag_destroy(dag);
+  return equal;
 }
 
 Expression expr_copy(Expression expr) {
-  Ast_Node *dummy_copy = ast_copy(expr.dummy_parent);
-  return (Expression){dummy_copy};
+  if (expr.shared) {
+    return expr_share(expr);
+  }
+  NodePool *prev = pool_enter(pool_create());
+  Expression copy = expr_wrap(ast_copy(get_root(expr)));
+  pool_enter(prev);
+  return copy;
+}
+
+void expr_compact(Expression expr) {
+  if (expr.shared) {
+    shared_compact(expr.shared);
+  } else if (expr.pool) {
+    pool_compact(expr.pool);
+  }
+}
+
+/* Compacts expr once its pool is mostly nodes no longer in the tree. Shared
+ * expressions are compacted every time, as the nodes their transforms leave
+ * unreachable are never reused. */
+static void expr_compact_sparse(Expression expr) {
+  if (expr.shared) {
+    shared_compact(expr.shared);
+  } else if (expr.pool && pool_carved(expr.pool) >
+                              POOL_COMPACT_RATIO * ast_size(get_root(expr))) {
+    pool_compact(expr.pool);
+  }
 }
 
-void expr_print(Expression expr) { recursive_print(get_root(expr)); }
+void expr_print(Expression expr) {
+  if (expr.shared) {
+    dag_print(expr.shared->root);
+  } else {
+    recursive_print(get_root(expr));
+  }
+}
 
 /* ---------------------------------------- *
  * EVALUATION AND SIMPLIFICATION TRANSFORMS *
@@ -278,7 +1055,7 @@ void expr_print(Expression expr) { recursive_print(get_root(expr)); }
 
 struct CtxAll {
   int changed;
-  void *ctx_trans;
+  const void *ctx_trans;
 };
 
 static void eval_apply(Ast_Node *node, void *ctx) {
@@ -287,10 +1064,9 @@ static void eval_apply(Ast_Node *node, void *ctx) {
   if (T_IS_OPR(node)) {
     if (T_OPR(node)->arity == 1 && T_IS_SCALAR(node->lchild)) {
 
-      Scalar evaled = (T_OPR(node)->func)(&T_SCALAR(node->lchild));
       Token t;
       t.token_type = SCALAR;
-      t.scalar = evaled;
+      t.num = opr_eval(T_OPR(node), &T_NUM(node->lchild));
       Ast_Node *new = ast_leaf(t);
       ast_overwrite(node, new);
 
@@ -299,11 +1075,10 @@ static void eval_apply(Ast_Node *node, void *ctx) {
     } else if (T_OPR(node)->arity == 2 && T_IS_SCALAR(node->lchild) &&
                T_IS_SCALAR(node->rchild)) {
 
-      Scalar arr[2] = {T_SCALAR(node->lchild), T_SCALAR(node->rchild)};
-      Scalar evaled = (T_OPR(node)->func)(arr);
+      NumId arr[2] = {T_NUM(node->lchild), T_NUM(node->rchild)};
       Token t;
       t.token_type = SCALAR;
-      t.scalar = evaled;
+      t.num = opr_eval(T_OPR(node), arr);
       Ast_Node *new = ast_leaf(t);
       ast_overwrite(node, new);
 
@@ -312,53 +1087,110 @@ static void eval_apply(Ast_Node *node, void *ctx) {
   }
 }
 
+/* The transforms on shared expressions return the node to replace node with,
+ * or node itself. */
+static const DagNode *eval_dag(Dag *dag, const DagNode *node,
+                               struct CtxAll *ctx_all) {
+  if (T_IS_OPR(node)) {
+    Token t;
+    t.token_type = SCALAR;
+    if (T_OPR(node)->arity == 1 && T_IS_SCALAR(node->lchild)) {
+      t.num = opr_eval(T_OPR(node), &T_NUM(node->lchild));
+      ctx_all->changed = 1;
+      return dag_intern(dag, t, NULL, NULL);
+
+    } else if (T_OPR(node)->arity == 2 && T_IS_SCALAR(node->lchild) &&
+               T_IS_SCALAR(node->rchild)) {
+      NumId arr[2] = {T_NUM(node->lchild), T_NUM(node->rchild)};
+      t.num = opr_eval(T_OPR(node), arr);
+      ctx_all->changed = 1;
+      return dag_intern(dag, t, NULL, NULL);
+    }
+  }
+  return node;
+}
+
 #define NAME_LENGTH 16
 
 struct Simpl {
   char name[NAME_LENGTH];
-  Opr *opr;
-  Scalar x;
+  const Opr *opr;
+  NumId x;
 };
 
 static void id_apply(Ast_Node *node, void *ctx) {
   struct CtxAll *ctx_all = ctx;
-  struct Simpl *simpl = ctx_all->ctx_trans;
-  Opr *opr = simpl->opr;
-  Scalar id = simpl->x;
+  const struct Simpl *simpl = ctx_all->ctx_trans;
+  const Opr *opr = simpl->opr;
+  NumId id = simpl->x;
 
   if (T_IS_OPR(node) && T_OPR(node) == opr) {
-    if (T_IS_SCALAR(node->lchild) && T_SCALAR(node->lchild) == id) {
+    if (T_IS_SCALAR(node->lchild) && T_NUM(node->lchild) == id) {
       ast_overwrite(node, node->rchild);
       ctx_all->changed = 1;
-    } else if (T_IS_SCALAR(node->rchild) && T_SCALAR(node->rchild) == id) {
+    } else if (T_IS_SCALAR(node->rchild) && T_NUM(node->rchild) == id) {
       ast_overwrite(node, node->lchild);
       ctx_all->changed = 1;
     }
   }
 }
 
+static const DagNode *id_dag(Dag *dag, const DagNode *node,
+                             struct CtxAll *ctx_all) {
+  (void)dag;
+  const struct Simpl *simpl = ctx_all->ctx_trans;
+
+  if (T_IS_OPR(node) && T_OPR(node) == simpl->opr) {
+    if (T_IS_SCALAR(node->lchild) && T_NUM(node->lchild) == simpl->x) {
+      ctx_all->changed = 1;
+      return node->rchild;
+    } else if (T_IS_SCALAR(node->rchild) && T_NUM(node->rchild) == simpl->x) {
+      ctx_all->changed = 1;
+      return node->lchild;
+    }
+  }
+  return node;
+}
+
 static void ann_apply(Ast_Node *node, void *ctx) {
   struct CtxAll *ctx_all = ctx;
-  struct Simpl *simpl = ctx_all->ctx_trans;
-  Opr *opr = simpl->opr;
-  Scalar ann = simpl->x;
+  const struct Simpl *simpl = ctx_all->ctx_trans;
+  const Opr *opr = simpl->opr;
+  NumId ann = simpl->x;
 
   if (T_IS_OPR(node) && T_OPR(node) == opr) {
-    if (T_IS_SCALAR(node->lchild) && T_SCALAR(node->lchild) == ann) {
+    if (T_IS_SCALAR(node->lchild) && T_NUM(node->lchild) == ann) {
       ast_overwrite(node, node->lchild);
       ctx_all->changed = 1;
-    } else if (T_IS_SCALAR(node->rchild) && T_SCALAR(node->rchild) == ann) {
+    } else if (T_IS_SCALAR(node->rchild) && T_NUM(node->rchild) == ann) {
       ast_overwrite(node, node->rchild);
       ctx_all->changed = 1;
     }
   }
 }
 
+static const DagNode *ann_dag(Dag *dag, const DagNode *node,
+                              struct CtxAll *ctx_all) {
+  (void)dag;
+  const struct Simpl *simpl = ctx_all->ctx_trans;
+
+  if (T_IS_OPR(node) && T_OPR(node) == simpl->opr) {
+    if (T_IS_SCALAR(node->lchild) && T_NUM(node->lchild) == simpl->x) {
+      ctx_all->changed = 1;
+      return node->lchild;
+    } else if (T_IS_SCALAR(node->rchild) && T_NUM(node->rchild) == simpl->x) {
+      ctx_all->changed = 1;
+      return node->rchild;
+    }
+  }
+  return node;
+}
+
 /* If node and its right child are the same associative operator, rotates the
  * subtree counter-clockwise, i.e. changes a + (b + c) to (a + b) + c. */
 static void assoc_apply(Ast_Node *node, void *ctx) {
   struct CtxAll *ctx_all = ctx;
-  Opr *opr = ctx_all->ctx_trans;
+  const Opr *opr = ctx_all->ctx_trans;
 
   if (T_IS_OPR(node) && T_OPR(node) == opr && T_IS_OPR(node->rchild) &&
       T_OPR(node->rchild) == opr) {
@@ -369,77 +1201,546 @@ static void assoc_apply(Ast_Node *node, void *ctx) {
 
 /* Nodes ordered lowest-to-highest scalars, variables, operators. Scalars and
  * variables are ordered as usual. Operators are first ordered by their initial
- * character, then by the ordering of their left children. Returns 1 if
- * node1 > node2, 0 otherwise. */
-static int ast_cmp(Ast_Node *node1, Ast_Node *node2) {
+ * character, then by the ordering of their left children, and past that by
+ * operator and right children, so only equal nodes are equivalent. Returns a
+ * positive value if node1 > node2, 0 if equal and a negative value
+ * otherwise. */
+static int ast_order(const Ast_Node *node1, const Ast_Node *node2) {
   if (T_TYPE(node1) != T_TYPE(node2)) {
-    return T_TYPE(node1) > T_TYPE(node2);
+    return (T_TYPE(node1) > T_TYPE(node2)) - (T_TYPE(node1) < T_TYPE(node2));
 
   } else {
     switch (T_TYPE(node1)) {
     case SCALAR:
-      return T_SCALAR(node1) > T_SCALAR(node2);
-      break;
+      return num_cmp(T_NUM(node1), T_NUM(node2));
 
     case VAR:
-      return T_VAR(node1) > T_VAR(node2);
-      break;
+      return strcmp(var_name(T_VAR(node1)), var_name(T_VAR(node2)));
 
     case OPR:
       if (T_OPR(node1) != T_OPR(node2)) {
-        return T_OPR(node1)->repr[0] > T_OPR(node2)->repr[0];
-      } else {
-        return ast_cmp(node1->lchild, node2->lchild);
+        int order = T_OPR(node1)->repr[0] - T_OPR(node2)->repr[0];
+        return order ? order
+                     : (T_OPR(node1) > T_OPR(node2)) -
+                           (T_OPR(node1) < T_OPR(node2));
+      }
+      int order = ast_order(node1->lchild, node2->lchild);
+      if (order || !node1->rchild) {
+        return order;
+      }
+      return ast_order(node1->rchild, node2->rchild);
+    }
+  }
+}
+
+/* Pairs of right children dag_order holds on the stack before it allocates. */
+#define ORDER_INLINE 16
+
+/* As ast_order. Equal nodes are equal pointers. Left children are compared
+ * first, in a loop rather than recursively as operands may be deep, and the
+ * pairs of right children left to compare after are kept on a stack. */
+static int dag_order(const DagNode *node1, const DagNode *node2) {
+  const DagNode *inline_pairs[2 * ORDER_INLINE];
+  const DagNode **pairs = inline_pairs;
+  size_t length = 0;
+  size_t cap = 2 * ORDER_INLINE;
+  int order = 0;
+  for (;;) {
+    if (node1 == node2) {
+      order = 0;
+    } else if (T_TYPE(node1) != T_TYPE(node2)) {
+      order = (T_TYPE(node1) > T_TYPE(node2)) - (T_TYPE(node1) < T_TYPE(node2));
+    } else if (T_TYPE(node1) == SCALAR) {
+      order = num_cmp(T_NUM(node1), T_NUM(node2));
+    } else if (T_TYPE(node1) == VAR) {
+      order = strcmp(var_name(T_VAR(node1)), var_name(T_VAR(node2)));
+    } else if (T_OPR(node1) != T_OPR(node2)) {
+      order = T_OPR(node1)->repr[0] - T_OPR(node2)->repr[0];
+      order = order ? order
+                    : (T_OPR(node1) > T_OPR(node2)) -
+                          (T_OPR(node1) < T_OPR(node2));
+    } else {
+      if (node1->rchild) {
+        if (length == cap) {
+          const DagNode **grown = malloc(2 * cap * sizeof(*grown));
+          memcpy(grown, pairs, length * sizeof(*grown));
+          if (pairs != inline_pairs) {
+            free(pairs);
+          }
+          pairs = grown;
+          cap *= 2;
+        }
+        pairs[length++] = node2->rchild;
+        pairs[length++] = node1->rchild;
       }
+      node1 = node1->lchild;
+      node2 = node2->lchild;
+      continue;
+    }
+    if (order || !length) {
       break;
     }
+    node1 = pairs[--length];
+    node2 = pairs[--length];
   }
+  if (pairs != inline_pairs) {
+    free(pairs);
+  }
+  return order;
 }
 
-/* Exchange sort between the right child of node and the left child or left
- * child of left child. In essence a bubble sort pass. Becomes a bubble sort
- * when iteratively applied by expr_it_apply and norm_apply. */
-static void order_apply(Ast_Node *node, void *ctx) {
-  struct CtxAll *ctx_all = ctx;
-  Opr *opr = ctx_all->ctx_trans;
+/* --------------- *
+ * N-ARY OPERATORS *
+ * --------------- */
+
+/* A chain is a maximal subtree of one associative operator, read as the n-ary
+ * node it stands for: its operands in order, flattened out of however the
+ * binary nodes nest. nary_apply normalises a chain in one pass over its
+ * operands: it combines like operands, e.g. x + 2 * x + x to 4 * x, sorts
+ * them in the order of ast_order and rebuilds the chain leaning left, e.g.
+ * ((a + b) + c) + d. This is what assoc_apply, a bubble sort of exchanges
+ * between neighbours and the rules on pairs took as many passes as operands
+ * for.
+ *
+ * Chains are not a kind of node: nodes stay binary, as patterns, the rule
+ * tables and printing match on two children, and each pass gathers a chain
+ * again. Nor is differentiation n-ary: the sum and product rules rewrite one
+ * binary node at a time. In pre-order, a sum is still split in a single
+ * pass, each rewrite leaving the rest of the chain under the next x'. */
+struct Nary {
+  const Opr *opr;
+  /* The operator an operand repeated a positive integer count of times is
+   * written with, e.g. * for + and ^ for *, and whether the count is its left
+   * operand. */
+  const Opr *repeat;
+  int count_left;
+};
 
-  if (T_IS_OPR(node) && T_OPR(node) == opr) {
+static int nary_is(const Opr *opr, Token value) {
+  return value.token_type == OPR && tok_opr(value) == opr;
+}
+
+/* Returns the count value is if it is a positive integer, otherwise 0. */
+static int64_t nary_count(Token value) {
+  if (value.token_type != SCALAR) {
+    return 0;
+  }
+  const Number *n = num_get(value.num);
+  return n->kind == NUM_RAT && n->rat.den == 1 && n->rat.num > 0 ? n->rat.num
+                                                                : 0;
+}
+
+/* An operand, as the base it repeats count times, which is node itself if
+ * count is 1 and node is not a repeat, and its index in the chain. */
+typedef struct {
+  Ast_Node *node;
+  Ast_Node *base;
+  int64_t count;
+  size_t index;
+} Operand;
+
+/* The operands of a chain, held inline unless it is unusually long. */
+#define CHAIN_INLINE 32
+
+typedef struct {
+  size_t length;
+  size_t cap;
+  Operand *operands;
+  Operand inline_operands[CHAIN_INLINE];
+} Chain;
+
+static void chain_init(Chain *chain) {
+  chain->length = 0;
+  chain->cap = CHAIN_INLINE;
+  chain->operands = chain->inline_operands;
+}
+
+static void chain_cleanup(Chain *chain) {
+  if (chain->operands != chain->inline_operands) {
+    free(chain->operands);
+  }
+}
 
-    if (T_IS_OPR(node->lchild) && T_OPR(node->lchild) == opr) {
+static void chain_push(Chain *chain, Operand operand) {
+  if (chain->length == chain->cap) {
+    Operand *operands = malloc(2 * chain->cap * sizeof(*operands));
+    memcpy(operands, chain->operands, chain->length * sizeof(*operands));
+    chain_cleanup(chain);
+    chain->operands = operands;
+    chain->cap *= 2;
+  }
+  chain->operands[chain->length++] = operand;
+}
+
+static Operand operand_create(const struct Nary *nary, Ast_Node *node,
+                              size_t index) {
+  if (nary_is(nary->repeat, node->value)) {
+    Ast_Node *k = nary->count_left ? node->lchild : node->rchild;
+    int64_t count = nary_count(k->value);
+    if (count) {
+      return (Operand){node, nary->count_left ? node->rchild : node->lchild,
+                       count, index};
+    }
+  }
+  return (Operand){node, node, 1, index};
+}
+
+/* Pushes the operands of the chain at node in order. Returns 1 if the chain
+ * already leans left. Walks down left spines, stacking the right sub-chains
+ * met on the way, as chains can be far deeper than the call stack. */
+static int chain_gather(const struct Nary *nary, Ast_Node *node,
+                        Chain *chain) {
+  Ast_Node **rights = NULL;
+  int left = 1;
+  for (;;) {
+    while (nary_is(nary->opr, node->value)) {
+      left &= !nary_is(nary->opr, node->rchild->value);
+      fp_push(node->rchild, rights);
+      node = node->lchild;
+    }
+    chain_push(chain, operand_create(nary, node, chain->length));
+    if (!fp_length(rights)) {
+      break;
+    }
+    node = fp_pop(rights);
+  }
+  fp_destroy(rights);
+  return left;
+}
+
+static int operand_order(const Operand *a, const Operand *b, int by_base) {
+  return by_base ? ast_order(a->base, b->base) : ast_order(a->node, b->node);
+}
+
+/* Sorts by base or by operand with a bottom up merge sort, which is stable, so
+ * the result is the one a bubble sort of exchanges between neighbours would
+ * reach, in n log n comparisons for however long the chain is. */
+static void chain_sort(Chain *chain, int by_base) {
+  size_t n = chain->length;
+  Operand inline_scratch[CHAIN_INLINE];
+  Operand *scratch =
+      n <= CHAIN_INLINE ? inline_scratch : malloc(n * sizeof(*scratch));
+  Operand *src = chain->operands;
+  Operand *dst = scratch;
+  for (size_t width = 1; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        dst[k++] = operand_order(&src[j], &src[i], by_base) < 0 ? src[j++]
+                                                                 : src[i++];
+      }
+      while (i < mid) {
+        dst[k++] = src[i++];
+      }
+      while (j < hi) {
+        dst[k++] = src[j++];
+      }
+    }
+    Operand *temp = src;
+    src = dst;
+    dst = temp;
+  }
+  if (src != chain->operands) {
+    memcpy(chain->operands, src, n * sizeof(*src));
+  }
+  if (scratch != inline_scratch) {
+    free(scratch);
+  }
+}
+
+/* Returns the end of the run of like operands from i in the chain, sorted by
+ * base, and outputs the sum of their counts, or 0 if it overflows, as a run
+ * whose count does not fit is left uncombined. */
+static size_t chain_run(const Chain *chain, size_t i, int64_t *count) {
+  const Operand *first = &chain->operands[i];
+  *count = first->count;
+  size_t j = i + 1;
+  for (; j < chain->length &&
+         ast_is_equal(first->base, chain->operands[j].base, tok_is_equal);
+       j++) {
+    if (*count &&
+        __builtin_add_overflow(*count, chain->operands[j].count, count)) {
+      *count = 0;
+    }
+  }
+  return j;
+}
 
-      /* if the first node is greater than the second in the described order */
-      if (ast_cmp(node->lchild->rchild, node->rchild)) {
-        ast_swap(node->lchild->rchild, node->rchild);
+/* Returns 1 if the chain, sorted by base, has like operands to combine. */
+static int chain_has_like(const Chain *chain) {
+  int64_t count;
+  for (size_t i = 0, j; i < chain->length; i = j) {
+    j = chain_run(chain, i, &count);
+    if (j - i > 1 && count) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-        ctx_all->changed = 1;
+/* Replaces each run of like, detached operands with one repeat of their base,
+ * freeing the rest. */
+static void chain_combine(Chain *chain, const struct Nary *nary) {
+  size_t length = 0;
+  int64_t count;
+  for (size_t i = 0, j; i < chain->length; i = j) {
+    j = chain_run(chain, i, &count);
+    if (j - i == 1 || !count) {
+      for (size_t k = i; k < j; k++) {
+        chain->operands[length++] = chain->operands[k];
       }
+      continue;
+    }
+    Operand *first = &chain->operands[i];
+    for (size_t k = i + 1; k < j; k++) {
+      ast_destroy(chain->operands[k].node);
+    }
+    if (first->base != first->node) {
+      ast_detach(first->base);
+      ast_destroy(first->node);
+    }
+    Token r = {.token_type = OPR, .opr_id = opr_id(nary->repeat)};
+    Ast_Node *k = ast_leaf((Token){.token_type = SCALAR,
+                                   .num = num_from_int(count)});
+    first->node = nary->count_left ? ast_join(r, k, first->base)
+                                   : ast_join(r, first->base, k);
+    chain->operands[length++] = *first;
+  }
+  chain->length = length;
+}
+
+/* Normalises the chain at node if node is its top. Applied in pre-order, so
+ * every chain is normalised from its top. */
+static void nary_apply(Ast_Node *node, void *ctx) {
+  struct CtxAll *ctx_all = ctx;
+  const struct Nary *nary = ctx_all->ctx_trans;
+
+  if (!nary_is(nary->opr, node->value) ||
+      nary_is(nary->opr, node->parent->value)) {
+    return;
+  }
+
+  Chain chain;
+  chain_init(&chain);
+  int left = chain_gather(nary, node, &chain);
+  chain_sort(&chain, 1);
+  int like = chain_has_like(&chain);
+  chain_sort(&chain, 0);
+  int moved = 0;
+  for (size_t i = 0; i < chain.length; i++) {
+    moved |= chain.operands[i].index != i;
+  }
+  if (moved || !left || like) {
+    for (size_t i = 0; i < chain.length; i++) {
+      ast_detach(chain.operands[i].node);
+    }
+    /* Only operator nodes of the chain are left below node. */
+    Ast_Node *temp;
+    if ((temp = node->lchild)) {
+      ast_detach(temp);
+      ast_destroy(temp);
+    }
+    if ((temp = node->rchild)) {
+      ast_detach(temp);
+      ast_destroy(temp);
+    }
+    if (like) {
+      chain_sort(&chain, 1);
+      chain_combine(&chain, nary);
+      chain_sort(&chain, 0);
+    }
+
+    Ast_Node *acc = chain.operands[0].node;
+    for (size_t i = 1; i + 1 < chain.length; i++) {
+      acc = ast_join(node->value, acc, chain.operands[i].node);
+    }
+    if (chain.length > 1) {
+      ast_attach(acc, node);
+      ast_attach(chain.operands[chain.length - 1].node, node);
     } else {
-      if (ast_cmp(node->lchild, node->rchild)) {
-        ast_swap(node->lchild, node->rchild);
+      ast_overwrite(node, acc);
+    }
+    ctx_all->changed = 1;
+  }
+  chain_cleanup(&chain);
+}
+
+/* As Operand and Chain. */
+typedef struct {
+  const DagNode *node;
+  const DagNode *base;
+  int64_t count;
+} DagOperand;
+
+typedef struct {
+  size_t length;
+  size_t cap;
+  DagOperand *operands;
+  DagOperand inline_operands[CHAIN_INLINE];
+} DagChain;
+
+static void dag_chain_init(DagChain *chain) {
+  chain->length = 0;
+  chain->cap = CHAIN_INLINE;
+  chain->operands = chain->inline_operands;
+}
 
-        ctx_all->changed = 1;
+static void dag_chain_cleanup(DagChain *chain) {
+  if (chain->operands != chain->inline_operands) {
+    free(chain->operands);
+  }
+}
+
+static void dag_chain_push(DagChain *chain, DagOperand operand) {
+  if (chain->length == chain->cap) {
+    DagOperand *operands = malloc(2 * chain->cap * sizeof(*operands));
+    memcpy(operands, chain->operands, chain->length * sizeof(*operands));
+    dag_chain_cleanup(chain);
+    chain->operands = operands;
+    chain->cap *= 2;
+  }
+  chain->operands[chain->length++] = operand;
+}
+
+static DagOperand dag_operand_create(const struct Nary *nary,
+                                     const DagNode *node) {
+  if (nary_is(nary->repeat, node->value)) {
+    const DagNode *k = nary->count_left ? node->lchild : node->rchild;
+    int64_t count = nary_count(k->value);
+    if (count) {
+      return (DagOperand){
+          node, nary->count_left ? node->rchild : node->lchild, count};
+    }
+  }
+  return (DagOperand){node, node, 1};
+}
+
+static void dag_chain_gather(const struct Nary *nary, const DagNode *node,
+                             DagChain *chain) {
+  const DagNode **rights = NULL;
+  for (;;) {
+    while (nary_is(nary->opr, node->value)) {
+      fp_push(node->rchild, rights);
+      node = node->lchild;
+    }
+    dag_chain_push(chain, dag_operand_create(nary, node));
+    if (!fp_length(rights)) {
+      break;
+    }
+    node = fp_pop(rights);
+  }
+  fp_destroy(rights);
+}
+
+static int dag_operand_order(const DagOperand *a, const DagOperand *b,
+                             int by_base) {
+  return by_base ? dag_order(a->base, b->base) : dag_order(a->node, b->node);
+}
+
+static void dag_chain_sort(DagChain *chain, int by_base) {
+  size_t n = chain->length;
+  DagOperand inline_scratch[CHAIN_INLINE];
+  DagOperand *scratch =
+      n <= CHAIN_INLINE ? inline_scratch : malloc(n * sizeof(*scratch));
+  DagOperand *src = chain->operands;
+  DagOperand *dst = scratch;
+  for (size_t width = 1; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        dst[k++] = dag_operand_order(&src[j], &src[i], by_base) < 0
+                       ? src[j++]
+                       : src[i++];
+      }
+      while (i < mid) {
+        dst[k++] = src[i++];
+      }
+      while (j < hi) {
+        dst[k++] = src[j++];
+      }
+    }
+    DagOperand *temp = src;
+    src = dst;
+    dst = temp;
+  }
+  if (src != chain->operands) {
+    memcpy(chain->operands, src, n * sizeof(*src));
+  }
+  if (scratch != inline_scratch) {
+    free(scratch);
+  }
+}
+
+/* As chain_run. Like operands have equal bases, which are equal pointers. */
+static size_t dag_chain_run(const DagChain *chain, size_t i, int64_t *count) {
+  const DagOperand *first = &chain->operands[i];
+  *count = first->count;
+  size_t j = i + 1;
+  for (; j < chain->length && chain->operands[j].base == first->base; j++) {
+    if (*count &&
+        __builtin_add_overflow(*count, chain->operands[j].count, count)) {
+      *count = 0;
+    }
+  }
+  return j;
+}
+
+static void dag_chain_combine(Dag *dag, DagChain *chain,
+                              const struct Nary *nary) {
+  size_t length = 0;
+  int64_t count;
+  for (size_t i = 0, j; i < chain->length; i = j) {
+    j = dag_chain_run(chain, i, &count);
+    if (j - i == 1 || !count) {
+      for (size_t k = i; k < j; k++) {
+        chain->operands[length++] = chain->operands[k];
       }
+      continue;
     }
+    DagOperand *first = &chain->operands[i];
+    Token r = {.token_type = OPR, .opr_id = opr_id(nary->repeat)};
+    const DagNode *k = dag_intern(
+        dag, (Token){.token_type = SCALAR, .num = num_from_int(count)}, NULL,
+        NULL);
+    first->node = nary->count_left ? dag_intern(dag, r, k, first->base)
+                                   : dag_intern(dag, r, first->base, k);
+    chain->operands[length++] = *first;
   }
+  chain->length = length;
 }
 
-/* TODO: Implement whole bubble sort in one function. */
-static void order_2_apply(Ast_Node *root, void *ctx) {
-  // struct CtxAll *ctx_all = ctx;
-  // Opr *opr = ctx_all->ctx_trans;
-  //
-  // while (1) {
-  //   int swapped = 0;
-  //   while (1) {
-  //
-  //     ;
-  //   };
-  // }
+/* Without parents to find the top of a chain by, normalises the chain at each
+ * of its nodes. Applied in pre-order, the top is first, and the nodes below it
+ * are then normal already, as the order is total, and left unchanged. */
+static const DagNode *nary_dag(Dag *dag, const DagNode *node,
+                               struct CtxAll *ctx_all) {
+  const struct Nary *nary = ctx_all->ctx_trans;
+
+  if (!nary_is(nary->opr, node->value)) {
+    return node;
+  }
+  DagChain chain;
+  dag_chain_init(&chain);
+  dag_chain_gather(nary, node, &chain);
+  dag_chain_sort(&chain, 1);
+  dag_chain_combine(dag, &chain, nary);
+  dag_chain_sort(&chain, 0);
+  const DagNode *acc = chain.operands[0].node;
+  for (size_t i = 1; i < chain.length; i++) {
+    acc = dag_intern(dag, node->value, acc, chain.operands[i].node);
+  }
+  dag_chain_cleanup(&chain);
+  ctx_all->changed |= acc != node;
+  return acc;
 }
 
 static void qwe(Ast_Node *node, void *ctx) {
   struct CtxAll *ctx_all = ctx;
-  Opr *opr = ctx_all->ctx_trans;
+  const Opr *opr = ctx_all->ctx_trans;
 
   if (T_IS_OPR(node) && T_OPR(node) == opr) {
     ;
@@ -450,49 +1751,105 @@ static void qwe(Ast_Node *node, void *ctx) {
  * PATTERN MATCHING TRANSFORMS *
  * --------------------------- */
 
+/* The replacement is also kept flattened, at flat_root in flat, as every match
+ * copies it out, and a flat is read in one pass over contiguous arrays. */
 struct PatternRule {
   char name[NAME_LENGTH];
   Expression pattern;
   Expression replacement;
+  const Ast_Flat *flat;
+  uint32_t flat_root;
 };
 
-/* Instantiate a associative array to store variable-node bindings. */
+/* Instantiate a associative array to store variable-node bindings. Pattern
+ * variable ids are dense, so their low bits hash them. */
 #define DPX_KT Var
 #define DPX_VT Ast_Node *
 #define DPX_PFX bind
 #define DPX_STRUCT_PFX Bind
+#define DPX_HASH(var) ((size_t)(var))
 #include "dpx.h"
 
-static int var_match(Var x, const Ast_Node *node) {
-  switch (x) {
-  case 'c':
-    return T_IS_SCALAR(node);
-  default:
-    return 1;
+/* The variable-node bindings of a match, which live on the matcher's stack.
+ * Patterns rarely have more than a few variables, so the first BIND_INLINE
+ * bindings are held inline and scanned, and only further ones spill into a
+ * map, so a match allocates nothing unless a pattern is unusually large. */
+#define BIND_INLINE 8
+
+typedef struct {
+  size_t length;
+  Var vars[BIND_INLINE];
+  Ast_Node *nodes[BIND_INLINE];
+  BindMap *spill;
+} Bindings;
+
+static void bindings_init(Bindings *bindings) {
+  bindings->length = 0;
+  bindings->spill = NULL;
+}
+
+static void bindings_cleanup(Bindings *bindings) {
+  if (bindings->spill) {
+    bind_destroy(bindings->spill);
+  }
+}
+
+/* Returns the address of the node bound to var, or NULL. */
+static Ast_Node **bindings_get(Bindings *bindings, Var var) {
+  for (size_t i = 0; i < bindings->length; i++) {
+    if (bindings->vars[i] == var) {
+      return &bindings->nodes[i];
+    }
   }
+  return bindings->spill ? bind_addr(var, bindings->spill) : NULL;
+}
+
+/* As bind_find_add. */
+static Ast_Node **bindings_find_add(Bindings *bindings, Var var,
+                                    Ast_Node *node, int *added) {
+  Ast_Node **bound = bindings_get(bindings, var);
+  *added = !bound;
+  if (bound) {
+    return bound;
+  }
+  if (bindings->length < BIND_INLINE) {
+    bindings->vars[bindings->length] = var;
+    bindings->nodes[bindings->length] = node;
+    return &bindings->nodes[bindings->length++];
+  }
+  if (!bindings->spill) {
+    bindings->spill = bind_create(BIND_INLINE);
+  }
+  return bind_find_add(var, node, bindings->spill, added);
+}
+
+static int var_match(Var x, const Ast_Node *node) {
+  return !(x & VAR_SCALAR) || T_IS_SCALAR(node);
 }
 
 /* Attempts to match the value of patt to the given node. If patt->value is a
- * a variable, binds it to the node and adds it to the list of bindings. */
-static int patt_match(const Ast_Node *patt, Ast_Node *node, BindMap *bindings) {
+ * a pattern variable, binds it to the node and adds it to the list of bindings.
+ * Any other variable only matches itself. */
+static int patt_match(const Ast_Node *patt, Ast_Node *node,
+                      Bindings *bindings) {
   switch (T_TYPE(patt)) {
 
   case SCALAR:
-    return T_SCALAR(patt) == T_SCALAR(node);
+    return T_IS_SCALAR(node) && T_NUM(patt) == T_NUM(node);
     break;
 
   case VAR:
+    if (!var_is_pattern(T_VAR(patt))) {
+      return T_IS_VAR(node) && T_VAR(patt) == T_VAR(node);
+    }
     if (var_match(T_VAR(patt), node)) {
 
-      /* Check if variable already bound, and if bound AST differs from node
-       */
-      if (bind_is_in(T_VAR(patt), bindings)) {
-        return ast_is_equal(bind_get(T_VAR(patt), bindings), node,
-                            tok_is_equal);
-      } else {
-        bind_add(T_VAR(patt), node, bindings);
-        return 1;
-      }
+      /* Bind the variable, or if already bound check the bound AST is equal
+       * to node, which their cached hashes settle at once unless it is. */
+      int added;
+      Ast_Node **bound =
+          bindings_find_add(bindings, T_VAR(patt), node, &added);
+      return added || ast_is_equal(*bound, node, tok_is_equal);
 
     } else {
       return 0;
@@ -505,105 +1862,228 @@ static int patt_match(const Ast_Node *patt, Ast_Node *node, BindMap *bindings) {
   }
 }
 
-/* Attempts to match the entire pattern to the expression rooted at ast_expr.
- * Adds bindings if any to bindings. */
-static int match(Ast_Node *pattern, Ast_Node *ast_expr, BindMap *bindings) {
-  int matched = 1;
+/* Attempts to match the entire pattern to the expression rooted at node.
+ * Adds bindings if any to bindings. Walks the pattern and expression together,
+ * recursing on the pattern, which is only a few levels deep. */
+static int match(const Ast_Node *pattern, Ast_Node *node, Bindings *bindings) {
+  if (!patt_match(pattern, node, bindings)) {
+    return 0;
+  }
+  if (pattern->lchild) {
+    if (!node->lchild || !match(pattern->lchild, node->lchild, bindings)) {
+      return 0;
+    }
+  }
+  if (pattern->rchild) {
+    if (!node->rchild || !match(pattern->rchild, node->rchild, bindings)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Allocates only once the pattern has matched, to build the replacement. The
+ * bound subtrees, which overwriting node would free, are detached and moved
+ * into the first place the replacement uses them, and only copied for any
+ * further, so a rewrite allocates just the nodes of the replacement itself.
+ * A detached subtree is still to be moved while it has no parent, and those
+ * the replacement does not use are freed after. Patterns whose root is a
+ * variable, or with bindings spilled out of line, copy every subtree. */
+static void match_apply(Ast_Node *node, void *ctx) {
+  struct CtxAll *ctx_all = ctx;
+  const struct PatternRule *rule = ctx_all->ctx_trans;
+  Ast_Node *pattern = get_root(rule->pattern);
+
+  Bindings bindings;
+  bindings_init(&bindings);
 
-  Ast_Iter *it = ast_iter_create(pattern, T_PRE);
-  Ast_Node *patt_node = ast_start(it);
-  Ast_Node *expr_node = ast_expr;
+  if (match(pattern, node, &bindings)) {
 
-  /* Walks the pattern tree. Uses the direction of the pattern tree iterator
-   * to walk the expression tree. */
-  while (!ast_end(it)) {
-    if (!patt_match(patt_node, expr_node, bindings)) {
-      matched = 0;
-      break;
+    Ast_Node *replacement = ast_flat_to_nodes(rule->flat, rule->flat_root);
+
+    int move = !bindings.spill && !T_IS_VAR(pattern);
+    for (size_t i = 0; move && i < bindings.length; i++) {
+      ast_detach(bindings.nodes[i]);
     }
-    patt_node = ast_traverse(it);
-    switch (it->dir) {
 
-    case LPARENT:
-      if (expr_node->lchild) {
-        expr_node = expr_node->lchild;
-      } else {
-        matched = 0;
-        goto loop_exit;
+    Ast_Iter it;
+    ast_iter_init(&it, replacement, T_POST);
+    for (Ast_Node *repl_node = ast_begin(&it); !ast_end(&it);
+         repl_node = ast_next(&it)) {
+      Ast_Node **bound = T_IS_VAR(repl_node)
+                             ? bindings_get(&bindings, T_VAR(repl_node))
+                             : NULL;
+      if (bound && move && !(*bound)->parent && *bound != replacement) {
+        ast_overwrite(repl_node, *bound);
+        *bound = repl_node;
+      } else if (bound) {
+        ast_overwrite(repl_node, ast_copy(*bound));
       }
-      break;
-
-    case RPARENT:
-      if (expr_node->rchild) {
-        expr_node = expr_node->rchild;
-      } else {
-        matched = 0;
-        goto loop_exit;
+    }
+    for (size_t i = 0; move && i < bindings.length; i++) {
+      if (!bindings.nodes[i]->parent && bindings.nodes[i] != replacement) {
+        ast_destroy(bindings.nodes[i]);
       }
-      break;
-
-    case LCHILD:
-    case RCHILD:
-      /* Should not need to check for parent's existence; loop should end
-       * right after it->head returns to pattern root. */
-      expr_node = expr_node->parent;
-      break;
     }
+    /* What is left of the subtree at node, including any originals of bound
+     * subtrees which were copied, is freed upon overwriting. */
+    ast_overwrite(node, replacement);
+    ctx_all->changed = 1;
   }
+  bindings_cleanup(&bindings);
+}
+
+/* The bindings of a match in a shared expression, as Bindings. */
+#define DPX_KT Var
+#define DPX_VT const DagNode *
+#define DPX_PFX dag_bind
+#define DPX_STRUCT_PFX DagBind
+#define DPX_HASH(var) ((size_t)(var))
+#include "dpx.h"
+
+typedef struct {
+  size_t length;
+  Var vars[BIND_INLINE];
+  const DagNode *nodes[BIND_INLINE];
+  DagBindMap *spill;
+} DagBindings;
 
-loop_exit:
-  free(it);
-  return matched;
+static void dag_bindings_init(DagBindings *bindings) {
+  bindings->length = 0;
+  bindings->spill = NULL;
 }
 
-static void match_apply(Ast_Node *node, void *ctx) {
-  struct CtxAll *ctx_all = ctx;
-  struct PatternRule *rule = ctx_all->ctx_trans;
-  Ast_Node *pattern = get_root(rule->pattern);
+static void dag_bindings_cleanup(DagBindings *bindings) {
+  if (bindings->spill) {
+    dag_bind_destroy(bindings->spill);
+  }
+}
 
-  BindMap *bindings = bind_create(1);
+static const DagNode **dag_bindings_get(DagBindings *bindings, Var var) {
+  for (size_t i = 0; i < bindings->length; i++) {
+    if (bindings->vars[i] == var) {
+      return &bindings->nodes[i];
+    }
+  }
+  return bindings->spill ? dag_bind_addr(var, bindings->spill) : NULL;
+}
 
-  if (match(pattern, node, bindings)) {
+static const DagNode **dag_bindings_find_add(DagBindings *bindings, Var var,
+                                             const DagNode *node, int *added) {
+  const DagNode **bound = dag_bindings_get(bindings, var);
+  *added = !bound;
+  if (bound) {
+    return bound;
+  }
+  if (bindings->length < BIND_INLINE) {
+    bindings->vars[bindings->length] = var;
+    bindings->nodes[bindings->length] = node;
+    return &bindings->nodes[bindings->length++];
+  }
+  if (!bindings->spill) {
+    bindings->spill = dag_bind_create(BIND_INLINE);
+  }
+  return dag_bind_find_add(var, node, bindings->spill, added);
+}
 
-    Ast_Node *replacement = ast_copy(get_root(rule->replacement));
+/* As patt_match, where a variable bound again only matches the same node. */
+static int dag_patt_match(const Ast_Node *patt, const DagNode *node,
+                          DagBindings *bindings) {
+  switch (T_TYPE(patt)) {
+  case SCALAR:
+    return T_IS_SCALAR(node) && T_NUM(patt) == T_NUM(node);
+  case VAR:
+    if (!var_is_pattern(T_VAR(patt))) {
+      return T_IS_VAR(node) && T_VAR(patt) == T_VAR(node);
+    }
+    if ((T_VAR(patt) & VAR_SCALAR) && !T_IS_SCALAR(node)) {
+      return 0;
+    }
+    int added;
+    const DagNode **bound =
+        dag_bindings_find_add(bindings, T_VAR(patt), node, &added);
+    return added || *bound == node;
+  case OPR:
+    return T_OPR(patt) == T_OPR(node);
+  }
+}
 
-    Ast_Iter *it = ast_iter_create(replacement, T_POST);
-    for (Ast_Node *repl_node = ast_begin(it); !ast_end(it);
-         repl_node = ast_next(it)) {
-      if (T_IS_VAR(repl_node) && bind_is_in(T_VAR(repl_node), bindings)) {
-        Ast_Node *bound_node = ast_copy(bind_get(T_VAR(repl_node), bindings));
-        ast_overwrite(repl_node, bound_node);
-      }
+static int dag_match(const Ast_Node *pattern, const DagNode *node,
+                     DagBindings *bindings) {
+  if (!dag_patt_match(pattern, node, bindings)) {
+    return 0;
+  }
+  if (pattern->lchild) {
+    if (!node->lchild || !dag_match(pattern->lchild, node->lchild, bindings)) {
+      return 0;
     }
-    free(it);
-	/* The old node should contain the originals of the bound subtrees, which will
-	 * all be freed upon overwriting. Hence the values in the bindings map become
-	 * invalid and do not need to be freed again. */
-    ast_overwrite(node, replacement);
+  }
+  if (pattern->rchild) {
+    if (!node->rchild || !dag_match(pattern->rchild, node->rchild, bindings)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns the node of the tree at i in flat, with every bound variable in it
+ * replaced by the node bound to it, which is shared rather than copied. */
+static const DagNode *dag_instantiate(Dag *dag, const Ast_Flat *flat,
+                                      uint32_t i, DagBindings *bindings) {
+  Token value = flat->values[i];
+  if (value.token_type == VAR) {
+    const DagNode **bound = dag_bindings_get(bindings, value.var);
+    if (bound) {
+      return *bound;
+    }
+  }
+  T_Links links = flat->links[i];
+  const DagNode *lchild =
+      links.lchild != T_NONE
+          ? dag_instantiate(dag, flat, links.lchild, bindings)
+          : NULL;
+  const DagNode *rchild =
+      links.rchild != T_NONE
+          ? dag_instantiate(dag, flat, links.rchild, bindings)
+          : NULL;
+  return dag_intern(dag, value, lchild, rchild);
+}
+
+static const DagNode *match_dag(Dag *dag, const DagNode *node,
+                                struct CtxAll *ctx_all) {
+  const struct PatternRule *rule = ctx_all->ctx_trans;
+
+  DagBindings bindings;
+  dag_bindings_init(&bindings);
+  if (dag_match(get_root(rule->pattern), node, &bindings)) {
+    node = dag_instantiate(dag, rule->flat, rule->flat_root, &bindings);
     ctx_all->changed = 1;
   }
-  bind_destroy(bindings);
+  dag_bindings_cleanup(&bindings);
+  return node;
 }
 
 /* ------------------------ *
  * TRANSFORM INITIALISATION *
  * ------------------------ */
 
-struct Simpl *simpls = NULL;
-
-/* Normalisation rules to convert expression into more readily modified form. */
-struct PatternRule *norm_rules = NULL;
-
-/* Denomralisation rules to convert expression into more human readable form. */
-struct PatternRule *denorm_rules = NULL;
-struct PatternRule *diff_rules = NULL;
+static void rule_flatten(Engine *engine, struct PatternRule *rule) {
+  if (!engine->flat) {
+    engine->flat = ast_flat_create(64);
+  }
+  rule->flat = engine->flat;
+  rule->flat_root =
+      ast_flat_from_nodes(engine->flat, get_root(rule->replacement));
+}
 
-static struct PatternRule rule_create(const char name[], char pattern[],
-                                      char replacement[]) {
+static struct PatternRule rule_create(Engine *engine, const char name[],
+                                      char pattern[], char replacement[]) {
   struct PatternRule rule;
-  strncpy(rule.name, name, NAME_LENGTH);
-  rule.pattern = expr_create(pattern);
-  rule.replacement = expr_create(replacement);
+  strncpy(rule.name, name, NAME_LENGTH - 1);
+  rule.name[NAME_LENGTH - 1] = '\0';
+  rule.pattern = patt_create(engine, pattern);
+  rule.replacement = patt_create(engine, replacement);
+  rule_flatten(engine, &rule);
   return rule;
 }
 
@@ -612,85 +2092,164 @@ static void rule_cleanup(struct PatternRule rule) {
   expr_destroy(rule.replacement);
 }
 
-static struct PatternRule rule_inverse(struct PatternRule *rule) {
+static struct PatternRule rule_inverse(Engine *engine,
+                                       struct PatternRule *rule) {
   struct PatternRule inverse_rule;
-  strncpy(inverse_rule.name, "i_", 2);
+  memcpy(inverse_rule.name, "i_", 2);
   strncpy(inverse_rule.name + 2, rule->name, NAME_LENGTH - 2);
   inverse_rule.name[NAME_LENGTH - 1] = '\0';
   inverse_rule.pattern = rule->replacement;
   inverse_rule.replacement = rule->pattern;
+  rule_flatten(engine, &inverse_rule);
   return inverse_rule;
 }
 
-static struct Simpl simpl_create(const char name[], Opr *opr, Scalar x) {
+static struct Simpl simpl_create(const char name[], const Opr *opr, NumId x) {
   struct Simpl simpl;
-  strncpy(simpl.name, name, NAME_LENGTH);
+  strncpy(simpl.name, name, NAME_LENGTH - 1);
+  simpl.name[NAME_LENGTH - 1] = '\0';
   simpl.opr = opr;
   simpl.x = x;
   return simpl;
 }
 
-void simpls_init(void) {
-  fp_push(simpl_create("add id", opr_get("+"), 0), simpls);
-  fp_push(simpl_create("mul id", opr_get("*"), 1), simpls);
-  fp_push(simpl_create("mul ann", opr_get("*"), 0), simpls);
+static void simpls_init(Engine *engine) {
+  fp_push(simpl_create("add id", engine->add, num_from_int(0)),
+          engine->simpls);
+  fp_push(simpl_create("mul id", engine->mul, num_from_int(1)),
+          engine->simpls);
+  fp_push(simpl_create("mul ann", engine->mul, num_from_int(0)),
+          engine->simpls);
 }
 
-void norm_rules_init(void) {
+/* Sums of a repeated term become products, and products of a repeated factor
+ * powers, as x+x = 2*x and x*x = x^2 do for two. */
+static void narys_init(Engine *engine) {
+  fp_push(((struct Nary){engine->add, engine->mul, 1}), engine->narys);
+  fp_push(((struct Nary){engine->mul, opr_get("^"), 0}), engine->narys);
+}
 
-  fp_push(rule_create("- to +", "f - g", "f + -1 * g"), norm_rules);
-  fp_push(rule_create("/ to *", "f / g", "f * g ^ -1"), norm_rules);
+/* Normalisation rules to convert expression into more readily modified form. */
+static void norm_rules_init(Engine *engine) {
+  engine_add_rule(engine, RULES_NORM, "- to +", "f - g", "f + -1 * g");
+  engine_add_rule(engine, RULES_NORM, "/ to *", "f / g", "f * g ^ -1");
+
+  engine_add_rule(engine, RULES_NORM, "x+x = 2*x", "f + f", "2 * f");
+  engine_add_rule(engine, RULES_NORM, "x*x = x^2", "f * f", "f ^ 2");
+
+  engine_add_rule(engine, RULES_NORM, "x^1 = x", "f ^ 1", "f");
+  engine_add_rule(engine, RULES_NORM, "x^y^z = x^yz", "(f ^ g) ^ h",
+                  "f ^ (g * h)");
+
+  engine_add_rule(engine, RULES_NORM, "factor left", "f * g + h * g",
+                  "(f + h) * g");
+  engine_add_rule(engine, RULES_NORM, "factor right", "f * g + f * h",
+                  "f * (g + h)");
+
+  engine_add_rule(engine, RULES_NORM, "power left", "f ^ g * h ^ g",
+                  "(f h) ^ g");
+  engine_add_rule(engine, RULES_NORM, "power right", "f ^ g * f ^ h",
+                  "f ^ (g + h)");
+  /* TODO: Add separate transform for inverses */
+  engine_add_rule(engine, RULES_NORM, "exp log = id", "exp log f", "f");
+  engine_add_rule(engine, RULES_NORM, "log exp = id", "log exp f", "f");
+}
 
-  fp_push(rule_create("x+x = 2*x", "f + f", "2 * f"), norm_rules);
-  fp_push(rule_create("x*x = x^2", "f * f", "f ^ 2"), norm_rules);
+/* Denomralisation rules to convert expression into more human readable form. */
+static void denorm_rules_init(Engine *engine) {
+  fp_push(rule_inverse(engine, engine->norm_rules), engine->denorm_rules);
+}
 
-  fp_push(rule_create("x^1 = x", "f ^ 1", "f"), norm_rules);
-  fp_push(rule_create("x^y^z = x^yz", "(f ^ g) ^ h", "f ^ (g * h)"),
-          norm_rules);
+/* Declares c scalar. */
+static void diff_rules_init(Engine *engine) {
+  engine_add_rule(engine, RULES_DIFF, "constant rule", "x'c", "0");
+  engine_add_rule(engine, RULES_DIFF, "self rule", "x'x", "1");
+  engine_add_rule(engine, RULES_DIFF, "sum rule", "x'(f + g)", "x'f + x'g");
+  engine_add_rule(engine, RULES_DIFF, "product rule", "x'(f * g)",
+                  "(x'f * g) + (f * x'g)");
+  engine_add_rule(engine, RULES_DIFF, "power rule", "x'(f ^ c)",
+                  "c * f ^ (c - 1) * x'f");
+  engine_add_rule(engine, RULES_DIFF, "exp rule", "x'(exp f)", "exp f * x'f");
+  engine_add_rule(engine, RULES_DIFF, "log rule", "x'(log f)", "f ^ -1 * x'f");
+  engine_add_rule(engine, RULES_DIFF, "sine rule", "x'(sin f)", "cos f * x'f");
+  engine_add_rule(engine, RULES_DIFF, "cosine rule", "x'(cos f)",
+                  "-1 * sin f * x'f");
+}
 
-  fp_push(rule_create("factor left", "f * g + h * g", "(f + h) * g"),
-          norm_rules);
-  fp_push(rule_create("factor right", "f * g + f * h", "f * (g + h)"),
-          norm_rules);
+/* The rules above are parsed by gen_tables at build time, into the static
+ * trees of rule_table.inc, which engine_create loads instead of parsing them
+ * again. Built with GEN_TABLES, as gen_tables is, engines parse them. */
+#ifndef GEN_TABLES
+#include "rule_table.inc"
 
-  fp_push(rule_create("power left", "f ^ g * h ^ g", "(f h) ^ g"), norm_rules);
-  fp_push(rule_create("power right", "f ^ g * f ^ h", "f ^ (g + h)"),
-          norm_rules);
-  /* TODO: Add separate transform for inverses */
-  fp_push(rule_create("exp log = id", "exp log f", "f"), norm_rules);
-  fp_push(rule_create("log exp = id", "log exp f", "f"), norm_rules);
-}
+#define RULE_TABLE_LENGTH(table) (sizeof(table) / sizeof(*(table)))
 
-void denorm_rules_init(void) {
-  fp_push(rule_inverse(norm_rules), denorm_rules);
+static void rule_table_load(const struct PatternRule table[], size_t length,
+                            struct PatternRule **rules) {
+  for (size_t i = 0; i < length; i++) {
+    fp_push(table[i], *rules);
+  }
+}
+#endif
+
+Engine *engine_create(void) {
+  Engine *engine = calloc(1, sizeof(*engine));
+  engine->add = opr_get("+");
+  engine->mul = opr_get("*");
+  simpls_init(engine);
+  narys_init(engine);
+  engine_declare_scalar(engine, "c");
+#ifdef GEN_TABLES
+  engine->oprs = opr_set_create();
+  norm_rules_init(engine);
+  diff_rules_init(engine);
+#else
+  engine->oprs = &opr_set_builtin;
+  rule_table_load(norm_rule_table, RULE_TABLE_LENGTH(norm_rule_table),
+                  &engine->norm_rules);
+  rule_table_load(diff_rule_table, RULE_TABLE_LENGTH(diff_rule_table),
+                  &engine->diff_rules);
+  engine->norm_static = fp_length(engine->norm_rules);
+  engine->diff_static = fp_length(engine->diff_rules);
+#endif
+  return engine;
 }
 
-void diff_rules_init(void) {
+void engine_add_rule(Engine *engine, RULE_SET set, const char name[],
+                     char pattern[], char replacement[]) {
+  struct PatternRule rule = rule_create(engine, name, pattern, replacement);
+  if (set == RULES_NORM) {
+    fp_push(rule, engine->norm_rules);
+  } else {
+    fp_push(rule, engine->diff_rules);
+  }
+}
 
-  fp_push(rule_create("constant rule", "x'c", "0"), diff_rules);
-  fp_push(rule_create("self rule", "x'x", "1"), diff_rules);
-  fp_push(rule_create("sum rule", "x'(f + g)", "x'f + x'g"), diff_rules);
-  fp_push(rule_create("product rule", "x'(f * g)", "(x'f * g) + (f * x'g)"),
-          diff_rules);
-  fp_push(rule_create("power rule", "x'(f ^ c)", "c * f ^ (c - 1) * x'f"),
-          diff_rules);
-  fp_push(rule_create("exp rule", "x'(exp f)", "exp f * x'f"), diff_rules);
-  fp_push(rule_create("log rule", "x'(log f)", "f ^ -1 * x'f"), diff_rules);
-  fp_push(rule_create("sine rule", "x'(sin f)", "cos f * x'f"), diff_rules);
-  fp_push(rule_create("cosine rule", "x'(cos f)", "-1 * sin f * x'f"),
-          diff_rules);
+void engine_declare_scalar(Engine *engine, const char name[]) {
+  fp_push(patt_var_get(name), engine->scalar_vars);
 }
 
-void trans_cleanup(void) {
-  fp_destroy(simpls);
-  for (int i = 0; i < fp_length(norm_rules); i++) {
-    rule_cleanup(norm_rules[i]);
+void engine_destroy(Engine *engine) {
+  fp_destroy(engine->simpls);
+  fp_destroy(engine->narys);
+  for (size_t i = engine->norm_static; i < fp_length(engine->norm_rules); i++) {
+    rule_cleanup(engine->norm_rules[i]);
+  }
+  fp_destroy(engine->norm_rules);
+  /* Shares its expressions with norm_rules. */
+  fp_destroy(engine->denorm_rules);
+  for (size_t i = engine->diff_static; i < fp_length(engine->diff_rules); i++) {
+    rule_cleanup(engine->diff_rules[i]);
   }
-  fp_destroy(norm_rules);
-  for (int i = 0; i < fp_length(diff_rules); i++) {
-    rule_cleanup(diff_rules[i]);
+  fp_destroy(engine->diff_rules);
+  fp_destroy(engine->scalar_vars);
+  if (engine->flat) {
+    ast_flat_destroy(engine->flat);
   }
-  fp_destroy(diff_rules);
+#ifdef GEN_TABLES
+  opr_set_destroy((OprSet *)engine->oprs);
+#endif
+  free(engine);
 }
 
 /* --------------------- *
@@ -698,57 +2257,148 @@ void trans_cleanup(void) {
  * --------------------- */
 
 static int expr_it_apply(Expression expr, ORDER order,
-                         void trans(Ast_Node *, void *), void *ctx_trans) {
+                         void trans(Ast_Node *, void *),
+                         const void *ctx_trans) {
   struct CtxAll ctx = {0, ctx_trans};
+  NodePool *prev = pool_enter(expr.pool);
   ast_iter_apply(get_root(expr), order, trans, &ctx);
+  pool_enter(prev);
+  return ctx.changed;
+}
+
+/* Every transform, on trees and on shared expressions. */
+struct Transform {
+  void (*tree)(Ast_Node *node, void *ctx);
+  const DagNode *(*dag)(Dag *dag, const DagNode *node, struct CtxAll *ctx);
+};
+
+static const struct Transform eval_trans = {eval_apply, eval_dag};
+static const struct Transform id_trans = {id_apply, id_dag};
+static const struct Transform ann_trans = {ann_apply, ann_dag};
+static const struct Transform nary_trans = {nary_apply, nary_dag};
+static const struct Transform match_trans = {match_apply, match_dag};
+
+/* Rewrites the DAG at node as ast_iter_apply does a tree. In post-order, each
+ * node is rewritten once its children are, and its parent sees the rewritten
+ * node. In pre-order, each node is rewritten first, then the children of what
+ * it was rewritten to. */
+static const DagNode *dag_apply(Dag *dag, const DagNode *node, ORDER order,
+                                const struct Transform *trans,
+                                struct CtxAll *ctx, MemoMap *memo) {
+  if (!node) {
+    return NULL;
+  }
+  Walk walk;
+  walk_init(&walk);
+  const DagNode *curr = node;
+  const DagNode *new;
+  for (;;) {
+    for (;;) {
+      const DagNode **done = memo_addr(curr, memo);
+      if (done) {
+        new = *done;
+        break;
+      }
+      const DagNode *top = order == T_PRE ? trans->dag(dag, curr, ctx) : curr;
+      if (!top->lchild && !top->rchild) {
+        new = order == T_POST ? trans->dag(dag, top, ctx) : top;
+        memo_add(curr, new, memo);
+        break;
+      }
+      walk_push(&walk, curr, top, !!top->lchild);
+      curr = top->lchild ? top->lchild : top->rchild;
+    }
+    curr = NULL;
+    while (walk.length) {
+      WalkFrame *frame = &walk.frames[walk.length - 1];
+      const DagNode *top = frame->top;
+      if (!frame->step && top->rchild) {
+        frame->lchild = new;
+        frame->step = 1;
+        curr = top->rchild;
+        break;
+      }
+      const DagNode *lchild = frame->step ? frame->lchild : new;
+      const DagNode *rchild = frame->step ? new : NULL;
+      new = lchild == top->lchild && rchild == top->rchild
+                ? top
+                : dag_intern(dag, top->value, lchild, rchild);
+      if (order == T_POST) {
+        new = trans->dag(dag, new, ctx);
+      }
+      memo_add(frame->node, new, memo);
+      walk.length--;
+    }
+    if (!curr) {
+      break;
+    }
+  }
+  walk_cleanup(&walk);
+  return new;
+}
+
+static int expr_apply(Expression expr, ORDER order,
+                      const struct Transform *trans, const void *ctx_trans) {
+  if (!expr.shared) {
+    return expr_it_apply(expr, order, trans->tree, ctx_trans);
+  }
+  Shared *shared = expr.shared;
+  if (atomic_load(&shared->dag->refs) > 1) {
+    shared_compact(shared);
+  }
+  struct CtxAll ctx = {0, ctx_trans};
+  MemoMap *memo = memo_create(DAG_BUCKETS_MIN);
+  shared->root = dag_apply(shared->dag, shared->root, order, trans, &ctx, memo);
+  memo_destroy(memo);
   return ctx.changed;
 }
 
 #define MAX_ITERATIONS 50
 
-int norm_apply(Expression expr) {
+int norm_apply(const Engine *engine, Expression expr) {
   int changed = 0;
 
   int j = 0;
   while (j++ < MAX_ITERATIONS) {
     int curr_changed = 0;
-    curr_changed |= expr_it_apply(expr, T_POST, id_apply, simpls);
-    curr_changed |= expr_it_apply(expr, T_POST, id_apply, simpls + 1);
-    curr_changed |= expr_it_apply(expr, T_POST, ann_apply, simpls + 2);
+    curr_changed |= expr_apply(expr, T_POST, &id_trans, engine->simpls);
+    curr_changed |= expr_apply(expr, T_POST, &id_trans, engine->simpls + 1);
+    curr_changed |= expr_apply(expr, T_POST, &ann_trans, engine->simpls + 2);
 
-    for (int i = 0; i < fp_length(norm_rules); i++) {
-      curr_changed |= expr_it_apply(expr, T_POST, match_apply, norm_rules + i);
+    for (size_t i = 0; i < fp_length(engine->norm_rules); i++) {
+      curr_changed |=
+          expr_apply(expr, T_POST, &match_trans, engine->norm_rules + i);
     }
 
-    curr_changed |= expr_it_apply(expr, T_POST, eval_apply, NULL);
-    curr_changed |= expr_it_apply(expr, T_POST, assoc_apply, opr_get("+"));
-    curr_changed |= expr_it_apply(expr, T_POST, assoc_apply, opr_get("*"));
-
-    curr_changed |= expr_it_apply(expr, T_POST, order_apply, opr_get("+"));
-    curr_changed |= expr_it_apply(expr, T_POST, order_apply, opr_get("*"));
+    curr_changed |= expr_apply(expr, T_POST, &eval_trans, NULL);
+    curr_changed |= expr_apply(expr, T_PRE, &nary_trans, engine->narys);
+    curr_changed |= expr_apply(expr, T_PRE, &nary_trans, engine->narys + 1);
 
     changed |= curr_changed;
     if (!curr_changed) {
       break;
     }
   }
+  expr_compact_sparse(expr);
   return changed;
 }
 
-int diff_apply(Expression expr) {
+int diff_apply(const Engine *engine, Expression expr) {
   int changed = 0;
 
   int j = 0;
   while (j++ < MAX_ITERATIONS) {
     int curr_changed = 0;
-    for (int i = 0; i < fp_length(diff_rules); i++) {
-      curr_changed |= expr_it_apply(expr, T_PRE, match_apply, diff_rules + i);
+    for (size_t i = 0; i < fp_length(engine->diff_rules); i++) {
+      curr_changed |=
+          expr_apply(expr, T_PRE, &match_trans, engine->diff_rules + i);
     }
-    curr_changed |= norm_apply(expr);
+    curr_changed |= norm_apply(engine, expr);
     changed |= curr_changed;
     if (!curr_changed) {
       break;
     }
   }
+  expr_compact_sparse(expr);
   return changed;
 }
@@ -7,21 +7,53 @@
 /* TODO: use opaque pointers */
 typedef struct Expression Expression;
 
-Expression expr_create(char expr[]);
+/* An engine owns the operators and transform rules expressions are parsed and
+ * transformed with. It is only read once created, so any number of threads can
+ * share one, and engines configured differently can run side by side.
+ * Variable names and numbers are interned process-wide, so var_set_init and
+ * num_set_init must be called before the first engine is created. */
+typedef struct Engine Engine;
+
+/* Create an engine with every operator, and the standard simplifications,
+ * normalisation rules and differentiation rules. */
+Engine *engine_create(void);
+void engine_destroy(Engine *engine);
+
+/* Configure engine before it is shared. Rules are tried in the order added,
+ * and pattern variables declared scalar only bind to scalars in rules added
+ * afterwards. */
+typedef enum { RULES_NORM, RULES_DIFF } RULE_SET;
+void engine_add_rule(Engine *engine, RULE_SET set, const char name[],
+                     char pattern[], char replacement[]);
+void engine_declare_scalar(Engine *engine, const char name[]);
+
+/* Returns an empty expression, for which expr_is_empty returns 1, if the input
+ * is not one whole expression. Empty expressions may only be destroyed. */
+Expression expr_create(const Engine *engine, char expr[]);
+/* Create from the characters between s0 inclusive and s1 exclusive, which need
+ * not be null terminated. */
+Expression expr_span_create(const Engine *engine, const char *s0,
+                            const char *s1);
+int expr_is_empty(Expression expr);
 void expr_destroy(Expression expr);
 Expression expr_copy(Expression expr);
 int expr_is_equal(Expression expr1, Expression expr2);
 
-/* Initialise expression transforms. */
-void simpls_init(void);
-void norm_rules_init(void);
-void diff_rules_init(void);
-
-void trans_cleanup(void);
-
-/* Apply normalisation and differentiation transforms. */
-int norm_apply(Expression expr);
-int diff_apply(Expression expr);
+/* Returns a shared copy of expr, in which equal subexpressions are stored
+ * once, so rewriting one rewrites all its occurrences together. Shared
+ * expressions are transformed, compared, copied and printed as any other, and
+ * copies of them are shared too. */
+Expression expr_share(Expression expr);
+
+/* Apply normalisation and differentiation transforms. Either compacts expr
+ * after, if its rewrites left it scattered. */
+int norm_apply(const Engine *engine, Expression expr);
+int diff_apply(const Engine *engine, Expression expr);
+
+/* Moves the nodes of expr into one block, in the order they are traversed,
+ * and frees the memory left from rewriting it. Invalidates pointers into
+ * expr. */
+void expr_compact(Expression expr);
 
 void expr_print(Expression expr);
 
@@ -1,3 +1,27 @@
+/* A generic associative array, instantiated like tree.h by defining the key
+ * type, value type and prefix before including this file:
+ *
+ * 		#define DPX_KT int
+ * 		#define DPX_VT double
+ * 		#define DPX_PFX id
+ * 		#include "dpx.h"
+ *
+ * Keys are compared with ==. By default the map is an array of buckets
+ * scanned linearly, which is quickest for a handful of keys. Define DPX_HASH
+ * as an expression of a key giving a size_t hash to instantiate an open
+ * addressing hash table instead, with Robin Hood probing, behind the same
+ * functions. Its low bits pick the bucket, so they should vary with the key.
+ *
+ * 		#define DPX_HASH(key) ((size_t)(key))
+ *
+ * _find_add(key, value, map, &added) returns the address of the value of key,
+ * adding key with value first if it is not in map, and sets added to whether
+ * it did, in a single probe. Addresses of values are invalidated by the next
+ * addition.
+ *
+ * Define DPX_ALLOC as an expression giving a const Allocator *, as in alloc.h,
+ * to allocate maps with it rather than with malloc and free. */
+
 #ifndef DPX_KT
 #ifndef DPX_VT
 #ifndef DPX_PFX
@@ -20,6 +44,18 @@ typedef int DPX_DEBUG_TYPE;
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef DPX_ALLOC
+#include "alloc.h"
+#define DPX_MALLOC(size) alloc_alloc(DPX_ALLOC, (size))
+#define DPX_REALLOC(p, old_size, size)                                        \
+  alloc_realloc(DPX_ALLOC, (p), (old_size), (size))
+#define DPX_FREE(p, size) alloc_free(DPX_ALLOC, (p), (size))
+#else
+#define DPX_MALLOC(size) malloc(size)
+#define DPX_REALLOC(p, old_size, size) realloc((p), (size))
+#define DPX_FREE(p, size) free(p)
+#endif
+
 #define DPX_CONCAT_2(A, B) A##B
 #define DPX_CONCAT(A, B) DPX_CONCAT_2(A, B)
 #define DPXMap DPX_CONCAT(DPX_STRUCT_PFX, Map)
@@ -36,10 +72,149 @@ static void DPX_CONCAT(DPX_PFX, _add)(DPX_KT key, DPX_VT value, DPXMap *map);
 
 static int DPX_CONCAT(DPX_PFX, _is_in)(DPX_KT key, const DPXMap *map);
 
+static DPX_VT *DPX_CONCAT(DPX_PFX, _find_add)(DPX_KT key, DPX_VT value,
+                                              DPXMap *map, int *added);
+
 static size_t DPX_CONCAT(DPX_PFX, _size)(const DPXMap *map);
 
 static void DPX_CONCAT(DPX_PFX, _destroy)(DPXMap *map);
 
+#ifdef DPX_HASH
+
+/* Buckets hold their probe length plus one, so 0 marks an empty bucket. Robin
+ * Hood insertion displaces any key closer to its home bucket than the key being
+ * inserted, which keeps probe lengths even, and lets a lookup stop at the first
+ * bucket holding a key closer to home than it would be. */
+typedef struct {
+  DPX_KT key;
+  DPX_VT value;
+  size_t dist;
+} DPX_CONCAT(DPX_STRUCT_PFX, Bucket);
+
+struct DPX_CONCAT(DPX_STRUCT_PFX, Map) {
+  size_t size;
+  size_t cap;
+  DPX_CONCAT(DPX_STRUCT_PFX, Bucket) * data;
+};
+
+/* Holds cap keys before growing, at most 3/4 full. */
+static DPXMap *DPX_CONCAT(DPX_PFX, _create)(size_t cap) {
+  DPXMap *p = DPX_MALLOC(sizeof(*p));
+  p->size = 0;
+  p->cap = 4;
+  while (3 * p->cap < 4 * cap) {
+    p->cap *= 2;
+  }
+  p->data = DPX_MALLOC(p->cap * sizeof(*p->data));
+  memset(p->data, 0, p->cap * sizeof(*p->data));
+  return p;
+}
+
+static void DPX_CONCAT(DPX_PFX, _destroy)(DPXMap *map) {
+  DPX_FREE(map->data, map->cap * sizeof(*map->data));
+  DPX_FREE(map, sizeof(*map));
+}
+
+static size_t DPX_CONCAT(DPX_PFX, _size)(const DPXMap *map) {
+  return map->size;
+}
+
+static DPX_VT *DPX_CONCAT(DPX_PFX, _addr)(DPX_KT key, const DPXMap *map) {
+  size_t mask = map->cap - 1;
+  size_t i = (size_t)(DPX_HASH(key)) & mask;
+  for (size_t dist = 1; map->data[i].dist >= dist; dist++) {
+    if (map->data[i].key == key) {
+      return &map->data[i].value;
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+static DPX_VT DPX_CONCAT(DPX_PFX, _get)(DPX_KT key, const DPXMap *map) {
+  DPX_VT *addr = DPX_CONCAT(DPX_PFX, _addr)(key, map);
+  if (addr) {
+    return *addr;
+  }
+  DPX_VT temp;
+  memset(&temp, 0, sizeof(DPX_VT));
+  return temp;
+}
+
+static int DPX_CONCAT(DPX_PFX, _is_in)(DPX_KT key, const DPXMap *map) {
+  return DPX_CONCAT(DPX_PFX, _addr)(key, map) != NULL;
+}
+
+/* Places bucket, whose key is not in map, probing from bucket i, which is
+ * bucket.dist - 1 past its home bucket. */
+static void DPX_CONCAT(DPX_PFX, _place)(DPX_CONCAT(DPX_STRUCT_PFX, Bucket)
+                                            bucket,
+                                        size_t i, DPXMap *map) {
+  size_t mask = map->cap - 1;
+  for (; map->data[i].dist; i = (i + 1) & mask, bucket.dist++) {
+    if (map->data[i].dist < bucket.dist) {
+      DPX_CONCAT(DPX_STRUCT_PFX, Bucket) displaced = map->data[i];
+      map->data[i] = bucket;
+      bucket = displaced;
+    }
+  }
+  map->data[i] = bucket;
+}
+
+static void DPX_CONCAT(DPX_PFX, _grow)(DPXMap *map) {
+  DPX_CONCAT(DPX_STRUCT_PFX, Bucket) *old = map->data;
+  size_t old_cap = map->cap;
+  map->cap *= 2;
+  map->data = DPX_MALLOC(map->cap * sizeof(*map->data));
+  memset(map->data, 0, map->cap * sizeof(*map->data));
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].dist) {
+      size_t home = (size_t)(DPX_HASH(old[i].key)) & (map->cap - 1);
+      old[i].dist = 1;
+      DPX_CONCAT(DPX_PFX, _place)(old[i], home, map);
+    }
+  }
+  DPX_FREE(old, old_cap * sizeof(*old));
+}
+
+/* Grows first if adding a key would fill map past 3/4, so may grow when key is
+ * already in map. */
+static DPX_VT *DPX_CONCAT(DPX_PFX, _find_add)(DPX_KT key, DPX_VT value,
+                                              DPXMap *map, int *added) {
+  if (4 * (map->size + 1) > 3 * map->cap) {
+    DPX_CONCAT(DPX_PFX, _grow)(map);
+  }
+  size_t mask = map->cap - 1;
+  size_t i = (size_t)(DPX_HASH(key)) & mask;
+  size_t dist = 1;
+  for (; map->data[i].dist >= dist; dist++) {
+    if (map->data[i].key == key) {
+      *added = 0;
+      return &map->data[i].value;
+    }
+    i = (i + 1) & mask;
+  }
+
+  /* The lookup stopped at the bucket key belongs in, so take it and place
+   * whatever key it held further along. */
+  *added = 1;
+  map->size++;
+  DPX_CONCAT(DPX_STRUCT_PFX, Bucket) displaced = map->data[i];
+  map->data[i] = (DPX_CONCAT(DPX_STRUCT_PFX, Bucket)){key, value, dist};
+  if (displaced.dist) {
+    displaced.dist++;
+    DPX_CONCAT(DPX_PFX, _place)(displaced, (i + 1) & mask, map);
+  }
+  return &map->data[i].value;
+}
+
+static void DPX_CONCAT(DPX_PFX, _add)(DPX_KT key, DPX_VT value, DPXMap *map) {
+  int added;
+  *DPX_CONCAT(DPX_PFX, _find_add)(key, value, map, &added) = value;
+}
+
+#else
+
 typedef struct {
   DPX_KT key;
   DPX_VT value;
@@ -52,16 +227,16 @@ struct DPX_CONCAT(DPX_STRUCT_PFX, Map) {
 };
 
 static DPXMap *DPX_CONCAT(DPX_PFX, _create)(size_t cap) {
-  DPXMap *p = malloc(sizeof(*p));
+  DPXMap *p = DPX_MALLOC(sizeof(*p));
   p->size = 0;
   p->cap = cap;
-  p->data = malloc(cap * sizeof(*p->data));
+  p->data = DPX_MALLOC(cap * sizeof(*p->data));
   return p;
 }
 
 static void DPX_CONCAT(DPX_PFX, _destroy)(DPXMap *map) {
-  free(map->data);
-  free(map);
+  DPX_FREE(map->data, map->cap * sizeof(*map->data));
+  DPX_FREE(map, sizeof(*map));
 }
 
 static size_t DPX_CONCAT(DPX_PFX, _size)(const DPXMap *map) {
@@ -96,7 +271,8 @@ void DPX_CONCAT(DPX_PFX, _add)(DPX_KT key, DPX_VT value, DPXMap *map) {
     }
   }
   if (map->size >= map->cap) {
-    map->data = realloc(map->data, 2 * map->cap * sizeof(*map->data));
+    map->data = DPX_REALLOC(map->data, map->cap * sizeof(*map->data),
+                            2 * map->cap * sizeof(*map->data));
     map->cap *= 2;
   }
   map->data[map->size++] =
@@ -112,6 +288,19 @@ static int DPX_CONCAT(DPX_PFX, _is_in)(DPX_KT key, const DPXMap *map) {
   return 0;
 }
 
+static DPX_VT *DPX_CONCAT(DPX_PFX, _find_add)(DPX_KT key, DPX_VT value,
+                                              DPXMap *map, int *added) {
+  DPX_VT *addr = DPX_CONCAT(DPX_PFX, _addr)(key, map);
+  *added = !addr;
+  if (!addr) {
+    DPX_CONCAT(DPX_PFX, _add)(key, value, map);
+    addr = &map->data[map->size - 1].value;
+  }
+  return addr;
+}
+
+#endif
+
 #undef DPX_CONCAT
 #undef DPX_CONCAT_2
 
@@ -119,6 +308,11 @@ static int DPX_CONCAT(DPX_PFX, _is_in)(DPX_KT key, const DPXMap *map) {
 #undef DPX_VT
 #undef DPX_PFX
 #undef DPX_STRUCT_PFX
+#undef DPX_HASH
+#undef DPX_ALLOC
+#undef DPX_MALLOC
+#undef DPX_REALLOC
+#undef DPX_FREE
 
 #endif
 #endif
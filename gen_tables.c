@@ -0,0 +1,244 @@
+#include "ast.c"
+#include "symbols.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Precompiles the operator trie and the default rules of engine_create into
+ * static const data, so engines are created without building, lexing, parsing
+ * or allocating any of them, and processes forked after share the tables.
+ * Tokens are written as ids, which only stay valid because var_set_init and
+ * num_set_init intern the ones rules may use first: single lowercase letter
+ * pattern variables and small integers. Anything else in a rule is an error.
+ *
+ * Usage: gen_tables.out [opr_table.inc] [rule_table.inc] */
+
+static void fail(const char msg[], const char name[]) {
+  fprintf(stderr, "gen_tables: %s in rule %s\n", msg, name);
+  exit(1);
+}
+
+static void write_char(FILE *out, char c) {
+  if (c == '\'' || c == '\\') {
+    fprintf(out, "'\\%c'", c);
+  } else {
+    fprintf(out, "'%c'", c);
+  }
+}
+
+static void write_oprs(FILE *out, const OprSet *set) {
+  fprintf(out, "const OprSet opr_set_builtin = {\n");
+  fprintf(out, "    %zu,\n    {\n", set->nodes_length);
+  for (size_t i = 0; i < set->nodes_length; i++) {
+    const OprTrieNode *node = &set->nodes[i];
+    fprintf(out, "        /* %zu */ {{", i);
+    const char *sep = "";
+    for (int c = 0; c < OPR_TRIE_CHARS; c++) {
+      if (node->next[c]) {
+        fprintf(out, "%s[", sep);
+        write_char(out, c);
+        fprintf(out, "] = %d", node->next[c]);
+        sep = ", ";
+      }
+    }
+    fprintf(out, "%s}, %d},\n", *sep ? "" : "0", node->opr);
+  }
+  fprintf(out, "    },\n};\n");
+}
+
+static size_t node_count(const Ast_Node *node) {
+  return node ? 1 + node_count(node->lchild) + node_count(node->rchild) : 0;
+}
+
+static void write_token(FILE *out, Token token, const char name[]) {
+  switch (token.token_type) {
+  case SCALAR: {
+    const Number *n = num_get(token.num);
+    if (n->kind != NUM_RAT || n->rat.den != 1 || n->rat.num < -NUM_SMALL ||
+        n->rat.num > NUM_SMALL || token.num != num_small(n->rat.num)) {
+      fail("constant other than a small integer", name);
+    }
+    fprintf(out, "{.token_type = SCALAR, .num = num_small(%lld)}",
+            (long long)n->rat.num);
+    break;
+  }
+  case VAR: {
+    if (token.var == VAR_ROOT) {
+      fprintf(out, "{.token_type = VAR, .var = VAR_ROOT}");
+      break;
+    }
+    const char *var = var_name(token.var);
+    if (!var_is_pattern(token.var) || var[0] < 'a' || var[0] > 'z' ||
+        var[1]) {
+      fail("variable other than a single letter pattern variable", name);
+    }
+    fprintf(out, "{.token_type = VAR, .var = patt_var_letter('%c')%s}",
+            var[0], token.var & VAR_SCALAR ? " | VAR_SCALAR" : "");
+    break;
+  }
+  case OPR:
+    fprintf(out, "{.token_type = OPR, .opr_id = %u /* %s */}", token.opr_id,
+            tok_opr(token)->repr);
+    break;
+  }
+}
+
+static void write_link(FILE *out, size_t i, int has) {
+  if (has) {
+    fprintf(out, "RULE_NODE(%zu)", i);
+  } else {
+    fprintf(out, "NULL");
+  }
+}
+
+/* Writes the nodes of the tree at node in pre-order, from index i, so the
+ * left child of node i is i + 1 and its right child follows the left
+ * subtree. Hashes are written computed, as static nodes are never stale.
+ * Returns the index after the last. */
+static size_t write_nodes(FILE *out, const Ast_Node *node, size_t parent,
+                          size_t i, const char name[]) {
+  size_t l = i + 1;
+  size_t r = l + node_count(node->lchild);
+  fprintf(out, "    /* %zu */ {", i);
+  write_token(out, node->value, name);
+  fprintf(out, ", ");
+  write_link(out, parent, node->parent != NULL);
+  fprintf(out, ", ");
+  write_link(out, l, node->lchild != NULL);
+  fprintf(out, ", ");
+  write_link(out, r, node->rchild != NULL);
+  fprintf(out, ", %uu, %u},\n", ast_hash((Ast_Node *)node),
+          ast_size((Ast_Node *)node));
+  if (node->lchild) {
+    write_nodes(out, node->lchild, i, l, name);
+  }
+  if (node->rchild) {
+    write_nodes(out, node->rchild, i, r, name);
+  }
+  return i + node_count(node);
+}
+
+static size_t rules_count(const struct PatternRule *rules) {
+  size_t count = 0;
+  for (size_t i = 0; i < fp_length(rules); i++) {
+    count += node_count(rules[i].pattern.dummy_parent) +
+             node_count(rules[i].replacement.dummy_parent);
+  }
+  return count;
+}
+
+static size_t write_rule_nodes(FILE *out, const struct PatternRule *rules,
+                               size_t i) {
+  for (size_t j = 0; j < fp_length(rules); j++) {
+    i = write_nodes(out, rules[j].pattern.dummy_parent, 0, i, rules[j].name);
+    i = write_nodes(out, rules[j].replacement.dummy_parent, 0, i,
+                    rules[j].name);
+  }
+  return i;
+}
+
+static size_t write_rule_table(FILE *out, const char table[],
+                               const struct PatternRule *rules, size_t i) {
+  fprintf(out, "static const struct PatternRule %s[] = {\n", table);
+  for (size_t j = 0; j < fp_length(rules); j++) {
+    size_t replacement = i + node_count(rules[j].pattern.dummy_parent);
+    for (const char *c = rules[j].name; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        fail("quote or backslash", rules[j].name);
+      }
+    }
+    fprintf(out,
+            "    {\"%s\", {RULE_NODE(%zu), NULL, NULL},\n"
+            "     {RULE_NODE(%zu), NULL, NULL}, &rule_flat, %u},\n",
+            rules[j].name, i, replacement, rules[j].flat_root);
+    i = replacement + node_count(rules[j].replacement.dummy_parent);
+  }
+  fprintf(out, "};\n\n");
+  return i;
+}
+
+static void write_index(FILE *out, uint32_t i) {
+  if (i == T_NONE) {
+    fprintf(out, "T_NONE");
+  } else {
+    fprintf(out, "%u", i);
+  }
+}
+
+/* Writes the flat of every replacement as a struct of its arrays, laid out as
+ * the block of a flat is. */
+static void write_flat(FILE *out, const Ast_Flat *flat) {
+  fprintf(out, "static const struct {\n");
+  fprintf(out, "  Token values[%u];\n", flat->length);
+  fprintf(out, "  T_Links links[%u];\n", flat->length);
+  fprintf(out, "  uint32_t parents[%u];\n", flat->length);
+  fprintf(out, "} rule_flat_block = {\n    {\n");
+  for (uint32_t i = 0; i < flat->length; i++) {
+    fprintf(out, "        /* %u */ ", i);
+    write_token(out, flat->values[i], "flat");
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "    },\n    {\n");
+  for (uint32_t i = 0; i < flat->length; i++) {
+    fprintf(out, "        /* %u */ {", i);
+    write_index(out, flat->links[i].lchild);
+    fprintf(out, ", ");
+    write_index(out, flat->links[i].rchild);
+    fprintf(out, "},\n");
+  }
+  fprintf(out, "    },\n    {");
+  for (uint32_t i = 0; i < flat->length; i++) {
+    fprintf(out, "%s", i % 8 ? " " : "\n        ");
+    write_index(out, flat->parents[i]);
+    fprintf(out, ",");
+  }
+  fprintf(out, "\n    },\n};\n\n");
+  fprintf(out, "static const Ast_Flat rule_flat = {\n");
+  fprintf(out, "    %u, %u, (Token *)rule_flat_block.values,\n", flat->length,
+          flat->length);
+  fprintf(out, "    (T_Links *)rule_flat_block.links,\n");
+  fprintf(out, "    (uint32_t *)rule_flat_block.parents,\n};\n\n");
+}
+
+static void write_rules(FILE *out, const Engine *engine) {
+  size_t length =
+      rules_count(engine->norm_rules) + rules_count(engine->diff_rules);
+  fprintf(out, "#define RULE_NODE(i) ((Ast_Node *)&rule_nodes[(i)])\n\n");
+  fprintf(out, "static const Ast_Node rule_nodes[%zu] = {\n", length);
+  write_rule_nodes(out, engine->diff_rules,
+                   write_rule_nodes(out, engine->norm_rules, 0));
+  fprintf(out, "};\n\n");
+  write_flat(out, engine->flat);
+  write_rule_table(out, "diff_rule_table", engine->diff_rules,
+                   write_rule_table(out, "norm_rule_table", engine->norm_rules,
+                                    0));
+  fprintf(out, "#undef RULE_NODE\n");
+}
+
+static FILE *open_table(const char path[]) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    exit(1);
+  }
+  fprintf(out, "/* Generated by gen_tables.c, do not edit. */\n\n");
+  return out;
+}
+
+int main(int argc, char *argv[]) {
+  var_set_init();
+  num_set_init();
+  Engine *engine = engine_create();
+
+  FILE *out = open_table(argc > 1 ? argv[1] : "opr_table.inc");
+  write_oprs(out, engine->oprs);
+  fclose(out);
+
+  out = open_table(argc > 2 ? argv[2] : "rule_table.inc");
+  write_rules(out, engine);
+  fclose(out);
+
+  engine_destroy(engine);
+  num_set_cleanup();
+  var_set_cleanup();
+  return 0;
+}
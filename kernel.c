@@ -0,0 +1,361 @@
+#include "kernel.h"
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+
+/* The kernels first run the vector block of an operator over each whole vector
+ * of the arguments, then the scalar loop over the remainder. A block returns 0
+ * without writing out if any of its lanes are out of the range it handles, and
+ * the scalar loop does that vector instead. */
+#define SCALAR_KERNEL(name, expr)                                              \
+  static void name##_scalar(const Scalar *a, const Scalar *b, Scalar *out,     \
+                            size_t n) {                                        \
+    (void)b;                                                                   \
+    for (size_t i = 0; i < n; i++) {                                           \
+      out[i] = expr;                                                           \
+    }                                                                          \
+  }
+
+SCALAR_KERNEL(add, a[i] + b[i])
+SCALAR_KERNEL(sub, a[i] - b[i])
+SCALAR_KERNEL(mul, a[i] * b[i])
+SCALAR_KERNEL(div, a[i] / b[i])
+SCALAR_KERNEL(pow, scalar_fn(pow)(a[i], b[i]))
+SCALAR_KERNEL(exp, scalar_fn(exp)(a[i]))
+SCALAR_KERNEL(log, scalar_fn(log)(a[i]))
+SCALAR_KERNEL(sin, scalar_fn(sin)(a[i]))
+SCALAR_KERNEL(cos, scalar_fn(cos)(a[i]))
+SCALAR_KERNEL(tan, scalar_fn(tan)(a[i]))
+SCALAR_KERNEL(sqrt, scalar_fn(sqrt)(a[i]))
+
+/* Vectors of float or double, 256 bits at a time with AVX2 when compiled for
+ * it, e.g. with -mavx2, otherwise 128 bits with SSE2 on x86-64. Only float has
+ * vector approximations, marked by KERNEL_APPROX, and long double has no
+ * vectors at all. */
+#if SCALAR_MANT_DIG == FLT_MANT_DIG && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define KERNEL_WIDTH 8
+#define KERNEL_APPROX
+
+typedef __m256 Vec;
+typedef __m256i VecI;
+
+#define v_load _mm256_loadu_ps
+#define v_store _mm256_storeu_ps
+#define v_set1 _mm256_set1_ps
+#define v_add _mm256_add_ps
+#define v_sub _mm256_sub_ps
+#define v_mul _mm256_mul_ps
+#define v_div _mm256_div_ps
+#define v_sqrt _mm256_sqrt_ps
+#define v_and _mm256_and_ps
+#define v_or _mm256_or_ps
+#define v_xor _mm256_xor_ps
+#define v_andnot _mm256_andnot_ps
+#define v_lt(x, y) _mm256_cmp_ps(x, y, _CMP_LT_OQ)
+#define v_le(x, y) _mm256_cmp_ps(x, y, _CMP_LE_OQ)
+#define v_all(mask) (_mm256_movemask_ps(mask) == 0xff)
+#define v_round _mm256_cvtps_epi32
+#define v_trunc _mm256_cvttps_epi32
+#define v_from_int _mm256_cvtepi32_ps
+#define v_as_int _mm256_castps_si256
+#define v_from_bits _mm256_castsi256_ps
+
+#define vi_set1 _mm256_set1_epi32
+#define vi_add _mm256_add_epi32
+#define vi_sub _mm256_sub_epi32
+#define vi_and _mm256_and_si256
+#define vi_or _mm256_or_si256
+#define vi_xor _mm256_xor_si256
+#define vi_andnot _mm256_andnot_si256
+#define vi_eq _mm256_cmpeq_epi32
+#define vi_shl _mm256_slli_epi32
+#define vi_shr _mm256_srli_epi32
+
+#elif SCALAR_MANT_DIG == FLT_MANT_DIG && defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define KERNEL_WIDTH 4
+#define KERNEL_APPROX
+
+typedef __m128 Vec;
+typedef __m128i VecI;
+
+#define v_load _mm_loadu_ps
+#define v_store _mm_storeu_ps
+#define v_set1 _mm_set1_ps
+#define v_add _mm_add_ps
+#define v_sub _mm_sub_ps
+#define v_mul _mm_mul_ps
+#define v_div _mm_div_ps
+#define v_sqrt _mm_sqrt_ps
+#define v_and _mm_and_ps
+#define v_or _mm_or_ps
+#define v_xor _mm_xor_ps
+#define v_andnot _mm_andnot_ps
+#define v_lt _mm_cmplt_ps
+#define v_le _mm_cmple_ps
+#define v_all(mask) (_mm_movemask_ps(mask) == 0xf)
+#define v_round _mm_cvtps_epi32
+#define v_trunc _mm_cvttps_epi32
+#define v_from_int _mm_cvtepi32_ps
+#define v_as_int _mm_castps_si128
+#define v_from_bits _mm_castsi128_ps
+
+#define vi_set1 _mm_set1_epi32
+#define vi_add _mm_add_epi32
+#define vi_sub _mm_sub_epi32
+#define vi_and _mm_and_si128
+#define vi_or _mm_or_si128
+#define vi_xor _mm_xor_si128
+#define vi_andnot _mm_andnot_si128
+#define vi_eq _mm_cmpeq_epi32
+#define vi_shl _mm_slli_epi32
+#define vi_shr _mm_srli_epi32
+
+#elif SCALAR_MANT_DIG == DBL_MANT_DIG && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define KERNEL_WIDTH 4
+
+typedef __m256d Vec;
+
+#define v_load _mm256_loadu_pd
+#define v_store _mm256_storeu_pd
+#define v_add _mm256_add_pd
+#define v_sub _mm256_sub_pd
+#define v_mul _mm256_mul_pd
+#define v_div _mm256_div_pd
+#define v_sqrt _mm256_sqrt_pd
+
+#elif SCALAR_MANT_DIG == DBL_MANT_DIG && defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define KERNEL_WIDTH 2
+
+typedef __m128d Vec;
+
+#define v_load _mm_loadu_pd
+#define v_store _mm_storeu_pd
+#define v_add _mm_add_pd
+#define v_sub _mm_sub_pd
+#define v_mul _mm_mul_pd
+#define v_div _mm_div_pd
+#define v_sqrt _mm_sqrt_pd
+
+#endif
+
+#ifdef KERNEL_WIDTH
+
+static inline void kern_run(int block(const Scalar *, const Scalar *, Scalar *),
+                            void scalar(const Scalar *, const Scalar *,
+                                        Scalar *, size_t),
+                            const Scalar *a, const Scalar *b, Scalar *out,
+                            size_t n) {
+  size_t i = 0;
+  for (; n - i >= KERNEL_WIDTH; i += KERNEL_WIDTH) {
+    if (!block(a + i, b ? b + i : b, out + i)) {
+      scalar(a + i, b ? b + i : b, out + i, KERNEL_WIDTH);
+    }
+  }
+  scalar(a + i, b ? b + i : b, out + i, n - i);
+}
+
+#define KERNEL(name)                                                           \
+  void kern_##name(const Scalar *a, const Scalar *b, Scalar *out, size_t n) {  \
+    kern_run(name##_block, name##_scalar, a, b, out, n);                       \
+  }
+
+#define BINARY_BLOCK(name, op)                                                 \
+  static int name##_block(const Scalar *a, const Scalar *b, Scalar *out) {     \
+    v_store(out, op(v_load(a), v_load(b)));                                    \
+    return 1;                                                                  \
+  }
+
+BINARY_BLOCK(add, v_add)
+BINARY_BLOCK(sub, v_sub)
+BINARY_BLOCK(mul, v_mul)
+BINARY_BLOCK(div, v_div)
+
+static int sqrt_block(const Scalar *a, const Scalar *b, Scalar *out) {
+  (void)b;
+  v_store(out, v_sqrt(v_load(a)));
+  return 1;
+}
+
+#endif
+
+#ifdef KERNEL_APPROX
+
+#define v_madd(x, y, z) v_add(v_mul(x, y), z)
+#define v_abs(x) v_andnot(v_set1(-0.0f), x)
+#define v_select(mask, x, y) v_or(v_and(mask, x), v_andnot(mask, y))
+
+/* The approximations below follow the Cephes single precision functions:
+ * reduce the argument by a multiple of ln 2 or pi/4, split into exactly
+ * representable high and low parts, then evaluate a minimax polynomial. */
+
+/* exp(x) = 2^n exp(r) with |r| <= ln(2)/2. Bounded so 2^n stays normal. */
+#define EXP_MAX 87.0f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO (-2.12194440e-4f)
+
+static int exp_block(const Scalar *a, const Scalar *b, Scalar *out) {
+  (void)b;
+  Vec x = v_load(a);
+  if (!v_all(v_le(v_abs(x), v_set1(EXP_MAX)))) {
+    return 0;
+  }
+  VecI n = v_round(v_mul(x, v_set1(LOG2E)));
+  Vec fn = v_from_int(n);
+  Vec r = v_sub(x, v_mul(fn, v_set1(LN2_HI)));
+  r = v_sub(r, v_mul(fn, v_set1(LN2_LO)));
+
+  Vec p = v_set1(1.9875691500e-4f);
+  p = v_madd(p, r, v_set1(1.3981999507e-3f));
+  p = v_madd(p, r, v_set1(8.3334519073e-3f));
+  p = v_madd(p, r, v_set1(4.1665795894e-2f));
+  p = v_madd(p, r, v_set1(1.6666665459e-1f));
+  p = v_madd(p, r, v_set1(5.0000001201e-1f));
+  p = v_add(v_madd(p, v_mul(r, r), r), v_set1(1.0f));
+
+  Vec scale = v_from_bits(vi_shl(vi_add(n, vi_set1(127)), 23));
+  v_store(out, v_mul(p, scale));
+  return 1;
+}
+
+/* log(x) = e log(2) + log(1 + m) with sqrt(1/2) - 1 <= m < sqrt(2) - 1. Only
+ * normal positive arguments are reduced from their bits. */
+#define SQRT_HALF 0.707106781186547524f
+
+static int log_block(const Scalar *a, const Scalar *b, Scalar *out) {
+  (void)b;
+  Vec x = v_load(a);
+  if (!v_all(v_and(v_le(v_set1(FLT_MIN), x), v_le(x, v_set1(FLT_MAX))))) {
+    return 0;
+  }
+  VecI bits = v_as_int(x);
+  Vec e = v_from_int(vi_sub(vi_shr(bits, 23), vi_set1(126)));
+  Vec m = v_from_bits(
+      vi_or(vi_and(bits, vi_set1(0x007fffff)), vi_set1(0x3f000000)));
+  Vec small = v_lt(m, v_set1(SQRT_HALF));
+  e = v_sub(e, v_and(small, v_set1(1.0f)));
+  m = v_add(v_sub(m, v_set1(1.0f)), v_and(small, m));
+  Vec z = v_mul(m, m);
+
+  Vec p = v_set1(7.0376836292e-2f);
+  p = v_madd(p, m, v_set1(-1.1514610310e-1f));
+  p = v_madd(p, m, v_set1(1.1676998740e-1f));
+  p = v_madd(p, m, v_set1(-1.2420140846e-1f));
+  p = v_madd(p, m, v_set1(1.4249322787e-1f));
+  p = v_madd(p, m, v_set1(-1.6668057665e-1f));
+  p = v_madd(p, m, v_set1(2.0000714765e-1f));
+  p = v_madd(p, m, v_set1(-2.4999993993e-1f));
+  p = v_madd(p, m, v_set1(3.3333331174e-1f));
+  p = v_mul(v_mul(p, m), z);
+  p = v_madd(e, v_set1(LN2_LO), p);
+  p = v_sub(p, v_mul(z, v_set1(0.5f)));
+  v_store(out, v_madd(e, v_set1(LN2_HI), v_add(m, p)));
+  return 1;
+}
+
+/* sin and cos of |x| - j pi/4 with j even and |x - j pi/4| <= pi/4, from the
+ * sine polynomial when j = 0 mod 4 and the cosine one otherwise, with the sign
+ * flipped when j = 4 mod 8. cos is sin shifted by 2 in j. Past SINCOS_MAX, pi/4
+ * is not precise enough for the reduction. */
+#define SINCOS_MAX 8192.0f
+#define FOUR_OVER_PI 1.27323954473516f
+#define PI_4_A (-0.78515625f)
+#define PI_4_B (-2.4187564849853515625e-4f)
+#define PI_4_C (-3.77489497744594108e-8f)
+
+static int sincos_block(const Scalar *a, Scalar *out, int cos) {
+  Vec x = v_load(a);
+  Vec ax = v_abs(x);
+  if (!v_all(v_le(ax, v_set1(SINCOS_MAX)))) {
+    return 0;
+  }
+  VecI j = v_trunc(v_mul(ax, v_set1(FOUR_OVER_PI)));
+  j = vi_and(vi_add(j, vi_set1(1)), vi_set1(~1));
+  Vec y = v_from_int(j);
+  VecI sign;
+  if (cos) {
+    j = vi_sub(j, vi_set1(2));
+    sign = vi_shl(vi_andnot(j, vi_set1(4)), 29);
+  } else {
+    sign = vi_xor(v_as_int(v_and(x, v_set1(-0.0f))),
+                  vi_shl(vi_and(j, vi_set1(4)), 29));
+  }
+  Vec use_sin = v_from_bits(vi_eq(vi_and(j, vi_set1(2)), vi_set1(0)));
+
+  ax = v_madd(y, v_set1(PI_4_A), ax);
+  ax = v_madd(y, v_set1(PI_4_B), ax);
+  ax = v_madd(y, v_set1(PI_4_C), ax);
+  Vec z = v_mul(ax, ax);
+
+  Vec c = v_set1(2.443315711809948e-5f);
+  c = v_madd(c, z, v_set1(-1.388731625493765e-3f));
+  c = v_madd(c, z, v_set1(4.166664568298827e-2f));
+  c = v_mul(v_mul(c, z), z);
+  c = v_add(v_sub(c, v_mul(z, v_set1(0.5f))), v_set1(1.0f));
+
+  Vec s = v_set1(-1.9515295891e-4f);
+  s = v_madd(s, z, v_set1(8.3321608736e-3f));
+  s = v_madd(s, z, v_set1(-1.6666654611e-1f));
+  s = v_madd(v_mul(s, z), ax, ax);
+
+  v_store(out, v_xor(v_select(use_sin, s, c), v_from_bits(sign)));
+  return 1;
+}
+
+static int sin_block(const Scalar *a, const Scalar *b, Scalar *out) {
+  (void)b;
+  return sincos_block(a, out, 0);
+}
+
+static int cos_block(const Scalar *a, const Scalar *b, Scalar *out) {
+  (void)b;
+  return sincos_block(a, out, 1);
+}
+
+#endif
+
+#define SCALAR_ONLY(name)                                                      \
+  void kern_##name(const Scalar *a, const Scalar *b, Scalar *out, size_t n) {  \
+    name##_scalar(a, b, out, n);                                               \
+  }
+
+#ifdef KERNEL_WIDTH
+KERNEL(add)
+KERNEL(sub)
+KERNEL(mul)
+KERNEL(div)
+KERNEL(sqrt)
+#else
+SCALAR_ONLY(add)
+SCALAR_ONLY(sub)
+SCALAR_ONLY(mul)
+SCALAR_ONLY(div)
+SCALAR_ONLY(sqrt)
+#endif
+
+#ifdef KERNEL_APPROX
+KERNEL(exp)
+KERNEL(log)
+KERNEL(sin)
+KERNEL(cos)
+#else
+SCALAR_ONLY(exp)
+SCALAR_ONLY(log)
+SCALAR_ONLY(sin)
+SCALAR_ONLY(cos)
+#endif
+
+SCALAR_ONLY(pow)
+SCALAR_ONLY(tan)
@@ -0,0 +1,31 @@
+#ifndef KERNEL_H
+
+#define KERNEL_H
+
+#include "scalar.h"
+#include <stddef.h>
+
+/* Batch versions of the operator functions, which evaluate out[i] = a[i] op
+ * b[i] for i < n, with b ignored by unary operators. out may alias a or b, but
+ * must not otherwise overlap them. */
+typedef void (*Kernel)(const Scalar *a, const Scalar *b, Scalar *out,
+                       size_t n);
+
+void kern_add(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_sub(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_mul(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_div(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_pow(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+
+/* For float, vector approximations of the usual functions, within a few ulp of
+ * them. Arguments out of the range of an approximation, e.g. infinities or
+ * large arguments to sin, fall back to the usual function, as do all arguments
+ * for wider Scalars. */
+void kern_exp(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_log(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_sin(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_cos(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_tan(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+void kern_sqrt(const Scalar *a, const Scalar *b, Scalar *out, size_t n);
+
+#endif
@@ -2,155 +2,364 @@
 #include "../c-generics/fat_pointer.h"
 #include "string.h"
 #include "symbols.h"
-#include <ctype.h>
 #include <stdio.h>
 
-/* Functions which attempt to match the string from s0 inclusive to s1
- * exclusive to the corresponding type. */
+typedef enum {
+  MATCH_SUCCESS,
+  MATCH_ERROR,
+} MATCH_CODE;
 
-static int scalar_match(const char *restrict s0, const char *restrict s1) {
-  /* if s is just a single non digit char, then operator or garbage */
-  if (!isdigit(*s0) && s0 + 1 == s1) {
-    return 0;
-  }
-  /* if first char is non digit and not -, then operator or garbage */
-  if (!isdigit(*s0) && *s0 != '-') {
-    return 0;
-  }
-  /* if latter chars contain non-digits, garbage */
-  for (s0++; s0 != s1; s0++) {
-    if (!isdigit(*s0) && *s0 != '.') {
-      return 0;
-    }
+/* Character classes of the lexer. Bytes not listed in char_classes are
+ * CC_OTHER, so the table only spells out the interesting entries. */
+typedef enum {
+  CC_OTHER,
+  CC_SPACE,
+  CC_ALPHA,
+  CC_DIGIT,
+  CC_DOT,
+  CC_MINUS,
+  CC_END,
+  CC_COUNT
+} CHAR_CLASS;
+
+_Static_assert(CC_COUNT <= LEX_CLASSES, "LexInput needs a mask per class");
+
+static const unsigned char char_classes[256] = {
+    ['\0'] = CC_END,   [' '] = CC_SPACE,  ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, ['.'] = CC_DOT,
+    ['-'] = CC_MINUS,
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+    ['a'] = CC_ALPHA, ['b'] = CC_ALPHA, ['c'] = CC_ALPHA, ['d'] = CC_ALPHA,
+    ['e'] = CC_ALPHA, ['f'] = CC_ALPHA, ['g'] = CC_ALPHA, ['h'] = CC_ALPHA,
+    ['i'] = CC_ALPHA, ['j'] = CC_ALPHA, ['k'] = CC_ALPHA, ['l'] = CC_ALPHA,
+    ['m'] = CC_ALPHA, ['n'] = CC_ALPHA, ['o'] = CC_ALPHA, ['p'] = CC_ALPHA,
+    ['q'] = CC_ALPHA, ['r'] = CC_ALPHA, ['s'] = CC_ALPHA, ['t'] = CC_ALPHA,
+    ['u'] = CC_ALPHA, ['v'] = CC_ALPHA, ['w'] = CC_ALPHA, ['x'] = CC_ALPHA,
+    ['y'] = CC_ALPHA, ['z'] = CC_ALPHA, ['A'] = CC_ALPHA, ['B'] = CC_ALPHA,
+    ['C'] = CC_ALPHA, ['D'] = CC_ALPHA, ['E'] = CC_ALPHA, ['F'] = CC_ALPHA,
+    ['G'] = CC_ALPHA, ['H'] = CC_ALPHA, ['I'] = CC_ALPHA, ['J'] = CC_ALPHA,
+    ['K'] = CC_ALPHA, ['L'] = CC_ALPHA, ['M'] = CC_ALPHA, ['N'] = CC_ALPHA,
+    ['O'] = CC_ALPHA, ['P'] = CC_ALPHA, ['Q'] = CC_ALPHA, ['R'] = CC_ALPHA,
+    ['S'] = CC_ALPHA, ['T'] = CC_ALPHA, ['U'] = CC_ALPHA, ['V'] = CC_ALPHA,
+    ['W'] = CC_ALPHA, ['X'] = CC_ALPHA, ['Y'] = CC_ALPHA, ['Z'] = CC_ALPHA,
+};
+
+#define char_class(c) (char_classes[(unsigned char)(c)])
+
+/* The vector versions of mask_block build the same classes as char_classes,
+ * 16 or 32 characters at a time, from range checks which are mutually
+ * exclusive. AVX2 is used when compiled for it, e.g. with -mavx2, otherwise
+ * SSE2 on x86-64, otherwise classify_masks goes character by character. */
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define CLASSIFY_WIDTH 32
+
+#define in_range(c, lo, n)                                                     \
+  _mm256_cmpeq_epi8(                                                           \
+      _mm256_min_epu8(_mm256_sub_epi8(c, _mm256_set1_epi8(lo)),                \
+                      _mm256_set1_epi8(n)),                                    \
+      _mm256_sub_epi8(c, _mm256_set1_epi8(lo)))
+#define is_char(c, x) _mm256_cmpeq_epi8(c, _mm256_set1_epi8(x))
+
+#define movemask(v) ((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+
+static void mask_block(const char *s, uint64_t masks[], size_t i) {
+  __m256i c = _mm256_loadu_si256((const __m256i *)s);
+  uint64_t m[CC_COUNT];
+  m[CC_SPACE] =
+      movemask(_mm256_or_si256(is_char(c, ' '), in_range(c, '\t', 4)));
+  m[CC_ALPHA] =
+      movemask(in_range(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 25));
+  m[CC_DIGIT] = movemask(in_range(c, '0', 9));
+  m[CC_DOT] = movemask(is_char(c, '.'));
+  m[CC_MINUS] = movemask(is_char(c, '-'));
+  m[CC_END] = movemask(is_char(c, '\0'));
+  m[CC_OTHER] = ~(m[CC_SPACE] | m[CC_ALPHA] | m[CC_DIGIT] | m[CC_DOT] |
+                  m[CC_MINUS] | m[CC_END]) &
+                UINT32_MAX;
+  for (int cc = 0; cc < CC_COUNT; cc++) {
+    masks[cc] |= m[cc] << i;
   }
-  return 1;
 }
 
-static int var_match(const char *restrict s0, const char *restrict s1) {
-  for (; s0 != s1; s0++) {
-    if (!isalpha(*s0)) {
-      return 0;
-    }
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define CLASSIFY_WIDTH 16
+
+#define in_range(c, lo, n)                                                     \
+  _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(c, _mm_set1_epi8(lo)),              \
+                              _mm_set1_epi8(n)),                               \
+                 _mm_sub_epi8(c, _mm_set1_epi8(lo)))
+#define is_char(c, x) _mm_cmpeq_epi8(c, _mm_set1_epi8(x))
+
+#define movemask(v) ((uint64_t)(uint32_t)_mm_movemask_epi8(v))
+
+static void mask_block(const char *s, uint64_t masks[], size_t i) {
+  __m128i c = _mm_loadu_si128((const __m128i *)s);
+  uint64_t m[CC_COUNT];
+  m[CC_SPACE] = movemask(_mm_or_si128(is_char(c, ' '), in_range(c, '\t', 4)));
+  m[CC_ALPHA] =
+      movemask(in_range(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 25));
+  m[CC_DIGIT] = movemask(in_range(c, '0', 9));
+  m[CC_DOT] = movemask(is_char(c, '.'));
+  m[CC_MINUS] = movemask(is_char(c, '-'));
+  m[CC_END] = movemask(is_char(c, '\0'));
+  m[CC_OTHER] = ~(m[CC_SPACE] | m[CC_ALPHA] | m[CC_DIGIT] | m[CC_DOT] |
+                  m[CC_MINUS] | m[CC_END]) &
+                UINT16_MAX;
+  for (int cc = 0; cc < CC_COUNT; cc++) {
+    masks[cc] |= m[cc] << i;
   }
-  return 1;
 }
 
-/* Copy the string subset to s, '\0' padded to the right if necessary, to
- * ensure opr_get can access all REPR_LENGTH many chars if required. */
-/* TODO: rephrase this */
-static Opr *opr_sec_get(const char *restrict s0, const char *restrict s1) {
-  char padded[REPR_LENGTH];
-  memset(padded, 0, 4);
-  memcpy(padded, s0, s1 - s0);
-  return opr_get(padded);
-}
+#endif
 
-static int opr_match(const char *restrict s0, const char *restrict s1) {
-  if (s1 - s0 > REPR_LENGTH) {
-    return 0;
-  } else {
-    return !!opr_sec_get(s0, s1);
+/* Sets bit i of masks[cc] for each of the n characters from s on, of class cc,
+ * for n up to LEX_BLOCK. */
+static void classify_masks(const char *s, size_t n, uint64_t masks[]) {
+  memset(masks, 0, CC_COUNT * sizeof(*masks));
+  size_t i = 0;
+#ifdef CLASSIFY_WIDTH
+  for (; n - i >= CLASSIFY_WIDTH; i += CLASSIFY_WIDTH) {
+    mask_block(s + i, masks, i);
+  }
+#endif
+  for (; i < n; i++) {
+    masks[char_class(s[i])] |= (uint64_t)1 << i;
   }
 }
 
-static void l_strip(char *remainder[]) {
-  while (isspace(**remainder)) {
-    (*remainder)++;
-  }
+static void lex_input_init(LexInput *in, const OprSet *oprs, const char *s0,
+                           const char *s1, int pattern) {
+  in->next = s0;
+  in->end = s1;
+  in->block = s0;
+  in->block_length = 0;
+  in->oprs = oprs;
+  in->mul = opr_id(opr_get("*"));
+  in->pattern = pattern;
 }
 
-/* Returns the atof of the string section between s0 and s1 only. In case
- * *remainder is a rvalue, copies the matched section into a temporary buffer,
- * and null terminates that section so atof scans that section only. */
-static float sec_atof(const char *restrict s0, const char *restrict s1) {
-  char temp[s1 - s0 + 1];
-  strncpy(temp, s0, s1 - s0);
-  temp[s1 - s0] = '\0';
-  return atof(temp);
+/* Classifies the block from s on. Lexing only moves forwards, so s is never
+ * before the current block. */
+static void lex_block(LexInput *in, const char *s) {
+  size_t n = in->end - s;
+  in->block = s;
+  in->block_length = n < LEX_BLOCK ? n : LEX_BLOCK;
+  classify_masks(s, in->block_length, in->masks);
 }
 
-typedef enum {
-  MATCH_SUCCESS,
-  MATCH_ERROR,
-} MATCH_CODE;
+#define class_bit(cc) (1u << (cc))
 
-/* Attempts to match the largest string possible from *remainder onwards to a
- * token type. If successful, outputs with the token parameter and returns 0. */
-static MATCH_CODE match(char *remainder[], Token *token) {
-  char *start = *remainder;
-  char *best = start;
-  char *end = start;
-  TOKEN_TYPE best_type;
-  do {
-    end++;
-    if (opr_match(start, end)) {
-      best = end;
-      best_type = OPR;
-    } else if (var_match(start, end)) {
-      best = end;
-      best_type = VAR;
-    } else if (scalar_match(start, end)) {
-      best = end;
-      best_type = SCALAR;
-    } else if (best != start) {
+/* Returns the number of characters from s0 on whose classes are in set, a set
+ * of class bits, found from the masks of each block the run crosses rather than
+ * character by character. */
+static size_t lex_run(LexInput *in, const char *s0, unsigned set) {
+  const char *s = s0;
+  size_t offset = s - in->block;
+  while (1) {
+    if (offset >= in->block_length) {
+      if (s == in->end) {
+        break;
+      }
+      lex_block(in, s);
+      offset = 0;
+    }
+    uint64_t run = 0;
+    for (unsigned bits = set; bits; bits &= bits - 1) {
+      run |= in->masks[__builtin_ctz(bits)];
+    }
+    /* Characters past the block are not in the run, so this stops at its end
+     * at the latest, unless the run fills all of it. */
+    uint64_t stop = ~(run >> offset);
+    size_t length = stop ? (size_t)__builtin_ctzll(stop) : LEX_BLOCK;
+    s += length;
+    offset += length;
+    if (offset < in->block_length) {
       break;
     }
-  } while (*end);
-
-  if (best == start) {
-    return MATCH_ERROR;
-  } else {
+  }
+  return s - s0;
+}
 
-    token->token_type = best_type;
+static void l_strip(LexInput *in) {
+  in->next += lex_run(in, in->next, class_bit(CC_SPACE));
+}
 
-    switch (best_type) {
-    case SCALAR:
-      token->scalar = sec_atof(start, best);
-      break;
-    case VAR:
-      token->var = *start;
-      break;
-    case OPR:
-      token->opr = opr_sec_get(start, best);
+/* Matches the largest string possible from in->next onwards to a token type,
+ * finding where it ends from the class masks. A '-' followed by digits or '.'
+ * is a negative scalar, an alphabetic character followed by alphanumerics is a
+ * variable unless the whole run names an operator, and any other character is
+ * looked up as a single character operator. If successful, outputs with the
+ * token parameter and returns 0. */
+static MATCH_CODE match(LexInput *in, Token *token) {
+  const char *start = in->next;
+  if (start == in->end) {
+    return MATCH_ERROR;
+  }
+  size_t length = 1;
+  const Opr *opr;
+  switch (char_class(*start)) {
+  case CC_ALPHA:
+    length += lex_run(in, start + 1, class_bit(CC_ALPHA) | class_bit(CC_DIGIT));
+    opr = opr_span_get(in->oprs, start, start + length);
+    if (opr) {
+      token->token_type = OPR;
+      token->opr_id = opr_id(opr);
+    } else {
+      token->token_type = VAR;
+      token->var = in->pattern ? patt_var_intern(start, start + length)
+                               : var_intern(start, start + length);
+    }
+    break;
+  case CC_MINUS:
+  case CC_DIGIT:
+    length += lex_run(in, start + 1, class_bit(CC_DIGIT) | class_bit(CC_DOT));
+    if (length > 1 || char_class(*start) == CC_DIGIT) {
+      token->token_type = SCALAR;
+      token->num = num_parse(start, start + length);
       break;
     }
-    *remainder = best;
-    return MATCH_SUCCESS;
+    /* A '-' alone is an operator. */
+    /* fall through */
+  case CC_DOT:
+  case CC_OTHER:
+    opr = opr_span_get(in->oprs, start, start + 1);
+    if (!opr) {
+      return MATCH_ERROR;
+    }
+    token->token_type = OPR;
+    token->opr_id = opr_id(opr);
+    break;
+  default:
+    return MATCH_ERROR;
   }
+  in->next += length;
+  return MATCH_SUCCESS;
 }
 
 /* Add implied multiplication into a processed array of tokens, i.e.
  * 2 x -> 2 * x */
 Token *mul_insert(Token tokens[]) {
+  Token mul = {.token_type = OPR};
+  mul.opr_id = opr_id(opr_get("*"));
   for (size_t i = 1; i < fp_length(tokens); i++) {
     if (tokens[i - 1].token_type != OPR && tokens[i].token_type == VAR) {
-      Token mul = {.token_type = OPR};
-      mul.opr = opr_get("*");
       fp_insert(mul, i, tokens);
     }
   }
   return tokens;
 }
 
+/* Matches the next token from in->next onwards into out, preceded by an
+ * implied multiplication if the previous token calls for one, i.e.
+ * 2 x -> 2 * x. Returns the number of tokens output, which is 0 at the end of
+ * the input or if the remaining characters could not be analysed. */
+static size_t lex_next(LexInput *in, const Token *prev, Token out[2]) {
+  l_strip(in);
+  if (in->next == in->end || char_class(*in->next) == CC_END) {
+    return 0;
+  }
+
+  Token token;
+  if (match(in, &token) == MATCH_ERROR) {
+    fprintf(stderr, "Error: Could not analyse all characters.\n");
+    return 0;
+  }
+  if (prev && prev->token_type != OPR && token.token_type == VAR) {
+    out[0].token_type = OPR;
+    out[0].opr_id = in->mul;
+    out[1] = token;
+    return 2;
+  }
+  out[0] = token;
+  return 1;
+}
+
 /* Returns a array of tokens processed from the string s. */
-Token *lexer(char input[]) {
+Token *lexer(const OprSet *oprs, char input[]) {
+  LexInput in;
+  lex_input_init(&in, oprs, input, input + strlen(input), 0);
   Token *tokens = NULL;
-  char **remainder = &input;
-  l_strip(remainder);
-
-  while (**remainder) {
-    Token token;
-    int matched = match(remainder, &token);
-    if (matched == MATCH_ERROR) {
-      fprintf(stderr, "Error: Could not analyse all characters.\n");
-      break;
-    } else {
-      fp_push(token, tokens);
-      l_strip(remainder);
+  Token out[2];
+  size_t n;
+  while ((n = lex_next(
+              &in, fp_length(tokens) ? &tokens[fp_length(tokens) - 1] : NULL,
+              out))) {
+    for (size_t i = 0; i < n; i++) {
+      fp_push(out[i], tokens);
     }
   }
-  /* Reassign array location back to tokens in case it was relocated. */
-  tokens = mul_insert(tokens);
-
   return tokens;
 }
+
+size_t lexer_buf(const OprSet *oprs, char input[], Token tokens[],
+                 size_t cap) {
+  return lexer_span(oprs, input, input + strlen(input), tokens, cap);
+}
+
+size_t lexer_span(const OprSet *oprs, const char *s0, const char *s1,
+                  Token tokens[], size_t cap) {
+  LexInput in;
+  lex_input_init(&in, oprs, s0, s1, 0);
+  size_t length = 0;
+  Token prev;
+  Token out[2];
+  size_t n;
+  while ((n = lex_next(&in, length ? &prev : NULL, out))) {
+    for (size_t i = 0; i < n; i++, length++) {
+      if (length < cap) {
+        tokens[length] = out[i];
+      }
+    }
+    prev = out[n - 1];
+  }
+  return length;
+}
+
+void token_stream_init(TokenStream *ts, const OprSet *oprs, const char *s0,
+                       const char *s1, int pattern) {
+  lex_input_init(&ts->in, oprs, s0, s1, pattern);
+  ts->length = 0;
+  ts->pos = 0;
+}
+
+void token_stream_cleanup(TokenStream *ts) { (void)ts; }
+
+int token_stream_peek(TokenStream *ts, Token *token) {
+  if (ts->pos == ts->length) {
+    /* The previous token is kept at the back of pending between refills. */
+    const Token *prev = ts->length ? &ts->pending[ts->length - 1] : NULL;
+    Token out[2];
+    size_t n = lex_next(&ts->in, prev, out);
+    if (!n) {
+      return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+      ts->pending[i] = out[i];
+    }
+    ts->length = n;
+    ts->pos = 0;
+  }
+  *token = ts->pending[ts->pos];
+  return 1;
+}
+
+int token_stream_next(TokenStream *ts, Token *token) {
+  if (!token_stream_peek(ts, token)) {
+    return 0;
+  }
+  ts->pos++;
+  return 1;
+}
+
+int token_stream_is_done(const TokenStream *ts) {
+  return ts->pos == ts->length &&
+         (ts->in.next == ts->in.end || char_class(*ts->in.next) == CC_END);
+}
@@ -3,7 +3,62 @@
 #define LEXER_H
 
 #include "symbols.h"
+#include <stddef.h>
 
-Token *lexer(char input[]);
+/* Operators are those in oprs, and anything else alphabetic is a variable. */
+Token *lexer(const OprSet *oprs, char input[]);
+
+/* Writes the tokens processed from input into the caller provided buffer, so
+ * one buffer can be reused across many inputs. Returns the total number of
+ * tokens, of which only the first cap are written if it exceeds cap. */
+size_t lexer_buf(const OprSet *oprs, char input[], Token tokens[], size_t cap);
+
+/* As lexer_buf, but for the characters from s0 inclusive to s1 exclusive, which
+ * need not be null terminated. */
+size_t lexer_span(const OprSet *oprs, const char *s0, const char *s1,
+                  Token tokens[], size_t cap);
+
+/* The remaining input of the lexer, classified one block of LEX_BLOCK
+ * characters at a time into a mask per character class, with bit i for the
+ * character at block + i, so lexing needs no buffer as long as the input.
+ * Variables are interned as pattern variables if pattern is set, and mul is
+ * resolved once for the implied multiplications. */
+#define LEX_BLOCK 64
+#define LEX_CLASSES 8
+
+typedef struct {
+  const char *next;
+  const char *end;
+  const char *block;
+  size_t block_length;
+  uint64_t masks[LEX_CLASSES];
+  const OprSet *oprs;
+  OprId mul;
+  int pattern;
+} LexInput;
+
+/* Pulls tokens from the characters between s0 inclusive and s1 exclusive one at
+ * a time, including implied multiplications, for parsers which build as they
+ * read. With pattern set, variables are pattern variables, as in transform
+ * rules. */
+typedef struct {
+  LexInput in;
+  Token pending[2];
+  size_t length;
+  size_t pos;
+} TokenStream;
+
+void token_stream_init(TokenStream *ts, const OprSet *oprs, const char *s0,
+                       const char *s1, int pattern);
+void token_stream_cleanup(TokenStream *ts);
+
+/* Outputs the next token through token without or with consuming it. Return 0
+ * at the end of the input, or if the remaining characters could not be
+ * analysed. */
+int token_stream_peek(TokenStream *ts, Token *token);
+int token_stream_next(TokenStream *ts, Token *token);
+/* Returns 1 once the stream has run out at the end of its input, rather than
+ * at characters which could not be analysed. */
+int token_stream_is_done(const TokenStream *ts);
 
 #endif
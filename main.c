@@ -1,35 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
 #define T_DEBUG
 #define SYMBOLS_DEBUG
 #include "ast.c"
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int main(void) {
-  opr_set_init();
-  simpls_init();
-  norm_rules_init();
-  diff_rules_init();
+#define OUTPUT_BUF_LENGTH (1 << 16)
 
-  while (1) {
-    char input[100];
-    fgets(input, 100, stdin);
+static int is_blank(const char *s0, const char *s1) {
+  for (; s0 != s1; s0++) {
+    if (!isspace((unsigned char)*s0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Prints the expression between s0 and s1 as parsed, normalised, then
+ * differentiated, or reports it and moves on if it does not parse. */
+static void expr_process(const Engine *engine, const char *s0,
+                         const char *s1) {
+  Expression expr = expr_span_create(engine, s0, s1);
+  if (expr_is_empty(expr)) {
+    while (s1 != s0 && isspace((unsigned char)s1[-1])) {
+      s1--;
+    }
+    fprintf(stderr, "Error: Could not parse \"%.*s\".\n", (int)(s1 - s0), s0);
+    return;
+  }
+  expr_print(expr);
+  printf("\n");
+  norm_apply(engine, expr);
+  expr_print(expr);
+  printf("\n");
+  diff_apply(engine, expr);
+  expr_print(expr);
+  printf("\n");
+  expr_destroy(expr);
+}
+
+/* Maps the file at path and processes each of its newline separated
+ * expressions straight from the mapped pages. */
+static int batch(const Engine *engine, const char path[]) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return 1;
+  }
+  size_t size = st.st_size;
+  const char *data = NULL;
+  if (size) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return 1;
+    }
+    posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  static char output_buf[OUTPUT_BUF_LENGTH];
+  setvbuf(stdout, output_buf, _IOFBF, OUTPUT_BUF_LENGTH);
+
+  const char *end = data + size;
+  for (const char *line = data; line < end;) {
+    const char *eol = memchr(line, '\n', end - line);
+    eol = eol ? eol : end;
+    if (!is_blank(line, eol)) {
+      expr_process(engine, line, eol);
+    }
+    line = eol + 1;
+  }
+
+  fflush(stdout);
+  if (size) {
+    munmap((void *)data, size);
+  }
+  return 0;
+}
+
+static void interactive(const Engine *engine) {
+  char *input = NULL;
+  size_t cap = 0;
+  ssize_t length;
+  while ((length = getline(&input, &cap, stdin)) != -1) {
     if (input[0] == 'q' && input[1] == '\n') {
       break;
     }
-    Expression expr = expr_create(input);
-    expr_print(expr);
-    printf("\n");
-    norm_apply(expr);
-    expr_print(expr);
-    printf("\n");
-    diff_apply(expr);
-    expr_print(expr);
-    printf("\n");
+    if (is_blank(input, input + length)) {
+      continue;
+    }
+    expr_process(engine, input, input + length);
+  }
+  free(input);
+}
+
+/* With no arguments, reads expressions from stdin one line at a time until
+ * "q". With a file argument, processes every line of that file. */
+int main(int argc, char *argv[]) {
+  var_set_init();
+  num_set_init();
+  Engine *engine = engine_create();
 
-    expr_destroy(expr);
+  int status = 0;
+  if (argc > 1) {
+    status = batch(engine, argv[1]);
+  } else {
+    interactive(engine);
   }
 
-  opr_set_cleanup();
-  trans_cleanup();
+  engine_destroy(engine);
+  num_set_cleanup();
+  var_set_cleanup();
 
-  return 0;
+  return status;
 }
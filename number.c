@@ -0,0 +1,934 @@
+#include "number.h"
+#include "segments.h"
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/* ------------------------------- *
+ * ARBITRARY PRECISION INTEGERS    *
+ * ------------------------------- */
+
+/* Sign and magnitude, with little endian limbs and no leading zero limbs, so
+ * zero has length 0 and is never negative. */
+typedef struct {
+  int neg;
+  size_t length;
+  uint32_t *limbs;
+} BigInt;
+
+struct BigRat {
+  BigInt num;
+  BigInt den;
+};
+
+static BigInt bi_alloc(size_t cap) {
+  BigInt b = {0, 0, calloc(cap ? cap : 1, sizeof(uint32_t))};
+  return b;
+}
+
+static void bi_free(BigInt *b) { free(b->limbs); }
+
+static void bi_trim(BigInt *b) {
+  while (b->length && !b->limbs[b->length - 1]) {
+    b->length--;
+  }
+  b->neg = b->neg && b->length;
+}
+
+static BigInt bi_from_i64(int64_t x) {
+  BigInt b = bi_alloc(2);
+  uint64_t mag = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  b.neg = x < 0;
+  b.limbs[0] = (uint32_t)mag;
+  b.limbs[1] = (uint32_t)(mag >> 32);
+  b.length = 2;
+  bi_trim(&b);
+  return b;
+}
+
+static BigInt bi_copy(const BigInt *a) {
+  BigInt b = bi_alloc(a->length);
+  b.neg = a->neg;
+  b.length = a->length;
+  memcpy(b.limbs, a->limbs, a->length * sizeof(*a->limbs));
+  return b;
+}
+
+/* Outputs b through x and returns 1 if it is within +-INT64_MAX. */
+static int bi_to_i64(const BigInt *b, int64_t *x) {
+  if (b->length > 2) {
+    return 0;
+  }
+  uint64_t mag = b->length > 1 ? (uint64_t)b->limbs[1] << 32 : 0;
+  mag |= b->length ? b->limbs[0] : 0;
+  if (mag > INT64_MAX) {
+    return 0;
+  }
+  *x = b->neg ? -(int64_t)mag : (int64_t)mag;
+  return 1;
+}
+
+/* Returns m such that b is about m * 2^exp, from the top 96 bits. */
+static long double bi_to_ld(const BigInt *b, int *exp) {
+  long double m = 0;
+  size_t top = b->length < 3 ? b->length : 3;
+  for (size_t i = 0; i < top; i++) {
+    m = m * 4294967296.0L + b->limbs[b->length - 1 - i];
+  }
+  *exp = 32 * (int)(b->length - top);
+  return b->neg ? -m : m;
+}
+
+static void bi_mul_add_small(BigInt *b, uint32_t mul, uint32_t add) {
+  uint64_t carry = add;
+  for (size_t i = 0; i < b->length; i++) {
+    carry += (uint64_t)b->limbs[i] * mul;
+    b->limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry) {
+    b->limbs = realloc(b->limbs, (b->length + 1) * sizeof(*b->limbs));
+    b->limbs[b->length++] = (uint32_t)carry;
+  }
+}
+
+static int bi_cmp_mag(const BigInt *a, const BigInt *b) {
+  if (a->length != b->length) {
+    return a->length > b->length ? 1 : -1;
+  }
+  for (size_t i = a->length; i-- > 0;) {
+    if (a->limbs[i] != b->limbs[i]) {
+      return a->limbs[i] > b->limbs[i] ? 1 : -1;
+    }
+  }
+  return 0;
+}
+
+/* |a| + |b| */
+static BigInt bi_add_mag(const BigInt *a, const BigInt *b) {
+  if (a->length < b->length) {
+    const BigInt *t = a;
+    a = b;
+    b = t;
+  }
+  BigInt s = bi_alloc(a->length + 1);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < a->length; i++) {
+    carry += (uint64_t)a->limbs[i] + (i < b->length ? b->limbs[i] : 0);
+    s.limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  s.limbs[a->length] = (uint32_t)carry;
+  s.length = a->length + 1;
+  bi_trim(&s);
+  return s;
+}
+
+/* |a| - |b|, for |a| >= |b| */
+static BigInt bi_sub_mag(const BigInt *a, const BigInt *b) {
+  BigInt d = bi_alloc(a->length);
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a->length; i++) {
+    int64_t t =
+        (int64_t)a->limbs[i] - (i < b->length ? b->limbs[i] : 0) - borrow;
+    borrow = t < 0;
+    d.limbs[i] = (uint32_t)t;
+  }
+  d.length = a->length;
+  bi_trim(&d);
+  return d;
+}
+
+static BigInt bi_add(const BigInt *a, const BigInt *b) {
+  BigInt s;
+  if (a->neg == b->neg) {
+    s = bi_add_mag(a, b);
+    s.neg = a->neg;
+  } else if (bi_cmp_mag(a, b) >= 0) {
+    s = bi_sub_mag(a, b);
+    s.neg = a->neg;
+  } else {
+    s = bi_sub_mag(b, a);
+    s.neg = b->neg;
+  }
+  bi_trim(&s);
+  return s;
+}
+
+static BigInt bi_mul(const BigInt *a, const BigInt *b) {
+  BigInt p = bi_alloc(a->length + b->length);
+  for (size_t i = 0; i < a->length; i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < b->length; j++) {
+      carry += (uint64_t)a->limbs[i] * b->limbs[j] + p.limbs[i + j];
+      p.limbs[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    p.limbs[i + b->length] = (uint32_t)carry;
+  }
+  p.length = a->length + b->length;
+  p.neg = a->neg != b->neg;
+  bi_trim(&p);
+  return p;
+}
+
+/* Divides |u| by the nonzero |v| into the quotient q and remainder r, by long
+ * division with each quotient limb estimated from the top two limbs, after
+ * normalising v so its top bit is set (Knuth, TAOCP 4.3.1, Algorithm D). */
+static void bi_divmod(const BigInt *u, const BigInt *v, BigInt *q,
+                      BigInt *r) {
+  size_t m = u->length;
+  size_t n = v->length;
+  if (bi_cmp_mag(u, v) < 0) {
+    *q = bi_alloc(1);
+    *r = bi_copy(u);
+    r->neg = 0;
+    return;
+  }
+  *q = bi_alloc(m - n + 1);
+  q->length = m - n + 1;
+
+  if (n == 1) {
+    uint64_t rem = 0;
+    for (size_t i = m; i-- > 0;) {
+      rem = (rem << 32) | u->limbs[i];
+      q->limbs[i] = (uint32_t)(rem / v->limbs[0]);
+      rem %= v->limbs[0];
+    }
+    bi_trim(q);
+    *r = bi_from_i64((int64_t)rem);
+    return;
+  }
+
+  int s = 0;
+  for (uint32_t top = v->limbs[n - 1]; !(top & 0x80000000u); top <<= 1) {
+    s++;
+  }
+  uint32_t *vn = malloc(n * sizeof(*vn));
+  uint32_t *un = malloc((m + 1) * sizeof(*un));
+  for (size_t i = n - 1; i > 0; i--) {
+    vn[i] = (v->limbs[i] << s) |
+            (uint32_t)((uint64_t)v->limbs[i - 1] >> (32 - s));
+  }
+  vn[0] = v->limbs[0] << s;
+  un[m] = (uint32_t)((uint64_t)u->limbs[m - 1] >> (32 - s));
+  for (size_t i = m - 1; i > 0; i--) {
+    un[i] = (u->limbs[i] << s) |
+            (uint32_t)((uint64_t)u->limbs[i - 1] >> (32 - s));
+  }
+  un[0] = u->limbs[0] << s;
+
+  const uint64_t base = UINT64_C(1) << 32;
+  for (size_t j = m - n + 1; j-- > 0;) {
+    uint64_t top = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+    uint64_t qhat = top / vn[n - 1];
+    uint64_t rhat = top % vn[n - 1];
+    while (qhat >= base ||
+           qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+      qhat--;
+      rhat += vn[n - 1];
+      if (rhat >= base) {
+        break;
+      }
+    }
+
+    /* Subtract qhat * vn from the current window of un. */
+    int64_t borrow = 0;
+    int64_t t;
+    for (size_t i = 0; i < n; i++) {
+      uint64_t p = qhat * vn[i];
+      t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xffffffffu);
+      un[i + j] = (uint32_t)t;
+      borrow = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)un[j + n] - borrow;
+    un[j + n] = (uint32_t)t;
+
+    /* qhat was one too large, so add vn back. */
+    q->limbs[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q->limbs[j]--;
+      uint64_t carry = 0;
+      for (size_t i = 0; i < n; i++) {
+        carry += (uint64_t)un[i + j] + vn[i];
+        un[i + j] = (uint32_t)carry;
+        carry >>= 32;
+      }
+      un[j + n] += (uint32_t)carry;
+    }
+  }
+  bi_trim(q);
+
+  *r = bi_alloc(n);
+  for (size_t i = 0; i + 1 < n; i++) {
+    r->limbs[i] = (un[i] >> s) | (uint32_t)((uint64_t)un[i + 1] << (32 - s));
+  }
+  r->limbs[n - 1] = un[n - 1] >> s;
+  r->length = n;
+  bi_trim(r);
+  free(vn);
+  free(un);
+}
+
+static BigInt bi_gcd(const BigInt *a, const BigInt *b) {
+  BigInt x = bi_copy(a);
+  BigInt y = bi_copy(b);
+  x.neg = y.neg = 0;
+  while (y.length) {
+    BigInt q, r;
+    bi_divmod(&x, &y, &q, &r);
+    bi_free(&q);
+    bi_free(&x);
+    x = y;
+    y = r;
+  }
+  bi_free(&y);
+  return x;
+}
+
+/* ------------------- *
+ * RATIONAL ARITHMETIC *
+ * ------------------- */
+
+#define mul_overflows __builtin_mul_overflow
+#define add_overflows __builtin_add_overflow
+
+static int64_t gcd64(int64_t a, int64_t b) {
+  a = a < 0 ? -a : a;
+  while (b) {
+    int64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Outputs num / den reduced, with den positive and neither INT64_MIN. */
+static void rat_make(int64_t num, int64_t den, Number *out) {
+  int64_t g = gcd64(num, den);
+  out->kind = NUM_RAT;
+  out->rat.num = num / g;
+  out->rat.den = den / g;
+}
+
+/* Outputs num / den, with den nonzero, in its one form, taking ownership of
+ * num and den. */
+static void big_make(BigInt num, BigInt den, Number *out) {
+  if (den.neg) {
+    num.neg = num.length && !num.neg;
+    den.neg = 0;
+  }
+  BigInt g = bi_gcd(&num, &den);
+  if (g.length != 1 || g.limbs[0] != 1) {
+    BigInt q, r;
+    bi_divmod(&num, &g, &q, &r);
+    q.neg = num.neg && q.length;
+    bi_free(&r);
+    bi_free(&num);
+    num = q;
+    bi_divmod(&den, &g, &q, &r);
+    bi_free(&r);
+    bi_free(&den);
+    den = q;
+  }
+  bi_free(&g);
+
+  int64_t n, d;
+  if (bi_to_i64(&num, &n) && bi_to_i64(&den, &d)) {
+    bi_free(&num);
+    bi_free(&den);
+    out->kind = NUM_RAT;
+    out->rat.num = n;
+    out->rat.den = d;
+  } else {
+    out->kind = NUM_BIG;
+    out->big = malloc(sizeof(*out->big));
+    out->big->num = num;
+    out->big->den = den;
+  }
+}
+
+static void big_parts(const Number *n, BigInt *num, BigInt *den) {
+  if (n->kind == NUM_RAT) {
+    *num = bi_from_i64(n->rat.num);
+    *den = bi_from_i64(n->rat.den);
+  } else {
+    *num = bi_copy(&n->big->num);
+    *den = bi_copy(&n->big->den);
+  }
+}
+
+/* Bignum results are capped at this many limbs for the numerator and for the
+ * denominator, past which an operation is not exact, as literals are capped by
+ * NUM_PARSE_DIGITS. Above that size they only slow every fold they reach, and
+ * repeated powers would otherwise grow without bound. */
+#define NUM_BIG_LIMBS 128
+
+/* Outputs the limb lengths of the parts of n, as big_parts would make them. */
+static void big_lengths(const Number *n, size_t *num, size_t *den) {
+  if (n->kind == NUM_RAT) {
+    *num = 2;
+    *den = 2;
+  } else {
+    *num = n->big->num.length;
+    *den = n->big->den.length;
+  }
+}
+
+static void num_free(Number *n) {
+  if (n->kind == NUM_BIG) {
+    bi_free(&n->big->num);
+    bi_free(&n->big->den);
+    free(n->big);
+  }
+}
+
+int num_add(const Number args[], Number *out) {
+  const Number *a = &args[0];
+  const Number *b = &args[1];
+  if (a->kind == NUM_RAT && b->kind == NUM_RAT) {
+    int64_t g = gcd64(a->rat.den, b->rat.den);
+    int64_t x, y, num, den;
+    if (!mul_overflows(a->rat.num, b->rat.den / g, &x) &&
+        !mul_overflows(b->rat.num, a->rat.den / g, &y) &&
+        !add_overflows(x, y, &num) && num != INT64_MIN &&
+        !mul_overflows(a->rat.den, b->rat.den / g, &den)) {
+      rat_make(num, den, out);
+      return 1;
+    }
+  }
+
+  size_t lan, lad, lbn, lbd;
+  big_lengths(a, &lan, &lad);
+  big_lengths(b, &lbn, &lbd);
+  if (lan + lbd >= NUM_BIG_LIMBS || lbn + lad >= NUM_BIG_LIMBS ||
+      lad + lbd > NUM_BIG_LIMBS) {
+    return 0;
+  }
+
+  BigInt an, ad, bn, bd;
+  big_parts(a, &an, &ad);
+  big_parts(b, &bn, &bd);
+  BigInt x = bi_mul(&an, &bd);
+  BigInt y = bi_mul(&bn, &ad);
+  big_make(bi_add(&x, &y), bi_mul(&ad, &bd), out);
+  bi_free(&x);
+  bi_free(&y);
+  bi_free(&an);
+  bi_free(&ad);
+  bi_free(&bn);
+  bi_free(&bd);
+  return 1;
+}
+
+/* Arguments are shallow copies, with any BigRat copied onto the stack, so
+ * negating or inverting one does not touch the interned original. */
+int num_sub(const Number args[], Number *out) {
+  Number neg[2] = {args[0], args[1]};
+  BigRat big;
+  if (neg[1].kind == NUM_RAT) {
+    neg[1].rat.num = -neg[1].rat.num;
+  } else {
+    big = *args[1].big;
+    big.num.neg = !big.num.neg;
+    neg[1].big = &big;
+  }
+  return num_add(neg, out);
+}
+
+int num_mul(const Number args[], Number *out) {
+  const Number *a = &args[0];
+  const Number *b = &args[1];
+  if (a->kind == NUM_RAT && b->kind == NUM_RAT) {
+    /* Cancel across first, so the result is already reduced. */
+    int64_t g1 = gcd64(a->rat.num, b->rat.den);
+    int64_t g2 = gcd64(b->rat.num, a->rat.den);
+    int64_t num, den;
+    if (!mul_overflows(a->rat.num / g1, b->rat.num / g2, &num) &&
+        num != INT64_MIN &&
+        !mul_overflows(a->rat.den / g2, b->rat.den / g1, &den)) {
+      out->kind = NUM_RAT;
+      out->rat.num = num;
+      out->rat.den = num ? den : 1;
+      return 1;
+    }
+  }
+
+  size_t lan, lad, lbn, lbd;
+  big_lengths(a, &lan, &lad);
+  big_lengths(b, &lbn, &lbd);
+  if (lan + lbn > NUM_BIG_LIMBS || lad + lbd > NUM_BIG_LIMBS) {
+    return 0;
+  }
+
+  BigInt an, ad, bn, bd;
+  big_parts(a, &an, &ad);
+  big_parts(b, &bn, &bd);
+  big_make(bi_mul(&an, &bn), bi_mul(&ad, &bd), out);
+  bi_free(&an);
+  bi_free(&ad);
+  bi_free(&bn);
+  bi_free(&bd);
+  return 1;
+}
+
+int num_div(const Number args[], Number *out) {
+  Number inv[2] = {args[0], args[1]};
+  BigRat big;
+  if (inv[1].kind == NUM_RAT) {
+    if (!inv[1].rat.num) {
+      return 0;
+    }
+    int64_t sign = inv[1].rat.num < 0 ? -1 : 1;
+    inv[1].rat.num = sign * args[1].rat.den;
+    inv[1].rat.den = sign * args[1].rat.num;
+  } else {
+    big.num = args[1].big->den;
+    big.den = args[1].big->num;
+    big.num.neg = big.den.neg;
+    big.den.neg = 0;
+    inv[1].big = &big;
+  }
+  return num_mul(inv, out);
+}
+
+/* Integer powers up to NUM_POW_MAX are exact, by repeated squaring, while
+ * every square and product stays within NUM_BIG_LIMBS. */
+#define NUM_POW_MAX 64
+
+int num_pow(const Number args[], Number *out) {
+  const Number *e = &args[1];
+  if (e->kind != NUM_RAT || e->rat.den != 1 || e->rat.num > NUM_POW_MAX ||
+      e->rat.num < -NUM_POW_MAX) {
+    return 0;
+  }
+  int64_t k = e->rat.num < 0 ? -e->rat.num : e->rat.num;
+  const Number one = {NUM_RAT, .rat = {1, 1}};
+
+  Number factors[2] = {one, args[0]};
+  Number next;
+  int base_owned = 0;
+  int exact = 1;
+  for (; k && exact; k >>= 1) {
+    if (k & 1) {
+      exact = num_mul(factors, &next);
+      if (exact) {
+        num_free(&factors[0]);
+        factors[0] = next;
+      }
+    }
+    if (k > 1 && exact) {
+      Number square[2] = {factors[1], factors[1]};
+      exact = num_mul(square, &next);
+      if (exact) {
+        if (base_owned) {
+          num_free(&factors[1]);
+        }
+        factors[1] = next;
+        base_owned = 1;
+      }
+    }
+  }
+  if (base_owned) {
+    num_free(&factors[1]);
+  }
+  if (!exact) {
+    num_free(&factors[0]);
+    return 0;
+  }
+
+  if (e->rat.num >= 0) {
+    *out = factors[0];
+    return 1;
+  }
+  Number inv[2] = {one, factors[0]};
+  exact = num_div(inv, out);
+  num_free(&factors[0]);
+  return exact;
+}
+
+/* Returns n as a long double, from its parts if a bignum. */
+static long double num_to_ld(const Number *n) {
+  int en, ed;
+  long double mn, md;
+  switch (n->kind) {
+  case NUM_RAT:
+    return (long double)n->rat.num / n->rat.den;
+  case NUM_BIG:
+    mn = bi_to_ld(&n->big->num, &en);
+    md = bi_to_ld(&n->big->den, &ed);
+    return ldexpl(mn / md, en - ed);
+  default:
+    return n->real;
+  }
+}
+
+/* A single correctly rounded division when both parts are exact in Scalar. */
+Scalar num_to_scalar(const Number *n) {
+  const int64_t exact = INT64_C(1)
+                        << (SCALAR_MANT_DIG < 62 ? SCALAR_MANT_DIG : 62);
+  if (n->kind == NUM_RAT && n->rat.num <= exact && n->rat.num >= -exact &&
+      n->rat.den <= exact) {
+    return (Scalar)n->rat.num / (Scalar)n->rat.den;
+  }
+  return (Scalar)num_to_ld(n);
+}
+
+/* ------------------- *
+ * INTERNED NUMBERS    *
+ * ------------------- */
+
+/* Numbers are interned into an open addressing hash table of ids, with the
+ * numbers stored by id in segments, as variable names are in symbols.c, so
+ * engines on different threads can fold constants into the one table. As
+ * there, lookups take no lock, and only inserting a number does. */
+typedef struct NumSlots {
+  struct NumSlots *retired;
+  size_t cap;
+  _Atomic uint32_t slots[];
+} NumSlots;
+
+typedef struct {
+  mtx_t lock;
+  size_t length;
+  size_t big_limbs;
+  Number *segs[SEGS_MAX];
+  _Atomic(NumSlots *) slots;
+} NumSet;
+
+/* Slots hold id + 1, so 0 marks an empty slot. */
+#define NUM_SET_CAP 512
+
+/* Returned by num_slots_find for a number not in the table. */
+#define NUM_NONE UINT32_MAX
+
+/* Interned numbers live until num_set_cleanup, as trees anywhere may hold
+ * their ids, so the bignums folded over a long run are bounded by a budget of
+ * limbs in all, past which new bignums are interned rounded instead. */
+#define NUM_SET_BIG_LIMBS ((size_t)1 << 22)
+
+NumSet *num_set;
+
+static uint32_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return (uint32_t)h;
+}
+
+static uint64_t bi_hash(const BigInt *b, uint64_t h) {
+  h = (h ^ (uint64_t)b->neg) * 1099511628211u;
+  for (size_t i = 0; i < b->length; i++) {
+    h = (h ^ b->limbs[i]) * 1099511628211u;
+  }
+  return h;
+}
+
+static uint32_t num_hash(const Number *n) {
+  double d;
+  uint64_t bits;
+  switch (n->kind) {
+  case NUM_RAT:
+    return mix64((uint64_t)n->rat.num * 31 + (uint64_t)n->rat.den);
+  case NUM_BIG:
+    return mix64(bi_hash(&n->big->den, bi_hash(&n->big->num, 0)));
+  default:
+    /* Through double, as wider Scalars have padding bytes. */
+    d = isnan(n->real) ? NAN : (double)n->real;
+    memcpy(&bits, &d, sizeof(bits));
+    return mix64(bits ^ UINT64_C(0x9e3779b97f4a7c15));
+  }
+}
+
+static int bi_is_equal(const BigInt *a, const BigInt *b) {
+  return a->neg == b->neg && !bi_cmp_mag(a, b);
+}
+
+/* All NaNs are the same number, and the zeros differ by sign. */
+static int num_is_equal(const Number *a, const Number *b) {
+  if (a->kind != b->kind) {
+    return 0;
+  }
+  switch (a->kind) {
+  case NUM_RAT:
+    return a->rat.num == b->rat.num && a->rat.den == b->rat.den;
+  case NUM_BIG:
+    return bi_is_equal(&a->big->num, &b->big->num) &&
+           bi_is_equal(&a->big->den, &b->big->den);
+  default:
+    return isnan(a->real) ? isnan(b->real)
+                          : a->real == b->real &&
+                                !signbit(a->real) == !signbit(b->real);
+  }
+}
+
+static NumSlots *num_slots_create(size_t cap, NumSlots *retired) {
+  NumSlots *slots = calloc(1, sizeof(*slots) + cap * sizeof(*slots->slots));
+  slots->retired = retired;
+  slots->cap = cap;
+  return slots;
+}
+
+/* Returns the id of n in slots, or NUM_NONE with the empty slot it would go in
+ * through slot. */
+static NumId num_slots_find(NumSlots *slots, uint32_t hash, const Number *n,
+                            size_t *slot) {
+  size_t i = hash & (slots->cap - 1);
+  uint32_t id;
+  for (; (id = atomic_load_explicit(&slots->slots[i], memory_order_acquire));
+       i = (i + 1) & (slots->cap - 1)) {
+    if (num_is_equal(seg_at(num_set->segs, id - 1), n)) {
+      return id - 1;
+    }
+  }
+  *slot = i;
+  return NUM_NONE;
+}
+
+/* Keeps the table at most half full, so probe sequences stay short. The new
+ * table is filled before it is published. */
+static void num_set_grow(void) {
+  NumSlots *old = atomic_load_explicit(&num_set->slots, memory_order_relaxed);
+  NumSlots *slots = num_slots_create(2 * old->cap, old);
+  for (size_t id = 0; id < num_set->length; id++) {
+    size_t i = num_hash(seg_at(num_set->segs, id)) & (slots->cap - 1);
+    while (atomic_load_explicit(&slots->slots[i], memory_order_relaxed)) {
+      i = (i + 1) & (slots->cap - 1);
+    }
+    atomic_store_explicit(&slots->slots[i], id + 1, memory_order_relaxed);
+  }
+  atomic_store_explicit(&num_set->slots, slots, memory_order_release);
+}
+
+static NumId num_set_intern(Number *n);
+
+void num_set_init(void) {
+  num_set = calloc(1, sizeof(*num_set));
+  mtx_init(&num_set->lock, mtx_plain);
+  atomic_init(&num_set->slots, num_slots_create(NUM_SET_CAP, NULL));
+  for (int64_t x = -NUM_SMALL; x <= NUM_SMALL; x++) {
+    Number n = {NUM_RAT, .rat = {x, 1}};
+    num_set_intern(&n);
+  }
+}
+
+void num_set_cleanup(void) {
+  for (size_t id = 0; id < num_set->length; id++) {
+    num_free(seg_at(num_set->segs, id));
+  }
+  for (size_t seg = 0; seg < SEGS_MAX; seg++) {
+    free(num_set->segs[seg]);
+  }
+  NumSlots *slots = atomic_load(&num_set->slots);
+  while (slots) {
+    NumSlots *retired = slots->retired;
+    free(slots);
+    slots = retired;
+  }
+  mtx_destroy(&num_set->lock);
+  free(num_set);
+}
+
+/* Reals which are integers within +-2^62 are exact. */
+#define REAL_INT_MAX 4611686018427387904.0L
+
+static NumId num_set_intern(Number *n) {
+  uint32_t hash = num_hash(n);
+  size_t i;
+  NumSlots *slots = atomic_load_explicit(&num_set->slots, memory_order_acquire);
+  NumId id = num_slots_find(slots, hash, n, &i);
+  if (id != NUM_NONE) {
+    num_free(n);
+    return id;
+  }
+
+  /* Another thread may have inserted n, or grown the table, since. */
+  mtx_lock(&num_set->lock);
+  slots = atomic_load_explicit(&num_set->slots, memory_order_relaxed);
+  id = num_slots_find(slots, hash, n, &i);
+  if (id != NUM_NONE) {
+    mtx_unlock(&num_set->lock);
+    num_free(n);
+    return id;
+  }
+
+  if (n->kind == NUM_BIG) {
+    size_t limbs = n->big->num.length + n->big->den.length;
+    if (num_set->big_limbs + limbs > NUM_SET_BIG_LIMBS) {
+      mtx_unlock(&num_set->lock);
+      Number real = {NUM_REAL, .real = (Scalar)num_to_ld(n)};
+      num_free(n);
+      return num_intern(&real);
+    }
+    num_set->big_limbs += limbs;
+  }
+
+  id = num_set->length++;
+  size_t seg = seg_of(id);
+  assert(seg < SEGS_MAX);
+  if (!num_set->segs[seg]) {
+    num_set->segs[seg] = malloc(seg_length(seg) * sizeof(Number));
+  }
+  *seg_at(num_set->segs, id) = *n;
+  atomic_store_explicit(&slots->slots[i], id + 1, memory_order_release);
+  if (2 * num_set->length >= slots->cap) {
+    num_set_grow();
+  }
+  mtx_unlock(&num_set->lock);
+  return id;
+}
+
+NumId num_intern(Number *n) {
+  if (n->kind == NUM_REAL && (long double)n->real == floorl(n->real) &&
+      fabsl(n->real) <= REAL_INT_MAX) {
+    int64_t x = (int64_t)n->real;
+    n->kind = NUM_RAT;
+    n->rat.num = x;
+    n->rat.den = 1;
+  }
+  if (n->kind == NUM_RAT && n->rat.den == 1 && n->rat.num >= -NUM_SMALL &&
+      n->rat.num <= NUM_SMALL) {
+    return num_small(n->rat.num);
+  }
+  return num_set_intern(n);
+}
+
+const Number *num_get(NumId id) { return seg_at(num_set->segs, id); }
+
+NumId num_from_int(int64_t x) {
+  if (x >= -NUM_SMALL && x <= NUM_SMALL) {
+    return num_small(x);
+  }
+  Number n = {NUM_RAT, .rat = {x, 1}};
+  return num_intern(&n);
+}
+
+NumId num_from_scalar(Scalar x) {
+  Number n = {NUM_REAL, .real = x};
+  return num_intern(&n);
+}
+
+int num_cmp(NumId a, NumId b) {
+  if (a == b) {
+    return 0;
+  }
+  const Number *x = num_get(a);
+  const Number *y = num_get(b);
+  int64_t l, r;
+  if (x->kind == NUM_RAT && y->kind == NUM_RAT &&
+      !mul_overflows(x->rat.num, y->rat.den, &l) &&
+      !mul_overflows(y->rat.num, x->rat.den, &r)) {
+    return (l > r) - (l < r);
+  }
+  long double lx = num_to_ld(x);
+  long double ly = num_to_ld(y);
+  return (lx > ly) - (lx < ly);
+}
+
+/* ------------------ *
+ * LITERAL PARSING    *
+ * ------------------ */
+
+#define is_digit(c) ((unsigned)((c) - '0') <= 9)
+
+/* Exponents beyond this are clamped, as in scalar_parse. */
+#define EXP_LIMIT 100000
+
+/* Literals with more digits and places of exponent than this are rounded
+ * instead, since their bignums would only slow every fold they reach. */
+#define NUM_PARSE_DIGITS 1000
+
+/* Digits that always fit in int64_t. */
+#define RAT_DIGITS 18
+
+NumId num_parse(const char *s0, const char *s1) {
+  const char *s = s0;
+  int neg = 0;
+  if (s != s1 && *s == '-') {
+    neg = 1;
+    s++;
+  }
+
+  const char *digits = s;
+  int ndigits = 0;
+  int frac = 0;
+  int seen_dot = 0;
+  for (; s != s1; s++) {
+    if (*s == '.' && !seen_dot) {
+      seen_dot = 1;
+      continue;
+    } else if (!is_digit(*s)) {
+      break;
+    }
+    ndigits++;
+    frac += seen_dot;
+  }
+  const char *digits_end = s;
+
+  int exp = 0;
+  if (ndigits && s != s1 && (*s == 'e' || *s == 'E')) {
+    const char *t = s + 1;
+    int exp_neg = 0;
+    if (t != s1 && (*t == '-' || *t == '+')) {
+      exp_neg = *t++ == '-';
+    }
+    for (; t != s1 && is_digit(*t); t++) {
+      if (exp < EXP_LIMIT) {
+        exp = 10 * exp + (*t - '0');
+      }
+    }
+    exp = exp_neg ? -exp : exp;
+  }
+  int exp10 = exp - frac;
+  int places = exp10 < 0 ? -exp10 : exp10;
+  if (ndigits + places > NUM_PARSE_DIGITS) {
+    return num_from_scalar(scalar_parse(s0, s1));
+  }
+
+  Number n;
+  if (ndigits + places <= RAT_DIGITS) {
+    int64_t m = 0;
+    for (s = digits; s != digits_end; s++) {
+      m = *s == '.' ? m : 10 * m + (*s - '0');
+    }
+    int64_t pow10 = 1;
+    for (int i = 0; i < places; i++) {
+      pow10 *= 10;
+    }
+    m = neg ? -m : m;
+    if (exp10 >= 0) {
+      rat_make(m * pow10, 1, &n);
+    } else {
+      rat_make(m, pow10, &n);
+    }
+    return num_intern(&n);
+  }
+
+  BigInt m = bi_alloc(1);
+  for (s = digits; s != digits_end; s++) {
+    if (*s != '.') {
+      bi_mul_add_small(&m, 10, (uint32_t)(*s - '0'));
+    }
+  }
+  BigInt pow10 = bi_from_i64(1);
+  for (int i = 0; i < places; i++) {
+    bi_mul_add_small(&pow10, 10, 0);
+  }
+  m.neg = neg && m.length;
+  if (exp10 >= 0) {
+    BigInt scaled = bi_mul(&m, &pow10);
+    bi_free(&m);
+    bi_free(&pow10);
+    big_make(scaled, bi_from_i64(1), &n);
+  } else {
+    big_make(m, pow10, &n);
+  }
+  return num_intern(&n);
+}
+
+NumId num_parse_str(const char s[]) { return num_parse(s, s + strlen(s)); }
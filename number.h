@@ -0,0 +1,75 @@
+#ifndef NUMBER_H
+
+#define NUMBER_H
+
+#include "scalar.h"
+#include <stdint.h>
+
+/* Numeric constants are exact while they can be. A Number is a rational of
+ * int64_t numerator and denominator while both fit, a rational of bignums past
+ * that, and a Scalar once a result is not rational, e.g. from sin or a
+ * fractional power. Rationals are kept reduced with a positive denominator,
+ * and only stored as bignums when they do not fit in NUM_RAT, so every value
+ * has one form. Reals which are integers in range are stored as NUM_RAT. */
+typedef enum { NUM_RAT, NUM_BIG, NUM_REAL } NUM_KIND;
+
+typedef struct BigRat BigRat;
+
+typedef struct {
+  NUM_KIND kind;
+  union {
+    struct {
+      int64_t num;
+      int64_t den;
+    } rat;
+    BigRat *big;
+    Scalar real;
+  };
+} Number;
+
+/* Numbers are interned like variables, so equal values have equal ids. */
+typedef uint32_t NumId;
+
+/* The integers from -NUM_SMALL to NUM_SMALL are interned first by
+ * num_set_init, in order, so their ids are known at compile time and interning
+ * them needs no lookup. */
+#define NUM_SMALL 16
+#define num_small(x) ((NumId)((x) + NUM_SMALL))
+
+/* Initialise and cleanup global numbers, once per process. In between, any
+ * number of threads may intern and read numbers. */
+void num_set_init(void);
+void num_set_cleanup(void);
+
+/* Returns the id of n, taking ownership of any bignum in it. */
+NumId num_intern(Number *n);
+const Number *num_get(NumId id);
+
+NumId num_from_int(int64_t x);
+NumId num_from_scalar(Scalar x);
+
+/* Returns the id of the literal between s0 inclusive and s1 exclusive, with
+ * the syntax of scalar_parse. Decimal literals are exact, except those too long
+ * or with too large an exponent to be worth holding exactly, which are rounded
+ * by scalar_parse. */
+NumId num_parse(const char *s0, const char *s1);
+NumId num_parse_str(const char s[]);
+
+#define num_is_exact(n) ((n)->kind != NUM_REAL)
+Scalar num_to_scalar(const Number *n);
+
+/* Returns a positive value if the number a is greater than b, 0 if equal and a
+ * negative value otherwise. Exact between NUM_RAT numbers. */
+int num_cmp(NumId a, NumId b);
+
+/* Exact operations on the exact numbers args[0] and args[1], which output
+ * through out and return 1, or return 0 if the result is not exact, e.g. on
+ * division by 0, for a fractional power or for a bignum too large to be worth
+ * holding exactly. */
+int num_add(const Number args[], Number *out);
+int num_sub(const Number args[], Number *out);
+int num_mul(const Number args[], Number *out);
+int num_div(const Number args[], Number *out);
+int num_pow(const Number args[], Number *out);
+
+#endif
@@ -0,0 +1,329 @@
+#include "scalar.h"
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Properties of Scalar used to round literals. SCALAR_EXACT_POW10 is the
+ * largest n such that 10^n is exact in Scalar, and literals below
+ * 10^SCALAR_ZERO_10_EXP round to zero. Literals with at most
+ * SCALAR_PARSE_DIGITS significant digits are rounded exactly, and longer ones
+ * are only used as a sticky digit, which is enough digits to tell any two
+ * halfway cases apart. */
+#if SCALAR_MANT_DIG == FLT_MANT_DIG
+#define SCALAR_ZERO_10_EXP (-46)
+#define SCALAR_EXACT_POW10 10
+#define SCALAR_PARSE_DIGITS 128
+#elif SCALAR_MANT_DIG == DBL_MANT_DIG
+#define SCALAR_ZERO_10_EXP (-324)
+#define SCALAR_EXACT_POW10 22
+#define SCALAR_PARSE_DIGITS 800
+#else
+/* The x87 extended format. */
+#define SCALAR_ZERO_10_EXP (-4951)
+#define SCALAR_EXACT_POW10 27
+#define SCALAR_PARSE_DIGITS 11600
+#endif
+#define scalar_ldexp scalar_fn(ldexp)
+
+/* Only the first SCALAR_EXACT_POW10 + 1 are used. */
+static const Scalar pow10s[] = {
+    1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+    1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+    1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+
+#if SCALAR_MANT_DIG < DBL_MANT_DIG
+
+/* Literals that are exact in double go through one correctly rounded double
+ * operation, and the result is narrowed unless that rounds twice. */
+#define DBL_EXACT_POW10 22
+
+static const double dbl_pow10s[DBL_EXACT_POW10 + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Narrowing the correctly rounded double is only wrong if the double landed
+ * exactly on a halfway point between two Scalars, since any halfway point
+ * strictly between the double and the literal would be a closer double.
+ * Returns 0 for those, and for results outside the normal range, which are
+ * left to the slow path. */
+static int narrow_once(uint64_t m, int exp10, Scalar *value) {
+  double d = exp10 >= 0 ? (double)m * dbl_pow10s[exp10]
+                        : (double)m / dbl_pow10s[-exp10];
+  if (!(d >= SCALAR_MIN) || d > SCALAR_MAX) {
+    return 0;
+  }
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  uint64_t half = UINT64_C(1) << (DBL_MANT_DIG - SCALAR_MANT_DIG - 1);
+  if ((bits & (2 * half - 1)) == half) {
+    return 0;
+  }
+  *value = (Scalar)d;
+  return 1;
+}
+
+#endif
+
+/* ------------------------------- *
+ * ARBITRARY PRECISION SLOW PATH   *
+ * ------------------------------- */
+
+/* Enough bits for the significant digits scaled by the largest power of ten
+ * that does not overflow, or shifted far enough left to keep SCALAR_MANT_DIG
+ * bits after dividing by the smallest power of ten that does not underflow.
+ * 4 bits per digit bounds log2(10). */
+#define BIG_BITS                                                               \
+  ((2 * (SCALAR_PARSE_DIGITS + 1) - SCALAR_ZERO_10_EXP) * 4 +                  \
+   SCALAR_MANT_DIG + 8)
+#define BIG_LIMBS (BIG_BITS / 32 + 1)
+
+/* Unsigned integer with little endian limbs and no leading zero limbs. */
+typedef struct {
+  size_t length;
+  uint32_t limbs[BIG_LIMBS];
+} Big;
+
+static void big_mul_add(Big *b, uint32_t mul, uint32_t add) {
+  uint64_t carry = add;
+  for (size_t i = 0; i < b->length; i++) {
+    carry += (uint64_t)b->limbs[i] * mul;
+    b->limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry) {
+    b->limbs[b->length++] = (uint32_t)carry;
+  }
+}
+
+/* Divides b by div in place and returns the remainder. */
+static uint32_t big_div_small(Big *b, uint32_t div) {
+  uint64_t rem = 0;
+  for (size_t i = b->length; i-- > 0;) {
+    rem = (rem << 32) | b->limbs[i];
+    b->limbs[i] = (uint32_t)(rem / div);
+    rem %= div;
+  }
+  while (b->length && !b->limbs[b->length - 1]) {
+    b->length--;
+  }
+  return (uint32_t)rem;
+}
+
+static void big_shl(Big *b, size_t bits) {
+  if (!b->length) {
+    return;
+  }
+  size_t words = bits / 32;
+  unsigned r = bits % 32;
+  size_t length = b->length + words + 1;
+
+  /* Walks downwards so every source limb is read before it is overwritten. */
+  for (size_t i = length - 1; i > words; i--) {
+    uint32_t hi = i - words < b->length ? b->limbs[i - words] : 0;
+    uint32_t lo = b->limbs[i - words - 1];
+    b->limbs[i] = r ? (hi << r) | (lo >> (32 - r)) : hi;
+  }
+  b->limbs[words] = b->limbs[0] << r;
+  for (size_t i = 0; i < words; i++) {
+    b->limbs[i] = 0;
+  }
+
+  b->length = length;
+  while (b->length && !b->limbs[b->length - 1]) {
+    b->length--;
+  }
+}
+
+static size_t big_bits(const Big *b) {
+  if (!b->length) {
+    return 0;
+  }
+  size_t bits = 32 * (b->length - 1);
+  for (uint32_t top = b->limbs[b->length - 1]; top; top >>= 1) {
+    bits++;
+  }
+  return bits;
+}
+
+static int big_bit(const Big *b, size_t i) {
+  return i / 32 < b->length ? (b->limbs[i / 32] >> (i % 32)) & 1 : 0;
+}
+
+/* Returns 1 if any bit strictly below bit i is set. */
+static int big_any_below(const Big *b, size_t i) {
+  for (size_t j = 0; j < i / 32 && j < b->length; j++) {
+    if (b->limbs[j]) {
+      return 1;
+    }
+  }
+  return i % 32 && i / 32 < b->length &&
+         (b->limbs[i / 32] & ((UINT32_C(1) << (i % 32)) - 1));
+}
+
+/* Rounds n * 2^-shift, plus an infinitesimal if sticky is set, to the nearest
+ * Scalar, ties to even. n must have at least two more bits than kept. */
+static Scalar big_round(const Big *n, int shift, int sticky) {
+  int bits = (int)big_bits(n);
+  int exp = bits - 1 - shift;
+  int emin = SCALAR_MIN_EXP - 1;
+  int keep = exp >= emin ? SCALAR_MANT_DIG : SCALAR_MANT_DIG - (emin - exp);
+  if (keep < 0) {
+    return 0;
+  }
+
+  int drop = bits - keep;
+  uint64_t q = 0;
+  for (int i = bits - 1; i >= drop; i--) {
+    q = (q << 1) | big_bit(n, i);
+  }
+  int round = big_bit(n, drop - 1);
+  sticky |= big_any_below(n, drop - 1);
+  if (round && (sticky || (q & 1)) && !++q) {
+    /* Carried out of all 64 bits, when Scalar keeps that many. */
+    return scalar_ldexp(1, keep + drop - shift);
+  }
+  return scalar_ldexp((Scalar)q, drop - shift);
+}
+
+/* Correctly rounds the digits in [s0, s1), skipping any '.', times 10^exp10.
+ * nsig is the number of significant digits in the span. */
+static Scalar parse_slow(const char *s0, const char *s1, int nsig, int exp10) {
+  Big n = {0};
+  int kept = 0;
+  int truncated = 0;
+  for (const char *s = s0; s != s1; s++) {
+    unsigned d = (unsigned)(*s - '0');
+    if (d > 9 || (!n.length && !d)) {
+      continue;
+    } else if (kept < SCALAR_PARSE_DIGITS) {
+      big_mul_add(&n, 10, d);
+      kept++;
+    } else if (d) {
+      truncated = 1;
+    }
+  }
+  exp10 += nsig - kept;
+  /* Any nonzero digits past the limit only decide which side of a halfway
+   * case the literal falls on, so a trailing 1 stands in for all of them. */
+  if (truncated) {
+    big_mul_add(&n, 10, 1);
+    exp10--;
+  }
+
+  if (exp10 >= 0) {
+    for (int i = 0; i < exp10; i++) {
+      big_mul_add(&n, 10, 0);
+    }
+    if ((int)big_bits(&n) < SCALAR_MANT_DIG + 2) {
+      big_shl(&n, SCALAR_MANT_DIG + 2);
+      return big_round(&n, SCALAR_MANT_DIG + 2, 0);
+    }
+    return big_round(&n, 0, 0);
+  }
+
+  /* Shift left far enough that the quotient keeps SCALAR_MANT_DIG + 2 bits,
+   * using 3322 / 1000 as an upper bound on log2(10). */
+  int k = -exp10;
+  int shift = SCALAR_MANT_DIG + 3 + (k * 3322 + 999) / 1000 - (int)big_bits(&n);
+  shift = shift > 0 ? shift : 0;
+  big_shl(&n, (size_t)shift);
+  int sticky = 0;
+  for (int i = 0; i < k; i++) {
+    sticky |= !!big_div_small(&n, 10);
+  }
+  return big_round(&n, shift, sticky);
+}
+
+/* ------------------ *
+ * LITERAL PARSING    *
+ * ------------------ */
+
+#define is_digit(c) ((unsigned)((c) - '0') <= 9)
+
+/* Exponents beyond this are clamped, as they overflow or underflow anyway. */
+#define EXP_LIMIT 100000
+
+Scalar scalar_parse(const char *restrict s0, const char *restrict s1) {
+  const char *s = s0;
+  int neg = 0;
+  if (s != s1 && *s == '-') {
+    neg = 1;
+    s++;
+  }
+
+  /* Accumulate up to 19 significant digits, which always fit in m. */
+  const char *digits = s;
+  uint64_t m = 0;
+  int ndigits = 0;
+  int nsig = 0;
+  int frac = 0;
+  int seen_dot = 0;
+  for (; s != s1; s++) {
+    if (*s == '.' && !seen_dot) {
+      seen_dot = 1;
+      continue;
+    } else if (!is_digit(*s)) {
+      break;
+    }
+    ndigits++;
+    frac += seen_dot;
+    if (nsig || *s != '0') {
+      if (nsig++ < 19) {
+        m = 10 * m + (uint64_t)(*s - '0');
+      }
+    }
+  }
+  const char *digits_end = s;
+
+  int exp = 0;
+  if (ndigits && s != s1 && (*s == 'e' || *s == 'E')) {
+    const char *t = s + 1;
+    int exp_neg = 0;
+    if (t != s1 && (*t == '-' || *t == '+')) {
+      exp_neg = *t++ == '-';
+    }
+    if (t != s1 && is_digit(*t)) {
+      for (; t != s1 && is_digit(*t); t++) {
+        if (exp < EXP_LIMIT) {
+          exp = 10 * exp + (*t - '0');
+        }
+      }
+      exp = exp_neg ? -exp : exp;
+    }
+  }
+
+  if (!ndigits) {
+    return 0;
+  }
+  if (!nsig) {
+    return neg ? -(Scalar)0 : 0;
+  }
+
+  int exp10 = exp - frac;
+  /* m <= 2^SCALAR_MANT_DIG, without shifting by 64 for long double. */
+  int m_exact = (m - 1) >> (SCALAR_MANT_DIG - 1) <= 1;
+  Scalar value;
+  if (nsig <= 19 && m_exact && exp10 >= -SCALAR_EXACT_POW10 &&
+      exp10 <= SCALAR_EXACT_POW10) {
+    /* m and the power of ten are both exact, so a single correctly rounded
+     * operation gives the correctly rounded literal. */
+    value = exp10 >= 0 ? (Scalar)m * pow10s[exp10] : (Scalar)m / pow10s[-exp10];
+#if SCALAR_MANT_DIG < DBL_MANT_DIG
+  } else if (nsig <= 19 && m <= (UINT64_C(1) << DBL_MANT_DIG) &&
+             exp10 >= -DBL_EXACT_POW10 && exp10 <= DBL_EXACT_POW10 &&
+             narrow_once(m, exp10, &value)) {
+    /* Narrowed from double by narrow_once. */
+#endif
+  } else if (nsig + exp10 - 1 > SCALAR_MAX_10_EXP) {
+    value = (Scalar)INFINITY;
+  } else if (nsig + exp10 <= SCALAR_ZERO_10_EXP) {
+    value = 0;
+  } else {
+    value = parse_slow(digits, digits_end, nsig, exp10);
+  }
+  return neg ? -value : value;
+}
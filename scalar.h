@@ -0,0 +1,51 @@
+#ifndef SCALAR_H
+
+#define SCALAR_H
+
+#include <float.h>
+
+/* Scalar is float unless built with -DSCALAR_DOUBLE or -DSCALAR_LONG_DOUBLE.
+ * Like the element types of tree.h and dpx.h, it can also be any other
+ * floating type by defining SCALAR_T as the type, SCALAR_SFX as the suffix of
+ * its <math.h> functions and SCALAR_LIM as the prefix of its <float.h> limits
+ * before the first include. */
+#ifndef SCALAR_T
+#if defined(SCALAR_LONG_DOUBLE)
+#define SCALAR_T long double
+#define SCALAR_SFX l
+#define SCALAR_LIM LDBL
+#elif defined(SCALAR_DOUBLE)
+#define SCALAR_T double
+#define SCALAR_SFX
+#define SCALAR_LIM DBL
+#else
+#define SCALAR_T float
+#define SCALAR_SFX f
+#define SCALAR_LIM FLT
+#endif
+#endif
+
+typedef SCALAR_T Scalar;
+
+#define SCALAR_CONCAT_2(A, B) A##B
+#define SCALAR_CONCAT(A, B) SCALAR_CONCAT_2(A, B)
+
+/* The <math.h> function or <float.h> limit for Scalar, i.e. scalar_fn(exp) is
+ * expf and scalar_lim(MAX) is FLT_MAX for float. */
+#define scalar_fn(f) SCALAR_CONCAT(f, SCALAR_SFX)
+#define scalar_lim(l) SCALAR_CONCAT(SCALAR_LIM, _##l)
+
+#define SCALAR_MANT_DIG scalar_lim(MANT_DIG)
+#define SCALAR_MIN_EXP scalar_lim(MIN_EXP)
+#define SCALAR_MIN scalar_lim(MIN)
+#define SCALAR_MAX scalar_lim(MAX)
+#define SCALAR_MAX_10_EXP scalar_lim(MAX_10_EXP)
+#define SCALAR_EPSILON scalar_lim(EPSILON)
+
+/* Returns the value of the numeric literal between s0 inclusive and s1
+ * exclusive, correctly rounded to Scalar. Accepts an optional leading '-',
+ * digits with at most one '.', and an optional exponent, and ignores anything
+ * after the longest such prefix. */
+Scalar scalar_parse(const char *restrict s0, const char *restrict s1);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SEGMENTS_H
+
+#define SEGMENTS_H
+
+#include <stddef.h>
+
+/* Storage for the interned tables, which are appended to by id under a lock
+ * while other threads read the entries of ids they already hold. Entries live
+ * in segments of doubling length, SEG_BASE << k entries for segment k, which
+ * never move once allocated, so reads need no lock. Enough segments for 32 bit
+ * ids. */
+#define SEG_BASE 64
+#define SEGS_MAX 26
+
+#define seg_of(id) ((size_t)(63 - __builtin_clzll((id) / SEG_BASE + 1)))
+#define seg_start(seg) (SEG_BASE * (((size_t)1 << (seg)) - 1))
+#define seg_length(seg) ((size_t)SEG_BASE << (seg))
+
+/* The entry for id in the segments segs. */
+#define seg_at(segs, id) (&(segs)[seg_of(id)][(id) - seg_start(seg_of(id))])
+
+#endif
@@ -1,57 +1,305 @@
 #include "symbols.h"
+#include "segments.h"
+#include <assert.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 
-#define DPX_KT char
-#define DPX_VT Opr
-#define DPX_PFX op
-#define DPX_STRUCT_PFX Op
-#include "dpx.h"
+static Scalar add(const Scalar args[]) { return args[0] + args[1]; }
+static Scalar sub(const Scalar args[]) { return args[0] - args[1]; }
+static Scalar mul(const Scalar args[]) { return args[0] * args[1]; }
+static Scalar divi(const Scalar args[]) { return args[0] / args[1]; }
 
-OpMap *opr_set;
+static Scalar powe(const Scalar args[]) {
+  return scalar_fn(pow)(args[0], args[1]);
+}
+static Scalar expo(const Scalar args[]) { return scalar_fn(exp)(args[0]); }
+static Scalar loga(const Scalar args[]) { return scalar_fn(log)(args[0]); }
+static Scalar sine(const Scalar args[]) { return scalar_fn(sin)(args[0]); }
+static Scalar cosi(const Scalar args[]) { return scalar_fn(cos)(args[0]); }
+static Scalar tang(const Scalar args[]) { return scalar_fn(tan)(args[0]); }
+static Scalar sqrr(const Scalar args[]) { return scalar_fn(sqrt)(args[0]); }
 
-static float add(const float args[]) { return args[0] + args[1]; }
-static float sub(const float args[]) { return args[0] - args[1]; }
-static float mul(const float args[]) { return args[0] * args[1]; }
-static float divi(const float args[]) { return args[0] / args[1]; }
+/* x'y is (d/dx)(y) */
+const Opr opr_table[] = {
+    {"+", 2, 1, add, kern_add, num_add},
+    {"-", 2, 1, sub, kern_sub, num_sub},
+    {"*", 2, 2, mul, kern_mul, num_mul},
+    {"/", 2, 2, divi, kern_div, num_div},
+    {"^", 2, 3, powe, kern_pow, num_pow},
 
-static float powe(const float args[]) { return pow(args[0], args[1]); }
-static float expo(const float args[]) { return exp(args[0]); }
-static float loga(const float args[]) { return log(args[0]); }
-static float sine(const float args[]) { return sin(args[0]); }
-static float cosi(const float args[]) { return cos(args[0]); }
+    {"exp", 1, 4, expo, kern_exp, NULL},
+    {"log", 1, 4, loga, kern_log, NULL},
+    {"sin", 1, 4, sine, kern_sin, NULL},
+    {"cos", 1, 4, cosi, kern_cos, NULL},
+    {"tan", 1, 4, tang, kern_tan, NULL},
+    {"sqrt", 1, 4, sqrr, kern_sqrt, NULL},
 
-/* x'y is (d/dx)(y) */
-void opr_set_init(void) {
-  opr_set = op_create(1);
-  op_add('+', (Opr){"+", 2, 1, add}, opr_set);
-  op_add('-', (Opr){"-", 2, 1, sub}, opr_set);
-  op_add('*', (Opr){"*", 2, 2, mul}, opr_set);
-  op_add('/', (Opr){"/", 2, 2, divi}, opr_set);
-  op_add('^', (Opr){"^", 2, 3, powe}, opr_set);
+    {"\'", 2, 5, NULL, NULL, NULL},
+    {"(", 0, 0, NULL, NULL, NULL},
+    {")", 0, 0, NULL, NULL, NULL},
+};
 
-  op_add('e', (Opr){"exp", 1, 4, expo}, opr_set);
-  op_add('l', (Opr){"log", 1, 4, loga}, opr_set);
-  op_add('s', (Opr){"sin", 1, 4, sine}, opr_set);
-  op_add('c', (Opr){"cos", 1, 4, cosi}, opr_set);
+#define OPRS_LENGTH (sizeof(opr_table) / sizeof(*opr_table))
 
-  op_add('\'', (Opr){"\'", 2, 5, NULL}, opr_set);
-  op_add('(', (Opr){"(", 0, 0, NULL}, opr_set);
-  op_add(')', (Opr){")", 0, 0, NULL}, opr_set);
+const Opr *opr_get(const char s[]) {
+  for (size_t i = 0; i < OPRS_LENGTH; i++) {
+    if (!strcmp(opr_table[i].repr, s)) {
+      return &opr_table[i];
+    }
+  }
+  return NULL;
 }
 
-void opr_set_cleanup(void) { op_destroy(opr_set); }
+/* Operators are registered in a trie keyed on their full names, with a
+ * transition for every ASCII character in each node, so both whole names and
+ * one character at a time probes cost a single lookup per character. Node 0 is
+ * the root, so it doubles as "no transition". */
+#define OPR_TRIE_NODES 256
+#define OPR_TRIE_CHARS 128
 
-Opr *opr_get(const char s[]) {
-  Opr *opr = op_addr(s[0], opr_set);
-  if (!opr) {
-    return NULL;
-  } else if (!strncmp(s, opr->repr, REPR_LENGTH)) {
-    return opr;
-  } else {
+typedef struct {
+  unsigned char next[OPR_TRIE_CHARS];
+  signed char opr;
+} OprTrieNode;
+
+struct OprSet {
+  size_t nodes_length;
+  OprTrieNode nodes[OPR_TRIE_NODES];
+};
+
+_Static_assert(sizeof(opr_table) / sizeof(*opr_table) <= 128,
+               "Operator ids should fit in a trie node");
+
+static void opr_add(OprSet *set, const Opr *opr) {
+  int node = OPR_PROBE_START;
+  for (const char *c = opr->repr; *c; c++) {
+    assert((unsigned char)*c < OPR_TRIE_CHARS);
+    if (!set->nodes[node].next[(unsigned char)*c]) {
+      assert(set->nodes_length < OPR_TRIE_NODES);
+      set->nodes[set->nodes_length].opr = -1;
+      set->nodes[node].next[(unsigned char)*c] = set->nodes_length++;
+    }
+    node = set->nodes[node].next[(unsigned char)*c];
+  }
+  set->nodes[node].opr = opr_id(opr);
+}
+
+OprSet *opr_set_create(void) {
+  OprSet *set = calloc(1, sizeof(*set));
+  set->nodes[0].opr = -1;
+  set->nodes_length = 1;
+  for (size_t i = 0; i < OPRS_LENGTH; i++) {
+    opr_add(set, &opr_table[i]);
+  }
+  return set;
+}
+
+void opr_set_destroy(OprSet *set) { free(set); }
+
+#ifndef GEN_TABLES
+#include "opr_table.inc"
+#endif
+
+int opr_probe(const OprSet *set, int state, char c) {
+  if (state == OPR_PROBE_NONE || (unsigned char)c >= OPR_TRIE_CHARS) {
+    return OPR_PROBE_NONE;
+  }
+  int next = set->nodes[state].next[(unsigned char)c];
+  return next ? next : OPR_PROBE_NONE;
+}
+
+const Opr *opr_probe_get(const OprSet *set, int state) {
+  if (state == OPR_PROBE_NONE || set->nodes[state].opr < 0) {
     return NULL;
   }
+  return opr_from_id(set->nodes[state].opr);
+}
+
+const Opr *opr_span_get(const OprSet *set, const char *s0, const char *s1) {
+  int state = OPR_PROBE_START;
+  for (; s0 != s1 && state != OPR_PROBE_NONE; s0++) {
+    state = opr_probe(set, state, *s0);
+  }
+  return opr_probe_get(set, state);
+}
+
+/* Variable names are interned into an open addressing hash table of ids, with
+ * the names stored by id in segments which never move, so names can be read
+ * without the lock that interning takes. Looking a name up takes no lock
+ * either: an id is stored into its slot with release order after its name is
+ * written, and a table of slots outgrown is kept until cleanup, as readers may
+ * still be probing it. Only inserting a name takes the lock. */
+typedef struct VarSlots {
+  struct VarSlots *retired;
+  size_t cap;
+  _Atomic uint32_t slots[];
+} VarSlots;
+
+typedef struct {
+  mtx_t lock;
+  size_t length;
+  char **segs[SEGS_MAX];
+  _Atomic(VarSlots *) slots;
+} VarSet;
+
+/* Slots hold id + 1, so 0 marks an empty slot. */
+#define VAR_SET_CAP 128
+
+/* Returned by var_slots_find for a name not in the table. */
+#define VAR_NONE UINT32_MAX
+
+VarSet *var_set;
+VarSet *patt_var_set;
+
+static VarSlots *var_slots_create(size_t cap, VarSlots *retired) {
+  VarSlots *slots = calloc(1, sizeof(*slots) + cap * sizeof(*slots->slots));
+  slots->retired = retired;
+  slots->cap = cap;
+  return slots;
+}
+
+static VarSet *var_set_create(void) {
+  VarSet *set = calloc(1, sizeof(*set));
+  mtx_init(&set->lock, mtx_plain);
+  atomic_init(&set->slots, var_slots_create(VAR_SET_CAP, NULL));
+  return set;
+}
+
+static void var_set_destroy(VarSet *set) {
+  for (size_t id = 0; id < set->length; id++) {
+    free(*seg_at(set->segs, id));
+  }
+  for (size_t seg = 0; seg < SEGS_MAX; seg++) {
+    free(set->segs[seg]);
+  }
+  VarSlots *slots = atomic_load(&set->slots);
+  while (slots) {
+    VarSlots *retired = slots->retired;
+    free(slots);
+    slots = retired;
+  }
+  mtx_destroy(&set->lock);
+  free(set);
+}
+
+/* FNV-1a */
+static uint32_t name_hash(const char *s0, const char *s1) {
+  uint32_t hash = 2166136261u;
+  for (; s0 != s1; s0++) {
+    hash = (hash ^ (unsigned char)*s0) * 16777619u;
+  }
+  return hash;
+}
+
+static int name_is_equal(const char name[], const char *s0, const char *s1) {
+  return !strncmp(name, s0, s1 - s0) && !name[s1 - s0];
+}
+
+/* Returns the id of the name in slots, or VAR_NONE with the empty slot it would
+ * go in through slot. */
+static uint32_t var_slots_find(const VarSet *set, VarSlots *slots,
+                               uint32_t hash, const char *s0, const char *s1,
+                               size_t *slot) {
+  size_t i = hash & (slots->cap - 1);
+  uint32_t id;
+  for (; (id = atomic_load_explicit(&slots->slots[i], memory_order_acquire));
+       i = (i + 1) & (slots->cap - 1)) {
+    if (name_is_equal(*seg_at(set->segs, id - 1), s0, s1)) {
+      return id - 1;
+    }
+  }
+  *slot = i;
+  return VAR_NONE;
+}
+
+/* Keeps the table at most half full, so probe sequences stay short. The new
+ * table is filled before it is published. */
+static void var_set_grow(VarSet *set) {
+  VarSlots *old = atomic_load_explicit(&set->slots, memory_order_relaxed);
+  VarSlots *slots = var_slots_create(2 * old->cap, old);
+  for (size_t id = 0; id < set->length; id++) {
+    const char *name = *seg_at(set->segs, id);
+    size_t i = name_hash(name, name + strlen(name)) & (slots->cap - 1);
+    while (atomic_load_explicit(&slots->slots[i], memory_order_relaxed)) {
+      i = (i + 1) & (slots->cap - 1);
+    }
+    atomic_store_explicit(&slots->slots[i], id + 1, memory_order_relaxed);
+  }
+  atomic_store_explicit(&set->slots, slots, memory_order_release);
+}
+
+static uint32_t var_set_intern(VarSet *set, const char *s0, const char *s1) {
+  uint32_t hash = name_hash(s0, s1);
+  size_t i;
+  VarSlots *slots = atomic_load_explicit(&set->slots, memory_order_acquire);
+  uint32_t id = var_slots_find(set, slots, hash, s0, s1, &i);
+  if (id != VAR_NONE) {
+    return id;
+  }
+
+  /* Another thread may have inserted the name, or grown the table, since. */
+  mtx_lock(&set->lock);
+  slots = atomic_load_explicit(&set->slots, memory_order_relaxed);
+  id = var_slots_find(set, slots, hash, s0, s1, &i);
+  if (id != VAR_NONE) {
+    mtx_unlock(&set->lock);
+    return id;
+  }
+
+  id = set->length++;
+  assert(id < VAR_SCALAR && seg_of(id) < SEGS_MAX);
+  if (!set->segs[seg_of(id)]) {
+    set->segs[seg_of(id)] = malloc(seg_length(seg_of(id)) * sizeof(char *));
+  }
+  char *name = malloc(s1 - s0 + 1);
+  memcpy(name, s0, s1 - s0);
+  name[s1 - s0] = '\0';
+  *seg_at(set->segs, id) = name;
+  atomic_store_explicit(&slots->slots[i], id + 1, memory_order_release);
+  if (2 * set->length >= slots->cap) {
+    var_set_grow(set);
+  }
+  mtx_unlock(&set->lock);
+  return id;
+}
+
+void var_set_init(void) {
+  var_set = var_set_create();
+  patt_var_set = var_set_create();
+  var_get("#");
+  for (char c = 'a'; c <= 'z'; c++) {
+    patt_var_intern(&c, &c + 1);
+  }
+}
+
+void var_set_cleanup(void) {
+  var_set_destroy(var_set);
+  var_set_destroy(patt_var_set);
+}
+
+Var var_intern(const char *s0, const char *s1) {
+  return var_set_intern(var_set, s0, s1);
+}
+
+Var var_get(const char name[]) { return var_intern(name, name + strlen(name)); }
+
+Var patt_var_intern(const char *s0, const char *s1) {
+  return var_set_intern(patt_var_set, s0, s1) | VAR_PATTERN;
+}
+
+Var patt_var_get(const char name[]) {
+  return patt_var_intern(name, name + strlen(name));
+}
+
+const char *var_name(Var var) {
+  if (var_is_pattern(var)) {
+    return *seg_at(patt_var_set->segs, var & ~(VAR_PATTERN | VAR_SCALAR));
+  }
+  return *seg_at(var_set->segs, var);
 }
 
 int opr_cmp(const Opr *opr1, const Opr *opr2) {
@@ -64,20 +312,38 @@ int opr_cmp(const Opr *opr1, const Opr *opr2) {
   }
 }
 
+NumId opr_eval(const Opr *opr, const NumId args[]) {
+  Number nums[2];
+  int exact = 1;
+  for (int i = 0; i < opr->arity; i++) {
+    nums[i] = *num_get(args[i]);
+    exact &= num_is_exact(&nums[i]);
+  }
+  Number out;
+  if (exact && opr->exact && opr->exact(nums, &out)) {
+    return num_intern(&out);
+  }
+
+  Scalar reals[2];
+  for (int i = 0; i < opr->arity; i++) {
+    reals[i] = num_to_scalar(&nums[i]);
+  }
+  return num_from_scalar(opr->func(reals));
+}
+
 int tok_is_equal(Token token1, Token token2) {
   if (token1.token_type != token2.token_type) {
     return 0;
   } else {
     switch (token1.token_type) {
     case SCALAR:
-      /* TODO: add epsilon difference */
-      return token1.scalar == token2.scalar;
+      return token1.num == token2.num;
       break;
     case VAR:
       return token1.var == token2.var;
       break;
     case OPR:
-      return token1.opr == token2.opr;
+      return token1.opr_id == token2.opr_id;
       break;
     }
   }
@@ -86,13 +352,13 @@ int tok_is_equal(Token token1, Token token2) {
 void tok_print(Token token) {
   switch (token.token_type) {
   case SCALAR:
-    printf("%.2f", token.scalar);
+    printf("%.2f", (double)num_to_scalar(num_get(token.num)));
     break;
   case VAR:
-    printf("%c", token.var);
+    printf("%s", var_name(token.var));
     break;
   case OPR:
-    printf("%s", token.opr->repr);
+    printf("%s", tok_opr(token)->repr);
     break;
   }
 }
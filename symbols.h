@@ -2,39 +2,125 @@
 
 #define SYMBOLS_H
 
-#define REPR_LENGTH 4
+#include "kernel.h"
+#include "number.h"
+#include "scalar.h"
+#include <stdint.h>
 
+#define REPR_LENGTH 8
+
+/* func evaluates the operator at one point, and kernel over many points. exact
+ * evaluates it on exact numbers where it can, as in number.h. */
 typedef struct {
   char repr[REPR_LENGTH];
   int arity;
   int precedence;
-  float (*func)(const float *args);
+  Scalar (*func)(const Scalar *args);
+  Kernel kernel;
+  int (*exact)(const Number *args, Number *out);
 } Opr;
 
-/* Initialise and cleanup global operator definitions. */
-void opr_set_init(void);
-void opr_set_cleanup(void);
-Opr *opr_get(const char s[]);
+/* Every operator, in a fixed order, so tokens refer to them by a 32 bit index
+ * into opr_table rather than a pointer. Read only, so shared by every engine
+ * and thread. */
+typedef uint32_t OprId;
+
+extern const Opr opr_table[];
+
+#define opr_from_id(id) (&opr_table[(id)])
+#define opr_id(opr) ((OprId)((opr) - opr_table))
+
+/* Returns the operator named s, or NULL. */
+const Opr *opr_get(const char s[]);
+
+/* The operators recognised by the lexer. */
+typedef struct OprSet OprSet;
+
+/* Create a set of every operator in opr_table. */
+OprSet *opr_set_create(void);
+void opr_set_destroy(OprSet *set);
+
+/* The same set as opr_set_create's, precompiled by gen_tables into static
+ * data, so it needs no building and is shared by every engine. Not defined in
+ * the build of gen_tables itself, with GEN_TABLES defined. */
+extern const OprSet opr_set_builtin;
+const Opr *opr_span_get(const OprSet *set, const char *s0, const char *s1);
+
+/* Look up an operator name in set one character at a time. Start from
+ * OPR_PROBE_START and feed each character to opr_probe, which returns
+ * OPR_PROBE_NONE once no operator name has the characters so far as a prefix.
+ * opr_probe_get returns the operator named by exactly the characters so far,
+ * or NULL. */
+#define OPR_PROBE_START 0
+#define OPR_PROBE_NONE (-1)
+int opr_probe(const OprSet *set, int state, char c);
+const Opr *opr_probe_get(const OprSet *set, int state);
 
 /* Return 1 if opr1 is higher precedence than opr2, -1 if opr is lower
  * precedence, and 0 if equal, i.e. >  */
 int opr_cmp(const Opr *opr1, const Opr *opr2);
 
-typedef float Scalar;
-typedef char Var;
+/* Variables are interned, so a Var is a dense index into a table of names.
+ * Pattern variables, which bind to subexpressions in transform rules, are
+ * interned separately from user variables, and their ids have VAR_PATTERN
+ * set. */
+typedef uint32_t Var;
+
+#define VAR_PATTERN (UINT32_C(1) << 31)
+#define var_is_pattern(var) (!!((var) & VAR_PATTERN))
+
+/* Pattern variables with VAR_SCALAR set only bind to scalars. Set by the
+ * engine on the pattern variables it declares scalar, so it is not part of the
+ * interned id. */
+#define VAR_SCALAR (UINT32_C(1) << 30)
 
+/* The single lowercase letters are interned first by var_set_init as pattern
+ * variables, so their ids are known at compile time for precompiled rules. */
+#define patt_var_letter(c) (VAR_PATTERN | (Var)((c) - 'a'))
+
+/* Reserved for the dummy parent of expression roots. */
+#define VAR_ROOT ((Var)0)
+
+/* Initialise and cleanup global variable names, once per process. In between,
+ * any number of threads may intern and read names. */
+void var_set_init(void);
+void var_set_cleanup(void);
+
+/* Return the id of the name between s0 inclusive and s1 exclusive, or of the
+ * null terminated name, interning it if new. */
+Var var_intern(const char *s0, const char *s1);
+Var var_get(const char name[]);
+Var patt_var_intern(const char *s0, const char *s1);
+Var patt_var_get(const char name[]);
+
+const char *var_name(Var var);
+
+/* A tag alongside a 32 bit payload, 8 bytes in all. Numeric constants are
+ * SCALAR tokens holding the id of an interned Number. */
 typedef enum { SCALAR, VAR, OPR } TOKEN_TYPE;
 typedef struct {
   TOKEN_TYPE token_type;
   union {
-    Scalar scalar;
+    NumId num;
     Var var;
-    Opr *opr;
+    OprId opr_id;
   };
 } Token;
 
+_Static_assert(sizeof(Token) <= 8, "Token should fit in 8 bytes");
+
+#define tok_opr(token) opr_from_id((token).opr_id)
+
+/* Returns the number id of opr applied to the numbers args, exactly if opr has
+ * an exact function and the arguments are exact, and through func otherwise. */
+NumId opr_eval(const Opr *opr, const NumId args[]);
+
 int tok_is_equal(Token token1, Token token2);
 
+/* Equal for tokens tok_is_equal finds equal. */
+#define tok_hash(token)                                                        \
+  ((size_t)((uint64_t)(token).token_type << 32 | (token).num))
+
 #ifdef SYMBOLS_DEBUG
 void tok_print(Token token);
 #endif
@@ -6,8 +6,15 @@
 #include "symbols.h"
 #include <assert.h>
 #include <stdio.h>
+#include <threads.h>
 
-void opr_set_setup(void) { opr_set_init(); }
+Engine *engine;
+
+void engine_setup(void) {
+  var_set_init();
+  num_set_init();
+  engine = engine_create();
+}
 
 #define ASSERT_TOKEN_EQUAL(token1, token2)                                     \
   do {                                                                         \
@@ -24,31 +31,33 @@ void opr_set_setup(void) { opr_set_init(); }
     }                                                                          \
   } while (0)
 
+#define NUM_TOKEN(s) ((Token){SCALAR, {num_parse_str(s)}})
+
 #define VAR_OPR_TOKENS_SETUP()                                                 \
   Token add = {.token_type = OPR};                                             \
-  add.opr = opr_get("+");                                                      \
+  add.opr_id = opr_id(opr_get("+"));                                           \
   Token sub = {.token_type = OPR};                                             \
-  sub.opr = opr_get("-");                                                      \
+  sub.opr_id = opr_id(opr_get("-"));                                           \
   Token mul = {.token_type = OPR};                                             \
-  mul.opr = opr_get("*");                                                      \
+  mul.opr_id = opr_id(opr_get("*"));                                           \
   Token divi = {.token_type = OPR};                                            \
-  divi.opr = opr_get("/");                                                     \
+  divi.opr_id = opr_id(opr_get("/"));                                          \
   Token exp = {.token_type = OPR};                                             \
-  exp.opr = opr_get("exp");                                                    \
+  exp.opr_id = opr_id(opr_get("exp"));                                         \
   Token lp = {.token_type = OPR};                                              \
-  lp.opr = opr_get("(");                                                       \
+  lp.opr_id = opr_id(opr_get("("));                                            \
   Token rp = {.token_type = OPR};                                              \
-  rp.opr = opr_get(")");                                                       \
+  rp.opr_id = opr_id(opr_get(")"));                                            \
                                                                                \
   Token x = {.token_type = VAR};                                               \
-  x.var = 'x';                                                                 \
+  x.var = var_get("x");                                                        \
   Token b = {.token_type = VAR};                                               \
-  b.var = 'b';                                                                 \
+  b.var = var_get("b");                                                        \
   Token c = {.token_type = VAR};                                               \
-  c.var = 'c';                                                                 \
+  c.var = var_get("c");                                                        \
                                                                                \
   Token dummy = {.token_type = VAR};                                           \
-  dummy.var = '#';
+  dummy.var = VAR_ROOT;
 
 struct test_exprs_formats {
   char s[32];
@@ -66,24 +75,24 @@ void test_exprs_setup(void) {
   test_exprs_all[0] = (struct test_exprs_formats){
       "3 *(x + 2)",
       {
-          (Token){SCALAR, {3.0}},
+          NUM_TOKEN("3.0"),
           mul,
           lp,
           x,
           add,
-          (Token){SCALAR, {2.0}},
+          NUM_TOKEN("2.0"),
           rp,
       },
       ast_join(dummy,
                ast_join(mul,
 
-                        ast_leaf((Token){SCALAR, {3.0}}),
+                        ast_leaf(NUM_TOKEN("3.0")),
 
                         ast_join(add,
 
                                  ast_leaf(x),
 
-                                 ast_leaf((Token){SCALAR, {2.0}})
+                                 ast_leaf(NUM_TOKEN("2.0"))
 
                                      )
 
@@ -95,7 +104,7 @@ void test_exprs_setup(void) {
   test_exprs_all[1] = (struct test_exprs_formats){
       "1.5/ (b + exp( c ))",
       {
-          (Token){SCALAR, {1.5}},
+          NUM_TOKEN("1.5"),
           divi,
           lp,
           b,
@@ -109,7 +118,7 @@ void test_exprs_setup(void) {
       ast_join(dummy,
                ast_join(divi,
 
-                        ast_leaf((Token){SCALAR, {1.5}}),
+                        ast_leaf(NUM_TOKEN("1.5")),
 
                         ast_join(add,
 
@@ -136,7 +145,7 @@ void test_exprs_setup(void) {
           exp,
           x,
           sub,
-          (Token){SCALAR, {-7.8}},
+          NUM_TOKEN("-7.8"),
           mul,
           x,
       },
@@ -149,7 +158,7 @@ void test_exprs_setup(void) {
 
                         ast_join(mul,
 
-                                 ast_leaf((Token){SCALAR, {-7.8}}),
+                                 ast_leaf(NUM_TOKEN("-7.8")),
 
                                  ast_leaf(x)
 
@@ -173,7 +182,7 @@ void test_tok_cmp(void) { ; }
 
 void test_lexer_2(void) {
   for (int i = 0; i < NUM_EXPRS; i++) {
-    Token *tokens = lexer(test_exprs_all[0].s);
+    Token *tokens = lexer(engine->oprs, test_exprs_all[0].s);
     for (int j = 0; j < fp_length(tokens); j++) {
       ASSERT_TOKEN_EQUAL(tokens[j], test_exprs_all[0].tokens[j]);
     }
@@ -184,16 +193,16 @@ void test_lexer_2(void) {
 }
 
 void test_expr_is_equal(void) {
-  Expression ast_s = expr_create("  exp(7- 5.2)");
-  Expression ast_t = expr_create("exp ( 7 - 5.2) ");
+  Expression ast_s = expr_create(engine, "  exp(7- 5.2)");
+  Expression ast_t = expr_create(engine, "exp ( 7 - 5.2) ");
   assert(expr_is_equal(ast_s, ast_t));
 
-  Expression ast_u = expr_create("exp (7 / 5.2)  ");
+  Expression ast_u = expr_create(engine, "exp (7 / 5.2)  ");
   assert(!expr_is_equal(ast_s, ast_u));
 
-  Expression ast_a = expr_create("1 + x + 3");
-  Expression ast_b = expr_create("1 + 3 + x");
-  Expression ast_c = expr_create("1 + (x + 3)");
+  Expression ast_a = expr_create(engine, "1 + x + 3");
+  Expression ast_b = expr_create(engine, "1 + 3 + x");
+  Expression ast_c = expr_create(engine, "1 + (x + 3)");
 
   assert(!expr_is_equal(ast_a, ast_b));
   assert(!expr_is_equal(ast_a, ast_c));
@@ -209,7 +218,9 @@ void test_expr_is_equal(void) {
 
 void test_shunting_yard(void) {
   for (int i = 0; i < NUM_EXPRS; i++) {
-    Ast_Node *expr = shunting_yard(lexer(test_exprs_all[i].s));
+    Token tokens[16];
+    size_t length = lexer_buf(engine->oprs, test_exprs_all[i].s, tokens, 16);
+    Ast_Node *expr = shunting_yard(tokens, length);
     Ast_Node *expected = test_exprs_all[i].tree->lchild;
     assert(ast_is_equal(expr, expected, tok_is_equal));
     ast_destroy(expr);
@@ -218,10 +229,78 @@ void test_shunting_yard(void) {
   printf("%s passed\n", __func__);
 }
 
+void test_pratt_parse(void) {
+  char *inputs[] = {
+      "3 *(x + 2)",        "1 - b/c",          "2 ^ 3 ^ 4",
+      "sin x ^ 2",         "sin x ' y ^ 2",    "2 ^ sin x ^ 3",
+      "x ' sin y * z",     "x ' sin y ' z",    "sin (x) ^ 2",
+      "sin (x) ' y",       "exp log (x) ' y",  "sin ((x)) ' y",
+      "-1 * sin f * x'f",  "c * f ^ (c - 1) * x'f",
+      "2 x y - sin 11",    "(x'f * g) + (f * x'g)",
+      "exp(2 x) / (1 + cos(x^2))",
+  };
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+    Expression expr = expr_create(engine, inputs[i]);
+    Expression expected = expr_sy_create(engine, inputs[i]);
+    assert(expr_is_equal(expr, expected));
+    expr_destroy(expr);
+    expr_destroy(expected);
+  }
+
+  printf("%s passed\n", __func__);
+}
+
+void test_pratt_parse_errors(void) {
+  char *inputs[] = {
+      "x +", "(x",       "sin",      "x)", ")",
+      "* x", "x + * y", "(x + 2))", "",   "x $ y",
+  };
+  Expression expr;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+    expr = expr_create(engine, inputs[i]);
+    assert(expr_is_empty(expr));
+    expr_destroy(expr);
+  }
+  /* Nesting past PRATT_MAX_DEPTH is an error rather than a stack overflow. */
+  size_t depth = 16 * PRATT_MAX_DEPTH;
+  char *nested = malloc(4 * depth + 2);
+  memset(nested, '(', depth);
+  memset(nested + depth, 'x', 1);
+  memset(nested + depth + 1, ')', depth);
+  nested[2 * depth + 1] = '\0';
+  expr = expr_create(engine, nested);
+  assert(expr_is_empty(expr));
+  expr_destroy(expr);
+  for (size_t i = 0; i < depth; i++) {
+    memcpy(nested + 4 * i, "sin ", 4);
+  }
+  memcpy(nested + 4 * depth, "x", 2);
+  expr = expr_create(engine, nested);
+  assert(expr_is_empty(expr));
+  expr_destroy(expr);
+  depth = PRATT_MAX_DEPTH / 2;
+  memset(nested, '(', depth);
+  memset(nested + depth, 'x', 1);
+  memset(nested + depth + 1, ')', depth);
+  nested[2 * depth + 1] = '\0';
+  expr = expr_create(engine, nested);
+  assert(!expr_is_empty(expr));
+  expr_destroy(expr);
+  free(nested);
+
+  char span[] = "(x + y) * 2";
+  assert(expr_is_empty(expr_span_create(engine, span, span + 5)));
+  expr = expr_span_create(engine, span, span + 7);
+  assert(!expr_is_empty(expr));
+  expr_destroy(expr);
+
+  printf("%s passed\n", __func__);
+}
+
 void test_expr_create(void) {
   for (int i = 0; i < NUM_EXPRS; i++) {
-    Expression expr = expr_create(test_exprs_all[i].s);
-    Expression expected = {test_exprs_all[i].tree};
+    Expression expr = expr_create(engine, test_exprs_all[i].s);
+    Expression expected = {.dummy_parent = test_exprs_all[i].tree};
     assert(expr_is_equal(expr, expected));
     expr_destroy(expr);
   }
@@ -229,6 +308,64 @@ void test_expr_create(void) {
   printf("%s passed\n", __func__);
 }
 
+void test_node_pool(void) {
+  Expression expr = expr_create(engine, "x - (exp x)");
+  Expression copy = expr_copy(expr);
+  assert(copy.pool && copy.pool != expr.pool);
+  assert(expr.pool->slabs && !expr.pool->slabs->next);
+
+  /* Freed nodes are reused, and nodes left over are freed with the pool. */
+  NodePool *prev = pool_enter(expr.pool);
+  Ast_Node *leaf = ast_leaf(get_root(expr)->value);
+  ast_destroy(leaf);
+  Ast_Node *reused = ast_leaf(get_root(expr)->value);
+  assert(reused == leaf);
+  for (int i = 0; i < 2 * POOL_SLAB_MIN; i++) {
+    ast_leaf(get_root(expr)->value);
+  }
+  assert(expr.pool->slabs->next);
+  pool_enter(prev);
+
+  expr_destroy(expr);
+  expr_destroy(copy);
+  printf("%s passed\n", __func__);
+}
+
+void test_expr_compact(void) {
+  Expression expr = expr_create(engine, "x ' (sin x * cos x * exp x)");
+  Expression expected = expr_copy(expr);
+  Ast_Node *dummy = expr.dummy_parent;
+
+  /* Rewritten without compacting, the nodes rewrites freed are left. */
+  for (size_t i = 0; i < fp_length(engine->diff_rules); i++) {
+    expr_apply(expr, T_PRE, &match_trans, engine->diff_rules + i);
+    expr_apply(expected, T_PRE, &match_trans, engine->diff_rules + i);
+  }
+  assert(expr.pool->free_list);
+
+  /* Then the tree is the same, in one slab in pre-order, with nothing free. */
+  expr_compact(expr);
+  assert(expr.dummy_parent == dummy && expr_is_equal(expr, expected));
+  assert(!expr.pool->slabs->next && !expr.pool->free_list);
+  assert(pool_carved(expr.pool) == ast_size(get_root(expr)));
+  Ast_Node *next = get_root(expr);
+  Ast_Iter it;
+  ast_iter_init(&it, get_root(expr), T_PRE);
+  for (Ast_Node *node = ast_begin(&it); !ast_end(&it); node = ast_next(&it)) {
+    assert(node == next++);
+    assert(node->parent->lchild == node || node->parent->rchild == node);
+  }
+
+  /* And is rewritten as before. */
+  norm_apply(engine, expr);
+  norm_apply(engine, expected);
+  assert(expr_is_equal(expr, expected));
+
+  expr_destroy(expr);
+  expr_destroy(expected);
+  printf("%s passed\n", __func__);
+}
+
 void test_ast_copy(void) {
   for (int i = 0; i < NUM_EXPRS; i++) {
     Ast_Node *original = test_exprs_all[i].tree;
@@ -241,10 +378,16 @@ void test_ast_copy(void) {
 }
 
 void test_ast_rotate_ccw(void) {
-  Expression expr = expr_create("3 * (x  + 2)");
-  Expression expected = expr_create("(3 * x) + 2");
+  Expression expr = expr_create(engine, "3 * (x  + 2)");
+  Expression expected = expr_create(engine, "(3 * x) + 2");
 
+  NodePool *prev = pool_enter(expr.pool);
+  uint32_t hash = ast_hash(get_root(expr));
   ast_rotate_ccw(get_root(expr));
+  pool_enter(prev);
+  assert(ast_hash(get_root(expr)) != hash);
+  assert(ast_hash(get_root(expr)) == ast_hash(get_root(expected)));
+  assert(ast_size(expr.dummy_parent) == 6);
   assert(expr_is_equal(expr, expected));
 
   expr_destroy(expr);
@@ -252,45 +395,60 @@ void test_ast_rotate_ccw(void) {
   printf("%s passed\n", __func__);
 }
 
+/* Applies trans at node, in the pool of its expression, as expr_it_apply
+ * does. */
+static void node_apply(Expression expr, Ast_Node *node,
+                       void trans(Ast_Node *, void *), void *ctx) {
+  NodePool *prev = pool_enter(expr.pool);
+  trans(node, ctx);
+  pool_enter(prev);
+}
+
 void test_eval_apply(void) {
-  Expression expr1 = expr_create("4 - 9");
-  Expression expr2 = expr_create("2 / 3.9 - 4");
-  Expression expr3 = expr_create("1.1 + 5");
+  Expression expr1 = expr_create(engine, "4 - 9");
+  Expression expr2 = expr_create(engine, "2 / 3.9 - 4");
+  Expression expr3 = expr_create(engine, "1.1 + 5");
+  Expression expr4 = expr_create(engine, "0.1 + 0.2");
   struct CtxAll ctx = {0, NULL};
 
-  eval_apply(get_root(expr1), &ctx);
-  assert(get_root(expr1)->value.scalar == -5);
+  node_apply(expr1, get_root(expr1), eval_apply, &ctx);
+  assert(get_root(expr1)->value.num == num_from_int(-5));
   assert(!get_root(expr1)->lchild);
-  eval_apply(get_root(expr2), &ctx);
+  node_apply(expr2, get_root(expr2), eval_apply, &ctx);
   assert(get_root(expr2)->value.token_type == OPR);
-  eval_apply(get_root(expr3), &ctx);
-  assert(get_root(expr3)->value.scalar - 6.1 < 0.01);
+  node_apply(expr3, get_root(expr3), eval_apply, &ctx);
+  assert(get_root(expr3)->value.num == num_parse_str("6.1"));
   assert(!get_root(expr1)->rchild);
 
+  /* Folded exactly, where 0.1f + 0.2f != 0.3f. */
+  node_apply(expr4, get_root(expr4), eval_apply, &ctx);
+  assert(get_root(expr4)->value.num == num_parse_str("0.3"));
+
   expr_destroy(expr1);
   expr_destroy(expr2);
   expr_destroy(expr3);
+  expr_destroy(expr4);
   printf("%s passed\n", __func__);
 }
 
 void test_id_apply(void) {
-  Expression expr1 = expr_create("0 + x");
-  Expression expr2 = expr_create("(5 - exp x)* 1");
-  struct CtxAll add_0_ctx = {0, simpls};
-  struct CtxAll mul_1_ctx = {0, simpls + 1};
+  Expression expr1 = expr_create(engine, "0 + x");
+  Expression expr2 = expr_create(engine, "(5 - exp x)* 1");
+  struct CtxAll add_0_ctx = {0, engine->simpls};
+  struct CtxAll mul_1_ctx = {0, engine->simpls + 1};
 
-  Expression expected_expr1 = expr_create("x");
-  Expression expected_expr2 = expr_create("5 - exp x");
+  Expression expected_expr1 = expr_create(engine, "x");
+  Expression expected_expr2 = expr_create(engine, "5 - exp x");
 
-  id_apply(get_root(expr1), &add_0_ctx);
-  id_apply(get_root(expr2), &mul_1_ctx);
+  node_apply(expr1, get_root(expr1), id_apply, &add_0_ctx);
+  node_apply(expr2, get_root(expr2), id_apply, &mul_1_ctx);
   assert(expr_is_equal(expr1, expected_expr1));
   assert(expr_is_equal(expr2, expected_expr2));
 
-  Expression expr3 = expr_create("(x + 0) / y");
-  struct CtxAll add_0_ctx2 = {0, simpls};
-  Expression expected_expr3 = expr_create("x / y");
-  id_apply(get_root(expr3)->lchild, &add_0_ctx2);
+  Expression expr3 = expr_create(engine, "(x + 0) / y");
+  struct CtxAll add_0_ctx2 = {0, engine->simpls};
+  Expression expected_expr3 = expr_create(engine, "x / y");
+  node_apply(expr3, get_root(expr3)->lchild, id_apply, &add_0_ctx2);
 
   assert(expr_is_equal(expr3, expected_expr3));
 
@@ -304,14 +462,14 @@ void test_id_apply(void) {
 }
 
 void test_ann_apply(void) {
-  Expression expr = expr_create("(3 * 0) * (2 * a - 4)");
-  struct CtxAll mul_0_ctx = {0, simpls + 2};
-  Expression expected_expr1 = expr_create("0 * (2 *a - 4 )");
-  Expression expected_expr2 = expr_create("0");
+  Expression expr = expr_create(engine, "(3 * 0) * (2 * a - 4)");
+  struct CtxAll mul_0_ctx = {0, engine->simpls + 2};
+  Expression expected_expr1 = expr_create(engine, "0 * (2 *a - 4 )");
+  Expression expected_expr2 = expr_create(engine, "0");
 
-  ann_apply(get_root(expr)->lchild, &mul_0_ctx);
+  node_apply(expr, get_root(expr)->lchild, ann_apply, &mul_0_ctx);
   assert(expr_is_equal(expr, expected_expr1));
-  ann_apply(get_root(expr), &mul_0_ctx);
+  node_apply(expr, get_root(expr), ann_apply, &mul_0_ctx);
   assert(expr_is_equal(expr, expected_expr2));
 
   expr_destroy(expr);
@@ -321,11 +479,11 @@ void test_ann_apply(void) {
 }
 
 void test_assoc_apply(void) {
-  Expression expr = expr_create("3 + (x + exp y)");
-  Expression expected = expr_create("3 + x + exp y");
+  Expression expr = expr_create(engine, "3 + (x + exp y)");
+  Expression expected = expr_create(engine, "3 + x + exp y");
   struct CtxAll add_assoc_ctx = {0, opr_get("+")};
 
-  assoc_apply(get_root(expr), &add_assoc_ctx);
+  node_apply(expr, get_root(expr), assoc_apply, &add_assoc_ctx);
   assert(expr_is_equal(expr, expected));
 
   expr_destroy(expr);
@@ -333,40 +491,123 @@ void test_assoc_apply(void) {
   printf("%s passed\n", __func__);
 }
 
+void test_nary_apply(void) {
+  char *inputs[][2] = {
+      {"c + (b + (a + d))", "a + b + c + d"},
+      {"x + y + x + x", "y + 3 * x"},
+      {"x * 2 * (x * y)", "2 * y * x ^ 2"},
+      {"x + x", "2 * x"},
+      /* Like operands whose count would overflow are left uncombined. */
+      {"9223372036854775807 * x + x", "x + 9223372036854775807 * x"},
+      {"x ^ 9223372036854775807 * x", "x * x ^ 9223372036854775807"},
+  };
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+    Expression expr = expr_create(engine, inputs[i][0]);
+    Expression expected = expr_create(engine, inputs[i][1]);
+    Expression shared = expr_share(expr);
+    const struct Nary *nary = engine->narys + (i == 2 || i == 5);
+
+    struct CtxAll ctx = {0, nary};
+    node_apply(expr, get_root(expr), nary_apply, &ctx);
+    assert(ctx.changed && expr_is_equal(expr, expected));
+    ctx.changed = 0;
+    node_apply(expr, get_root(expr), nary_apply, &ctx);
+    assert(!ctx.changed);
+
+    assert(expr_apply(shared, T_PRE, &nary_trans, nary));
+    assert(expr_is_equal(shared, expected));
+    assert(!expr_apply(shared, T_PRE, &nary_trans, nary));
+
+    expr_destroy(expr);
+    expr_destroy(expected);
+    expr_destroy(shared);
+  }
+
+  /* Chains far deeper than the call stack goes. */
+  size_t terms = 100000;
+  char *sum = malloc(2 * terms);
+  for (size_t i = 0; i < terms; i++) {
+    sum[2 * i] = 'x';
+    sum[2 * i + 1] = i + 1 < terms ? '+' : '\0';
+  }
+  Expression expr = expr_create(engine, sum);
+  Expression expected = expr_create(engine, "100000 * x");
+  struct CtxAll ctx = {0, engine->narys};
+  node_apply(expr, get_root(expr), nary_apply, &ctx);
+  assert(ctx.changed && expr_is_equal(expr, expected));
+  expr_destroy(expr);
+  expr_destroy(expected);
+  free(sum);
+
+  printf("%s passed\n", __func__);
+}
+
 void test_var_match(void) {
-  Expression expr = expr_create("3 ^ y");
+  Expression expr = expr_create(engine, "3 ^ y");
 
-  assert(var_match('f', get_root(expr)));
-  assert(!var_match('c', get_root(expr)));
-  assert(var_match('c', get_root(expr)->lchild));
+  Var f = patt_var_get("f");
+  Var c = patt_var_get("c") | VAR_SCALAR;
+  assert(var_match(f, get_root(expr)));
+  assert(!var_match(c, get_root(expr)));
+  assert(var_match(c, get_root(expr)->lchild));
 
   expr_destroy(expr);
   printf("%s passed\n", __func__);
 }
 
 void test_match(void) {
-  Expression pattern = expr_create("f + 2");
-  Expression expr = expr_create("(-5 / y) + 2");
-
-  BindMap *bindings = bind_create(1);
-  assert(match(get_root(pattern), get_root(expr), bindings));
-  assert(bind_size(bindings) == 1);
-  assert(bind_is_in('f', bindings));
-  assert(ast_is_equal(bind_get('f', bindings), get_root(expr)->lchild,
+  Expression pattern = patt_create(engine, "f + 2");
+  Expression expr = expr_create(engine, "(-5 / y) + 2");
+  Var f = patt_var_get("f");
+
+  Bindings bindings;
+  bindings_init(&bindings);
+  assert(match(get_root(pattern), get_root(expr), &bindings));
+  assert(bindings.length == 1);
+  assert(bindings_get(&bindings, f));
+  assert(ast_is_equal(*bindings_get(&bindings, f), get_root(expr)->lchild,
                       tok_is_equal));
+  expr_destroy(pattern);
+  bindings_cleanup(&bindings);
 
+  /* Variables outside of patterns only match themselves. */
+  pattern = expr_create(engine, "f + 2");
+  bindings_init(&bindings);
+  assert(!match(get_root(pattern), get_root(expr), &bindings));
   expr_destroy(pattern);
+  pattern = expr_create(engine, "(-5 / y) + 2");
+  assert(match(get_root(pattern), get_root(expr), &bindings));
+  assert(bindings.length == 0);
+  expr_destroy(pattern);
+  bindings_cleanup(&bindings);
+
+  /* Repeated variables match equal subtrees, past the inline bindings. */
+  pattern = patt_create(engine, "a + b + c + d + e + f + g + h + i + i");
+  Expression equal = expr_create(engine, "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + "
+                                         "(x ^ 2) + (x ^ 2)");
+  Expression unequal = expr_create(engine, "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + "
+                                           "(x ^ 2) + (x ^ 3)");
+  bindings_init(&bindings);
+  assert(match(get_root(pattern), get_root(equal), &bindings));
+  assert(bindings.length == BIND_INLINE && bind_size(bindings.spill) == 1);
+  bindings_cleanup(&bindings);
+  bindings_init(&bindings);
+  assert(!match(get_root(pattern), get_root(unequal), &bindings));
+  bindings_cleanup(&bindings);
+  expr_destroy(pattern);
+  expr_destroy(equal);
+  expr_destroy(unequal);
+
   expr_destroy(expr);
-  bind_destroy(bindings);
   printf("%s passed\n", __func__);
 }
 
 void test_match_apply(void) {
-  Expression expr = expr_create("x - (exp x)");
-  Expression expected = expr_create("x + (-1 * exp x)");
-  struct CtxAll ctx = {0, norm_rules};
+  Expression expr = expr_create(engine, "x - (exp x)");
+  Expression expected = expr_create(engine, "x + (-1 * exp x)");
+  struct CtxAll ctx = {0, engine->norm_rules};
 
-  match_apply(get_root(expr), &ctx);
+  node_apply(expr, get_root(expr), match_apply, &ctx);
   assert(ctx.changed = 1);
   assert(ast_is_equal(get_root(expr), get_root(expected), tok_is_equal));
   assert(ast_is_equal(get_root(expected), get_root(expr), tok_is_equal));
@@ -374,12 +615,24 @@ void test_match_apply(void) {
   expr_destroy(expr);
   expr_destroy(expected);
 
-  expr = expr_create("(a/b) + 0");
-  expected = expr_create("a * b^(-1) + 0");
-  ctx.ctx_trans = norm_rules + 1;
+  expr = expr_create(engine, "(a/b) + 0");
+  expected = expr_create(engine, "a * b^(-1) + 0");
+  ctx.ctx_trans = engine->norm_rules + 1;
+
+  node_apply(expr, get_root(expr)->lchild, match_apply, &ctx);
+  assert(ast_is_equal(get_root(expr), get_root(expected), tok_is_equal));
+
+  expr_destroy(expr);
+  expr_destroy(expected);
+
+  /* Bound subtrees are moved into the replacement rather than copied. */
+  expr = expr_create(engine, "(a c)/b + 0");
+  expected = expr_create(engine, "a c * b^(-1) + 0");
+  Ast_Node *a = get_root(expr)->lchild->lchild->lchild;
 
-  match_apply(get_root(expr)->lchild, &ctx);
+  node_apply(expr, get_root(expr)->lchild, match_apply, &ctx);
   assert(ast_is_equal(get_root(expr), get_root(expected), tok_is_equal));
+  assert(get_root(expr)->lchild->lchild->lchild == a);
 
   expr_destroy(expr);
   expr_destroy(expected);
@@ -388,27 +641,207 @@ void test_match_apply(void) {
 }
 
 void test_norm_apply(void) {
-  Expression expr = expr_create("1 - b/c");
-  Expression expected = expr_create("1 + -1 * b * c ^ -1");
+  Expression expr = expr_create(engine, "1 - b/c");
+  Expression expected = expr_create(engine, "1 + -1 * b * c ^ -1");
+
+  assert(norm_apply(engine, expr));
+  assert(expr_is_equal(expr, expected));
+
+  expr_destroy(expr);
+  expr_destroy(expected);
+  printf("%s passed\n", __func__);
+}
 
-  assert(norm_apply(expr));
+void test_engine_rules(void) {
+  Engine *trig = engine_create();
+  engine_add_rule(trig, RULES_NORM, "sin^2 + cos^2", "sin f ^ 2 + cos f ^ 2",
+                  "1");
+  engine_declare_scalar(trig, "k");
+  engine_add_rule(trig, RULES_NORM, "sin^2 k", "sin k ^ 2", "0");
+
+  Expression expr = expr_create(trig, "sin (2 x) ^ 2 + cos (2 x) ^ 2");
+  Expression other = expr_copy(expr);
+  Expression expected = expr_create(trig, "1");
+  assert(norm_apply(trig, expr));
   assert(expr_is_equal(expr, expected));
+  norm_apply(engine, other);
+  assert(!expr_is_equal(other, expected));
+  expr_destroy(expr);
+  expr_destroy(other);
+  expr_destroy(expected);
+
+  /* k only binds to scalars. */
+  expr = expr_create(trig, "sin x ^ 2");
+  expected = expr_create(trig, "sin x ^ 2");
+  norm_apply(trig, expr);
+  assert(expr_is_equal(expr, expected));
+  expr_destroy(expr);
+  expr_destroy(expected);
+
+  engine_destroy(trig);
+  printf("%s passed\n", __func__);
+}
+
+/* Shared expressions are transformed to the same expressions as trees. */
+void test_expr_share(void) {
+  char *inputs[] = {"1 - b/c", "x ' (x ^ 3 + 2 x)", "x ' (sin x * exp x)",
+                    "x ' (x ' (x ' (sin x * cos x * exp x)))",
+                    "y ' (x y ^ 2 + log y)"};
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+    Expression expr = expr_create(engine, inputs[i]);
+    Expression shared = expr_share(expr);
+    assert(expr_is_equal(shared, expr) && expr_is_equal(expr, shared));
+    norm_apply(engine, expr);
+    norm_apply(engine, shared);
+    assert(expr_is_equal(shared, expr));
+    diff_apply(engine, expr);
+    diff_apply(engine, shared);
+    assert(expr_is_equal(shared, expr));
+    Expression copy = expr_copy(shared);
+    assert(copy.shared && expr_is_equal(copy, expr));
+    expr_destroy(expr);
+    expr_destroy(shared);
+    expr_destroy(copy);
+  }
 
+  /* Equal subexpressions are one node, and the table keeps one of each. */
+  Expression expr = expr_create(engine, "sin (x + 1) * sin (x + 1) + 2");
+  Expression shared = expr_share(expr);
+  const DagNode *root = shared.shared->root;
+  assert(root->lchild->lchild == root->lchild->rchild);
+  assert(shared.shared->dag->length == 7);
   expr_destroy(expr);
+  expr_destroy(shared);
+
+  /* Copies share the table until one is transformed. */
+  expr = expr_create(engine, "x ' (x ^ 3 + 2 x)");
+  shared = expr_share(expr);
+  Expression copy = expr_copy(shared);
+  assert(copy.shared->dag == shared.shared->dag);
+  assert(copy.shared->root == shared.shared->root);
+  assert(expr_is_equal(copy, shared));
+  diff_apply(engine, copy);
+  assert(copy.shared->dag != shared.shared->dag);
+  assert(expr_is_equal(shared, expr) && !expr_is_equal(copy, shared));
+  expr_destroy(expr);
+  expr_destroy(shared);
+  expr_destroy(copy);
+
+  /* Sums far deeper than the call stack goes. */
+  size_t terms = 100000;
+  char *sum = malloc(2 * terms);
+  for (size_t i = 0; i < terms; i++) {
+    sum[2 * i] = 'x';
+    sum[2 * i + 1] = i + 1 < terms ? '+' : '\0';
+  }
+  expr = expr_create(engine, sum);
+  shared = expr_share(expr);
+  assert(shared.shared->dag->length == terms);
+  copy = expr_copy(shared);
+  assert(!expr_apply(copy, T_POST, &eval_trans, NULL));
+  assert(copy.shared->dag != shared.shared->dag);
+  assert(expr_is_equal(copy, expr));
+  Expression expected = expr_create(engine, "100000 * x");
+  assert(expr_apply(shared, T_PRE, &nary_trans, engine->narys));
+  assert(expr_is_equal(shared, expected));
+  expr_destroy(expr);
+  expr_destroy(shared);
+  expr_destroy(copy);
   expr_destroy(expected);
+  free(sum);
+
+  printf("%s passed\n", __func__);
+}
+
+/* The precompiled default rules are those parsed from their definitions. */
+void test_engine_tables(void) {
+  Engine *parsed = engine_create();
+  size_t norm = fp_length(parsed->norm_rules);
+  size_t diff = fp_length(parsed->diff_rules);
+  norm_rules_init(parsed);
+  diff_rules_init(parsed);
+  assert(norm && fp_length(parsed->norm_rules) == 2 * norm);
+  assert(diff && fp_length(parsed->diff_rules) == 2 * diff);
+
+  for (size_t i = 0; i < norm + diff; i++) {
+    struct PatternRule *table = i < norm ? parsed->norm_rules + i
+                                         : parsed->diff_rules + i - norm;
+    struct PatternRule *rule = table + (i < norm ? norm : diff);
+    assert(!strcmp(table->name, rule->name));
+    assert(expr_is_equal(table->pattern, rule->pattern));
+    assert(expr_is_equal(table->replacement, rule->replacement));
+    assert(table->flat == &rule_flat && rule->flat == parsed->flat);
+    Ast_Node *flat_table = ast_flat_to_nodes(table->flat, table->flat_root);
+    Ast_Node *flat_rule = ast_flat_to_nodes(rule->flat, rule->flat_root);
+    assert(ast_is_equal(flat_table, get_root(rule->replacement), tok_is_equal));
+    assert(ast_is_equal(flat_rule, get_root(rule->replacement), tok_is_equal));
+    ast_destroy(flat_table);
+    ast_destroy(flat_rule);
+  }
+  assert(engine->oprs == &opr_set_builtin);
+
+  engine_destroy(parsed);
+  printf("%s passed\n", __func__);
+}
+
+#define THREADS 4
+#define THREAD_ROUNDS 50
+
+struct DiffJob {
+  char *input;
+  Expression expected;
+  int failed;
+};
+
+static int diff_job(void *arg) {
+  struct DiffJob *job = arg;
+  for (int i = 0; i < THREAD_ROUNDS; i++) {
+    Expression expr = expr_create(engine, job->input);
+    diff_apply(engine, expr);
+    job->failed |= !expr_is_equal(expr, job->expected);
+    expr_destroy(expr);
+  }
+  return 0;
+}
+
+/* Threads share the one engine. */
+void test_engine_threads(void) {
+  char *inputs[THREADS] = {"x ' (x ^ 3 + 2 x)", "x ' (sin x * exp x)",
+                           "x ' (1.5 x ^ 2 - 0.25 / x)",
+                           "y ' (x y ^ 2 + log y)"};
+  struct DiffJob jobs[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    jobs[t] = (struct DiffJob){inputs[t], expr_create(engine, inputs[t]), 0};
+    diff_apply(engine, jobs[t].expected);
+  }
+
+  thrd_t threads[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    thrd_create(&threads[t], diff_job, &jobs[t]);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    thrd_join(threads[t], NULL);
+    assert(!jobs[t].failed);
+    expr_destroy(jobs[t].expected);
+  }
+
   printf("%s passed\n", __func__);
 }
 
 void run_tests(void) {
   printf("\n\n%s\n\n", __FILE__);
-  opr_set_setup();
+  engine_setup();
   test_exprs_setup();
 
   test_lexer_2();
   test_shunting_yard();
+  test_pratt_parse();
+  test_pratt_parse_errors();
   test_expr_create();
   test_expr_is_equal();
   test_tok_cmp();
+  test_node_pool();
+  test_expr_compact();
   test_ast_copy();
   test_ast_rotate_ccw();
 
@@ -416,21 +849,23 @@ void run_tests(void) {
 
   test_eval_apply();
 
-  simpls_init();
-
   test_id_apply();
   test_ann_apply();
   test_assoc_apply();
-
-  norm_rules_init();
+  test_nary_apply();
 
   test_var_match();
   test_match();
   test_match_apply();
   test_norm_apply();
-
-  trans_cleanup();
-  opr_set_cleanup();
+  test_engine_rules();
+  test_engine_tables();
+  test_expr_share();
+  test_engine_threads();
+
+  engine_destroy(engine);
+  num_set_cleanup();
+  var_set_cleanup();
 }
 
 int main(void) {
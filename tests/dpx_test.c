@@ -0,0 +1,130 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Counts live allocations and bytes, to check maps with an allocator free
+ * everything through it, with the sizes they allocated. */
+struct Count {
+  long allocs;
+  long bytes;
+};
+
+static void *count_alloc(void *ctx, size_t size) {
+  struct Count *count = ctx;
+  count->allocs++;
+  count->bytes += size;
+  return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *p, size_t old_size, size_t size) {
+  struct Count *count = ctx;
+  count->bytes += size - old_size;
+  return realloc(p, size);
+}
+
+static void count_free(void *ctx, void *p, size_t size) {
+  struct Count *count = ctx;
+  count->allocs--;
+  count->bytes -= size;
+  free(p);
+}
+
+static struct Count count;
+static const Allocator count_allocator = {&count, count_alloc, count_realloc,
+                                          count_free};
+
+#define DPX_KT int
+#define DPX_VT double
+#define DPX_PFX lin
+#define DPX_STRUCT_PFX Lin
+#define DPX_ALLOC (&count_allocator)
+#include "dpx.h"
+
+#define DPX_KT int
+#define DPX_VT double
+#define DPX_PFX hash
+#define DPX_STRUCT_PFX Hash
+#define DPX_HASH(key) ((size_t)(key))
+#define DPX_ALLOC (&count_allocator)
+#include "dpx.h"
+
+/* Every key probes from the same bucket. */
+#define DPX_KT int
+#define DPX_VT double
+#define DPX_PFX clash
+#define DPX_STRUCT_PFX Clash
+#define DPX_HASH(key) ((size_t)(key) & 0)
+#include "dpx.h"
+
+#define KEYS 2000
+
+/* The same operations on each variant of the map, checked against an array
+ * indexed by key. Keys are spread out and negative, so some hash to the same
+ * bucket. */
+#define TEST_MAP(pfx, Pfx)                                                     \
+  do {                                                                         \
+    double expected[KEYS] = {0};                                               \
+    int present[KEYS] = {0};                                                   \
+    srand(5);                                                                  \
+    Pfx##Map *map = pfx##_create(1);                                           \
+    for (int i = 0; i < 4 * KEYS; i++) {                                       \
+      int k = rand() % KEYS;                                                   \
+      int key = 37 * k - KEYS;                                                 \
+      if (rand() % 2) {                                                        \
+        pfx##_add(key, i, map);                                                \
+        expected[k] = i;                                                       \
+        present[k] = 1;                                                        \
+      } else {                                                                 \
+        int added;                                                             \
+        double *value = pfx##_find_add(key, i, map, &added);                   \
+        assert(added == !present[k]);                                          \
+        assert(*value == (present[k] ? expected[k] : i));                      \
+        expected[k] = *value;                                                  \
+        present[k] = 1;                                                        \
+      }                                                                        \
+    }                                                                          \
+    size_t size = 0;                                                           \
+    for (int k = 0; k < KEYS; k++) {                                           \
+      int key = 37 * k - KEYS;                                                 \
+      size += present[k];                                                      \
+      assert(pfx##_is_in(key, map) == present[k]);                             \
+      assert(pfx##_get(key, map) == expected[k]);                              \
+      assert(present[k] ? *pfx##_addr(key, map) == expected[k]                 \
+                        : !pfx##_addr(key, map));                              \
+    }                                                                          \
+    assert(pfx##_size(map) == size);                                           \
+    pfx##_destroy(map);                                                        \
+  } while (0)
+
+void test_lin(void) {
+  TEST_MAP(lin, Lin);
+  assert(count.allocs == 0 && count.bytes == 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_hash(void) {
+  TEST_MAP(hash, Hash);
+  assert(count.allocs == 0 && count.bytes == 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_clash(void) {
+  TEST_MAP(clash, Clash);
+
+  printf("%s passed\n", __func__);
+}
+
+void run_tests(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  test_lin();
+  test_hash();
+  test_clash();
+}
+
+int main(void) {
+  run_tests();
+  return 0;
+}
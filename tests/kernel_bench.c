@@ -0,0 +1,70 @@
+#include "kernel.h"
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_POINTS 1000000
+#define NUM_ROUNDS 5
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Evaluation one point at a time through the operator's func, as eval_apply
+ * does for a single point. */
+static double bench_func(const Opr *opr, const Scalar a[], const Scalar b[],
+                         Scalar out[]) {
+  double best = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    double start = now();
+    for (size_t i = 0; i < NUM_POINTS; i++) {
+      Scalar args[2] = {a[i], b[i]};
+      out[i] = opr->func(args);
+    }
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+static double bench_kernel(const Opr *opr, const Scalar a[], const Scalar b[],
+                           Scalar out[]) {
+  double best = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    double start = now();
+    opr->kernel(a, b, out, NUM_POINTS);
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+int main(void) {
+  printf("\n\n%s (%zu byte Scalar)\n\n", __FILE__, sizeof(Scalar));
+  Scalar *a = malloc(NUM_POINTS * sizeof(*a));
+  Scalar *b = malloc(NUM_POINTS * sizeof(*b));
+  Scalar *out = malloc(NUM_POINTS * sizeof(*out));
+  srand(1);
+  for (size_t i = 0; i < NUM_POINTS; i++) {
+    a[i] = 0.01f + 20.0f * rand() / RAND_MAX;
+    b[i] = 0.01f + 20.0f * rand() / RAND_MAX;
+  }
+
+  const char *names[] = {"+", "*", "/", "exp", "log", "sin", "cos", "sqrt"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+    const Opr *opr = opr_get(names[i]);
+    double t_func = bench_func(opr, a, b, out);
+    double t_kernel = bench_kernel(opr, a, b, out);
+    printf("%-4s func: %5.2f ns/point, kernel: %5.2f ns/point (%.1fx)\n",
+           names[i], t_func * 1e9 / NUM_POINTS, t_kernel * 1e9 / NUM_POINTS,
+           t_func / t_kernel);
+  }
+
+  free(out);
+  free(b);
+  free(a);
+  return 0;
+}
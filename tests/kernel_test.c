@@ -0,0 +1,118 @@
+#include "kernel.c"
+#include "kernel.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+/* Not a multiple of any vector width, so the scalar remainder runs too. */
+#define NUM_POINTS 1003
+
+/* Within a few ulp of the double precision result, relative to 1 for results
+ * below 1. */
+static int is_close(Scalar x, double expected, int relative) {
+  if (isnan(expected) || isinf(expected)) {
+    return isnan(expected) ? isnan(x) : x == expected;
+  }
+  double scale = relative ? fabs(expected) : fmax(fabs(expected), 1);
+  return fabs(x - expected) <= 4 * FLT_EPSILON * scale;
+}
+
+void test_kern_arith(void) {
+  Scalar a[NUM_POINTS], b[NUM_POINTS], out[NUM_POINTS];
+  for (int i = 0; i < NUM_POINTS; i++) {
+    a[i] = (i - 500) * 0.37f;
+    b[i] = (i % 7 + 1) * 1.5f;
+  }
+
+  kern_add(a, b, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(out[i] == a[i] + b[i]);
+  }
+  kern_sub(a, b, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(out[i] == a[i] - b[i]);
+  }
+  kern_div(a, b, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(out[i] == a[i] / b[i]);
+  }
+  kern_sqrt(b, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(out[i] == sqrtf(b[i]));
+  }
+  kern_pow(b, b, out, 5);
+  assert(out[0] == powf(1.5f, 1.5f));
+
+  /* In place */
+  Scalar expected = a[NUM_POINTS - 1] * b[NUM_POINTS - 1];
+  kern_mul(a, b, a, NUM_POINTS);
+  assert(a[NUM_POINTS - 1] == expected);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_kern_approx(void) {
+  Scalar x[NUM_POINTS], out[NUM_POINTS];
+
+  for (int i = 0; i < NUM_POINTS; i++) {
+    x[i] = (i - 501) * 0.173f;
+  }
+  kern_exp(x, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(is_close(out[i], exp(x[i]), 1));
+  }
+  kern_sin(x, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(is_close(out[i], sin(x[i]), 0));
+  }
+  kern_cos(x, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(is_close(out[i], cos(x[i]), 0));
+  }
+
+  for (int i = 0; i < NUM_POINTS; i++) {
+    x[i] = ldexpf(1 + i * 0.0137f, i % 200 - 100);
+  }
+  kern_log(x, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(is_close(out[i], log(x[i]), 0));
+  }
+  for (int i = 0; i < NUM_POINTS; i++) {
+    x[i] = i * 8.13f;
+  }
+  kern_sin(x, NULL, out, NUM_POINTS);
+  for (int i = 0; i < NUM_POINTS; i++) {
+    assert(is_close(out[i], sin(x[i]), 0));
+  }
+
+  printf("%s passed\n", __func__);
+}
+
+void test_kern_out_of_range(void) {
+  Scalar x[8] = {100, -200, INFINITY, NAN, 0, -1, 1e6f, 1e-40f};
+  Scalar out[8];
+
+  kern_exp(x, NULL, out, 8);
+  assert(out[0] == INFINITY && out[1] == 0 && out[2] == INFINITY);
+  assert(isnan(out[3]) && out[4] == 1);
+  kern_log(x, NULL, out, 8);
+  assert(isnan(out[3]) && out[4] == -INFINITY && isnan(out[5]));
+  assert(is_close(out[7], log(1e-40f), 0));
+  kern_sin(x, NULL, out, 8);
+  assert(isnan(out[2]) && out[4] == 0);
+  assert(is_close(out[6], sin(1e6f), 0));
+
+  printf("%s passed\n", __func__);
+}
+
+void run_tests(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  test_kern_arith();
+  test_kern_approx();
+  test_kern_out_of_range();
+}
+
+int main(void) {
+  run_tests();
+  return 0;
+}
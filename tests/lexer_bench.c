@@ -0,0 +1,270 @@
+#include "lexer.c"
+#include "lexer.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define INPUT_LENGTH (1 << 22)
+#define NUM_ROUNDS 5
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The lexer before the class masks, which grew a window one character at a
+ * time and rechecked all of it with ctype at each step. Kept here only as the
+ * baseline. */
+
+static int scalar_match(const char *restrict s0, const char *restrict s1) {
+  /* if s is just a single non digit char, then operator or garbage */
+  if (!isdigit(*s0) && s0 + 1 == s1) {
+    return 0;
+  }
+  /* if first char is non digit and not -, then operator or garbage */
+  if (!isdigit(*s0) && *s0 != '-') {
+    return 0;
+  }
+  /* if latter chars contain non-digits, garbage */
+  for (s0++; s0 != s1; s0++) {
+    if (!isdigit(*s0) && *s0 != '.') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Variables may continue with digits, as they may in the lexer now. */
+static int var_match(const char *restrict s0, const char *restrict s1) {
+  if (!isalpha(*s0)) {
+    return 0;
+  }
+  for (s0++; s0 != s1; s0++) {
+    if (!isalnum(*s0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int opr_match(const OprSet *oprs, const char *restrict s0,
+                     const char *restrict s1) {
+  return !!opr_span_get(oprs, s0, s1);
+}
+
+static size_t lexer_ctype(const OprSet *oprs, const char *s0, const char *s1,
+                          Token tokens[], size_t cap) {
+  OprId mul = opr_id(opr_get("*"));
+  size_t length = 0;
+  while (1) {
+    while (s0 != s1 && isspace(*s0)) {
+      s0++;
+    }
+    if (s0 == s1 || !*s0) {
+      break;
+    }
+    const char *best = s0;
+    const char *end = s0;
+    TOKEN_TYPE best_type = OPR;
+    do {
+      end++;
+      if (opr_match(oprs, s0, end)) {
+        best = end;
+        best_type = OPR;
+      } else if (var_match(s0, end)) {
+        best = end;
+        best_type = VAR;
+      } else if (scalar_match(s0, end)) {
+        best = end;
+        best_type = SCALAR;
+      } else if (best != s0) {
+        break;
+      }
+    } while (end != s1 && *end);
+    if (best == s0) {
+      break;
+    }
+
+    Token token = {.token_type = best_type};
+    switch (best_type) {
+    case SCALAR:
+      token.num = num_parse(s0, best);
+      break;
+    case VAR:
+      token.var = var_intern(s0, best);
+      break;
+    case OPR:
+      token.opr_id = opr_id(opr_span_get(oprs, s0, best));
+      break;
+    }
+    if (length && tokens[length - 1].token_type != OPR && best_type == VAR &&
+        length < cap) {
+      tokens[length++] = (Token){.token_type = OPR, .opr_id = mul};
+    }
+    if (length < cap) {
+      tokens[length++] = token;
+    }
+    s0 = best;
+  }
+  return length;
+}
+
+/* Counts the tokens from s0 to s1 by finding where each ends with ctype, one
+ * character at a time, as lexer_ctype would without the operator lookups. */
+static size_t token_ends_ctype(const OprSet *oprs, const char *s0,
+                               const char *s1) {
+  (void)oprs;
+  size_t count = 0;
+  while (1) {
+    while (s0 != s1 && isspace(*s0)) {
+      s0++;
+    }
+    if (s0 == s1 || !*s0) {
+      return count;
+    }
+    const char *s = s0 + 1;
+    if (isalpha(*s0)) {
+      while (s != s1 && isalnum(*s)) {
+        s++;
+      }
+    } else if (isdigit(*s0) || *s0 == '-') {
+      while (s != s1 && (isdigit(*s) || *s == '.')) {
+        s++;
+      }
+    }
+    count++;
+    s0 = s;
+  }
+}
+
+/* Counts the tokens as above, finding where each ends from the class masks. */
+static size_t token_ends_masks(const OprSet *oprs, const char *s0,
+                               const char *s1) {
+  LexInput in;
+  lex_input_init(&in, oprs, s0, s1, 0);
+  size_t count = 0;
+  while (1) {
+    l_strip(&in);
+    if (in.next == in.end || char_class(*in.next) == CC_END) {
+      return count;
+    }
+    const char *s = in.next + 1;
+    switch (char_class(*in.next)) {
+    case CC_ALPHA:
+      s += lex_run(&in, s, class_bit(CC_ALPHA) | class_bit(CC_DIGIT));
+      break;
+    case CC_DIGIT:
+    case CC_MINUS:
+      s += lex_run(&in, s, class_bit(CC_DIGIT) | class_bit(CC_DOT));
+      break;
+    }
+    count++;
+    in.next = s;
+  }
+}
+
+static char *input_create(void) {
+  static const char *const terms[] = {
+      "12.5 * x",   "sin (y + 3)", "exp(-0.25 * z)", "x ^ 2",
+      "log(1 + x)", "2 x y",       "(a - b) / c",    "cos  theta",
+  };
+  char *input = malloc(INPUT_LENGTH + 1);
+  size_t length = 0;
+  srand(1);
+  while (1) {
+    const char *term = terms[rand() % 8];
+    size_t term_length = strlen(term);
+    if (length + term_length + 3 > INPUT_LENGTH) {
+      break;
+    }
+    if (length) {
+      memcpy(input + length, " + ", 3);
+      length += 3;
+    }
+    memcpy(input + length, term, term_length);
+    length += term_length;
+  }
+  memset(input + length, ' ', INPUT_LENGTH - length);
+  input[INPUT_LENGTH] = '\0';
+  return input;
+}
+
+static double bench_ends(size_t (*func)(const OprSet *, const char *,
+                                        const char *),
+                         const OprSet *oprs, const char *input,
+                         size_t *count) {
+  double best = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    double start = now();
+    *count = func(oprs, input, input + INPUT_LENGTH);
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  return INPUT_LENGTH / best / 1e6;
+}
+
+static double bench_lexer(size_t (*func)(const OprSet *, const char *,
+                                         const char *, Token[], size_t),
+                          const OprSet *oprs, const char *input,
+                          Token tokens[], size_t cap, size_t *length) {
+  double best = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    double start = now();
+    *length = func(oprs, input, input + INPUT_LENGTH, tokens, cap);
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  return INPUT_LENGTH / best / 1e6;
+}
+
+int main(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  OprSet *opr_set = opr_set_create();
+  var_set_init();
+  num_set_init();
+  char *input = input_create();
+
+  size_t ctype_count, masks_count;
+  printf("token ends ctype: %8.1f MB/s\n",
+         bench_ends(token_ends_ctype, opr_set, input, &ctype_count));
+  printf("token ends masks: %8.1f MB/s (%d bytes at a time)\n",
+         bench_ends(token_ends_masks, opr_set, input, &masks_count),
+#ifdef CLASSIFY_WIDTH
+         CLASSIFY_WIDTH
+#else
+         1
+#endif
+  );
+  if (ctype_count != masks_count) {
+    printf("token counts differ\n");
+  }
+
+  size_t cap = INPUT_LENGTH;
+  Token *expected = malloc(cap * sizeof(*expected));
+  Token *tokens = malloc(cap * sizeof(*tokens));
+  size_t ctype_length, length;
+  double rate =
+      bench_lexer(lexer_ctype, opr_set, input, expected, cap, &ctype_length);
+  printf("lexer ctype:      %8.1f MB/s (%zu tokens)\n", rate, ctype_length);
+  rate = bench_lexer(lexer_span, opr_set, input, tokens, cap, &length);
+  printf("lexer_span:       %8.1f MB/s (%zu tokens)\n", rate, length);
+  int differ = ctype_length != length;
+  for (size_t i = 0; !differ && i < length; i++) {
+    differ = tokens[i].token_type != expected[i].token_type ||
+             tokens[i].num != expected[i].num;
+  }
+  if (differ) {
+    printf("tokens differ\n");
+  }
+
+  free(tokens);
+  free(expected);
+  free(input);
+  num_set_cleanup();
+  var_set_cleanup();
+  opr_set_destroy(opr_set);
+  return 0;
+}
@@ -2,38 +2,56 @@
 #include "lexer.c"
 #include "symbols.h"
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 
-Scalar epsilon = 0.001;
+OprSet *opr_set;
 
-void test_scalar_match(void) {
-  char s[] = "-13.6";
-  assert(!scalar_match(s, s + 1));
-  assert(scalar_match(s + 1, s + 2));
-  assert(scalar_match(s, s + 5));
-
-  char t[] = "asdiwqd";
-  assert(!scalar_match(t, t + 3));
-
-  printf("%s passed\n", __func__);
-}
-
-void test_var_match(void) {
-  char s[] = "aBKOx";
-  assert(var_match(s, s + 3));
-
-  char t[] = "1ci8i9";
-  assert(!var_match(t, t + 9));
-
-  printf("%s passed\n", __func__);
+/* Runs match on the null terminated string at *t, and advances *t past it. */
+static MATCH_CODE match_str(const char **t, Token *token) {
+  LexInput in;
+  lex_input_init(&in, opr_set, *t, *t + strlen(*t), 0);
+  MATCH_CODE code = match(&in, token);
+  *t = in.next;
+  return code;
 }
 
-void test_opr_match(void) {
-  char s[] = "(jsin";
-  assert(opr_match(s, s + 1));
-  assert(!opr_match(s, s + 2));
-  assert(!opr_match(s + 2, s + 4));
-  assert(opr_match(s + 2, s + 5));
+void test_classify(void) {
+  char s[] = "exp(-12.5 * x)\t+ y^2 @ Z_9 and more text past one block";
+  size_t length = strlen(s) + 1;
+  uint64_t masks[LEX_CLASSES];
+  classify_masks(s, length, masks);
+  for (size_t i = 0; i < length; i++) {
+    for (int cc = 0; cc < CC_COUNT; cc++) {
+      assert(!!(masks[cc] >> i & 1) == (cc == char_class(s[i])));
+    }
+  }
+  assert(masks[CC_ALPHA] & 1);
+  assert(masks[CC_OTHER] >> 3 & 1);
+  assert(masks[CC_MINUS] >> 4 & 1);
+  assert(masks[CC_DOT] >> 7 & 1);
+  assert(masks[CC_SPACE] >> 14 & 1);
+  assert(masks[CC_END] >> (length - 1) & 1);
+
+  /* Every byte, through the vector checks as well as the table. */
+  char all[LEX_BLOCK];
+  for (int c0 = 0; c0 < 256; c0 += LEX_BLOCK) {
+    for (int i = 0; i < LEX_BLOCK; i++) {
+      all[i] = (char)(c0 + i);
+    }
+    classify_masks(all, LEX_BLOCK, masks);
+    for (int i = 0; i < LEX_BLOCK; i++) {
+      for (int cc = 0; cc < CC_COUNT; cc++) {
+        assert(!!(masks[cc] >> i & 1) == (cc == char_class(all[i])));
+      }
+    }
+  }
+
+  for (int c = 0; c < 256; c++) {
+    assert((char_class(c) == CC_SPACE) == !!isspace(c));
+    assert((char_class(c) == CC_ALPHA) == !!isalpha(c));
+    assert((char_class(c) == CC_DIGIT) == !!isdigit(c));
+  }
 
   printf("%s passed\n", __func__);
 }
@@ -41,38 +59,108 @@ void test_opr_match(void) {
 void test_match(void) {
   Token token;
   char s1[] = "12.3ba";
-  char *t = s1;
-  assert(match(&t, &token) == MATCH_SUCCESS);
+  const char *t = s1;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
   assert(token.token_type == SCALAR);
-  assert(token.scalar - 12.3 < epsilon);
+  assert(token.num == num_parse_str("12.3"));
 
   char s2[] = "i+";
   t = s2;
-  assert(match(&t, &token) == MATCH_SUCCESS);
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
   assert(token.token_type == VAR);
-  assert(token.var = 'i');
+  assert(token.var == var_get("i"));
 
   char s3[] = "*5.9";
   t = s3;
-  assert(match(&t, &token) == 0);
+  assert(match_str(&t, &token) == 0);
   assert(token.token_type == OPR);
-  assert(token.opr = opr_get("*"));
+  assert(tok_opr(token) == opr_get("*"));
 
   char s4[] = ":99.a";
   t = s4;
-  assert(match(&t, &token) == MATCH_ERROR);
+  assert(match_str(&t, &token) == MATCH_ERROR);
 
   char s5[] = "";
   t = s5;
-  assert(match(&t, &token) == MATCH_ERROR);
+  assert(match_str(&t, &token) == MATCH_ERROR);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_match_longest(void) {
+  Token token;
+  char s1[] = "-.5x";
+  const char *t = s1;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == SCALAR);
+  assert(token.num == num_parse_str("-0.5"));
+  assert(*t == 'x');
+
+  char s2[] = "- 5";
+  t = s2;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == OPR);
+  assert(tok_opr(token) == opr_get("-"));
+
+  char s3[] = "sinh(";
+  t = s3;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == VAR);
+  assert(token.var == var_get("sinh"));
+  assert(*t == '(');
+
+  char s4[] = "exp(";
+  t = s4;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == OPR);
+  assert(tok_opr(token) == opr_get("exp"));
+
+  char s6[] = "sqrt x";
+  t = s6;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == OPR);
+  assert(tok_opr(token) == opr_get("sqrt"));
+
+  char s5[] = ".5";
+  t = s5;
+  assert(match_str(&t, &token) == MATCH_ERROR);
+  assert(t == s5);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_match_blocks(void) {
+  Token token;
+  char s[3 * LEX_BLOCK + 8];
+  memset(s, ' ', LEX_BLOCK + 3);
+  memset(s + LEX_BLOCK + 3, 'a', LEX_BLOCK + 1);
+  strcpy(s + 2 * LEX_BLOCK + 4, "b1 -");
+  LexInput in;
+  lex_input_init(&in, opr_set, s, s + strlen(s), 0);
+  l_strip(&in);
+  assert(in.next == s + LEX_BLOCK + 3);
+  assert(match(&in, &token) == MATCH_SUCCESS);
+  assert(token.token_type == VAR);
+  assert(in.next == s + 2 * LEX_BLOCK + 6);
+  assert(strlen(var_name(token.var)) == LEX_BLOCK + 3);
+  assert(!strncmp(var_name(token.var), s + LEX_BLOCK + 3, LEX_BLOCK + 3));
+
+  char u[2 * LEX_BLOCK + 4];
+  memset(u, '1', sizeof(u) - 1);
+  u[LEX_BLOCK] = '.';
+  u[sizeof(u) - 1] = '\0';
+  const char *t = u;
+  assert(match_str(&t, &token) == MATCH_SUCCESS);
+  assert(token.token_type == SCALAR);
+  assert(t == u + sizeof(u) - 1);
 
   printf("%s passed\n", __func__);
 }
 
 void test_mul_insert(void) {
-  Token token1 = {SCALAR, {-5}};
+  Token token1 = {SCALAR, {num_from_int(-5)}};
   Token token2 = {.token_type = VAR};
-  token2.var = 'x';
+  token2.var = var_get("x");
   Token *tokens = NULL;
   fp_push(token1, tokens);
   fp_push(token2, tokens);
@@ -80,43 +168,68 @@ void test_mul_insert(void) {
   tokens = mul_insert(tokens);
   assert(fp_length(tokens) == 3);
   assert(tokens[1].token_type == OPR);
-  assert(tokens[1].opr == opr_get("*"));
+  assert(tok_opr(tokens[1]) == opr_get("*"));
 
   fp_destroy(tokens);
   printf("%s passed\n", __func__);
 }
 
 void test_lexer(void) {
-  Token *tokens = lexer(" 1 +3.2/ x  ");
+  Token *tokens = lexer(opr_set, " 1 +3.2/ x  ");
 
   assert(fp_length(tokens) == 5);
-  assert(tokens[0].scalar - 1 < epsilon);
+  assert(tokens[0].num == num_from_int(1));
   assert(tokens[1].token_type == OPR);
-  assert(tokens[4].var = 'x');
+  assert(tokens[4].var == var_get("x"));
   fp_destroy(tokens);
 
-  tokens = lexer("x y - sin 11");
+  tokens = lexer(opr_set, "x y - sin 11");
   assert(fp_length(tokens) == 6);
   assert(tokens[1].token_type == OPR);
-  assert(tokens[4].opr->precedence == 4);
-  assert(tokens[5].scalar == 11);
+  assert(tok_opr(tokens[4])->precedence == 4);
+  assert(tokens[5].num == num_from_int(11));
+  fp_destroy(tokens);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_lexer_buf(void) {
+  Token buf[8];
+  char s[] = "2 x y - sin 11";
+  Token *tokens = lexer(opr_set, s);
+  size_t length = lexer_buf(opr_set, s, buf, 8);
+
+  assert(length == fp_length(tokens));
+  for (size_t i = 0; i < length; i++) {
+    assert(tok_is_equal(buf[i], tokens[i]));
+  }
+  assert(tok_opr(buf[1]) == opr_get("*"));
+  assert(tok_opr(buf[3]) == opr_get("*"));
   fp_destroy(tokens);
 
+  assert(lexer_buf(opr_set, "1 + 2 x", buf, 2) == 5);
+  assert(tok_opr(buf[1]) == opr_get("+"));
+
   printf("%s passed\n", __func__);
 }
 
 void run_tests(void) {
   printf("\n\n%s\n\n", __FILE__);
-  opr_set_init();
+  opr_set = opr_set_create();
+  var_set_init();
+  num_set_init();
 
-  test_scalar_match();
-  test_var_match();
-  test_opr_match();
+  test_classify();
   test_match();
+  test_match_longest();
+  test_match_blocks();
   test_mul_insert();
   test_lexer();
+  test_lexer_buf();
 
-  opr_set_cleanup();
+  num_set_cleanup();
+  var_set_cleanup();
+  opr_set_destroy(opr_set);
 }
 
 int main(void) {
@@ -0,0 +1,176 @@
+#include "ast.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_TERMS 4096
+#define NUM_ROUNDS 5
+
+/* Linked with --wrap for each allocation function, so every allocation made
+ * from the code under test is counted. */
+static size_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocs++;
+  return __real_realloc(p, size);
+}
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The matcher as it used to be, with a bindings map and an iterator on the
+ * heap for every attempt. */
+static int patt_match_heap(const Ast_Node *patt, Ast_Node *node,
+                           BindMap *map) {
+  if (!T_IS_VAR(patt) || !var_is_pattern(T_VAR(patt))) {
+    return patt_match(patt, node, NULL);
+  }
+  if (!var_match(T_VAR(patt), node)) {
+    return 0;
+  }
+  if (bind_is_in(T_VAR(patt), map)) {
+    return ast_is_equal(bind_get(T_VAR(patt), map), node, tok_is_equal);
+  }
+  bind_add(T_VAR(patt), node, map);
+  return 1;
+}
+
+static int match_heap(Ast_Node *pattern, Ast_Node *ast_expr, BindMap *map) {
+  int matched = 1;
+  Ast_Iter *it = ast_iter_create(pattern, T_PRE);
+  Ast_Node *patt_node = ast_start(it);
+  Ast_Node *expr_node = ast_expr;
+  while (!ast_end(it)) {
+    if (!patt_match_heap(patt_node, expr_node, map)) {
+      matched = 0;
+      break;
+    }
+    patt_node = ast_traverse(it);
+    if (it->dir == LPARENT || it->dir == RPARENT) {
+      expr_node = it->dir == LPARENT ? expr_node->lchild : expr_node->rchild;
+      if (!expr_node) {
+        matched = 0;
+        break;
+      }
+    } else {
+      expr_node = expr_node->parent;
+    }
+  }
+  ast_iter_destroy(it);
+  return matched;
+}
+
+static int match_heap_apply(Ast_Node *pattern, Ast_Node *node) {
+  BindMap *map = bind_create(1);
+  int matched = match_heap(pattern, node, map);
+  bind_destroy(map);
+  return matched;
+}
+
+static int match_inline_apply(Ast_Node *pattern, Ast_Node *node) {
+  Bindings bindings;
+  bindings_init(&bindings);
+  int matched = match(pattern, node, &bindings);
+  bindings_cleanup(&bindings);
+  return matched;
+}
+
+static char *input_create(void) {
+  static const char *const terms[] = {
+      "12.5 * x",   "sin (y + 3)", "exp(2 z) * exp(2 z)", "x ^ 2",
+      "log(1 + x)", "2 x y",       "(a - b) / c",         "cos t + cos t",
+  };
+  size_t length = 0;
+  char *input = malloc(NUM_TERMS * 40);
+  srand(1);
+  for (int i = 0; i < NUM_TERMS; i++) {
+    length +=
+        sprintf(input + length, "%s%s", i ? " + " : "", terms[rand() % 8]);
+  }
+  return input;
+}
+
+/* Tries every default rule at every node, as one pass of norm_apply and
+ * diff_apply would, without rewriting. */
+static void bench_match(const char name[],
+                        int (*func)(Ast_Node *pattern, Ast_Node *node),
+                        const Engine *engine, Ast_Node *nodes[],
+                        size_t length) {
+  double best = 0;
+  size_t matches = 0;
+  size_t start_allocs = allocs;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    matches = 0;
+    double start = now();
+    for (size_t i = 0; i < fp_length(engine->norm_rules); i++) {
+      for (size_t j = 0; j < length; j++) {
+        matches += func(get_root(engine->norm_rules[i].pattern), nodes[j]);
+      }
+    }
+    for (size_t i = 0; i < fp_length(engine->diff_rules); i++) {
+      for (size_t j = 0; j < length; j++) {
+        matches += func(get_root(engine->diff_rules[i].pattern), nodes[j]);
+      }
+    }
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  size_t attempts =
+      (fp_length(engine->norm_rules) + fp_length(engine->diff_rules)) * length;
+  printf("%s %8.1f M attempts/s, %5.2f allocs/attempt (%zu matched)\n", name,
+         attempts / best / 1e6,
+         (double)(allocs - start_allocs) / NUM_ROUNDS / attempts, matches);
+}
+
+int main(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  var_set_init();
+  num_set_init();
+  Engine *engine = engine_create();
+  char *input = input_create();
+  Expression expr = expr_create(engine, input);
+
+  Ast_Node **nodes = NULL;
+  Ast_Iter *it = ast_iter_create(get_root(expr), T_POST);
+  for (Ast_Node *node = ast_begin(it); !ast_end(it); node = ast_next(it)) {
+    fp_push(node, nodes);
+  }
+  ast_iter_destroy(it);
+
+  printf("%zu nodes\n", fp_length(nodes));
+  bench_match("match heap:  ", match_heap_apply, engine, nodes,
+              fp_length(nodes));
+  bench_match("match inline:", match_inline_apply, engine, nodes,
+              fp_length(nodes));
+
+  size_t start_allocs = allocs;
+  double start = now();
+  norm_apply(engine, expr);
+  printf("norm_apply:    %8.3f s, %zu allocs\n", now() - start,
+         allocs - start_allocs);
+
+  fp_destroy(nodes);
+  expr_destroy(expr);
+  free(input);
+  engine_destroy(engine);
+  num_set_cleanup();
+  var_set_cleanup();
+  return 0;
+}
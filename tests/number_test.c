@@ -0,0 +1,113 @@
+#include "number.c"
+#include "number.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+static NumId apply(int (*op)(const Number *, Number *), NumId a, NumId b) {
+  Number args[2] = {*num_get(a), *num_get(b)};
+  Number out;
+  if (!op(args, &out)) {
+    return (NumId)-1;
+  }
+  return num_intern(&out);
+}
+
+#define N(s) num_parse_str(s)
+
+void test_num_parse(void) {
+  assert(N("11") == num_from_int(11));
+  assert(N("-0") == num_from_int(0));
+  assert(N("2.50") == N("25e-1"));
+  assert(N("1e3") == num_from_int(1000));
+  assert(N("-16") == num_small(-16) && N("4.0") == num_small(4));
+  assert(num_get(num_small(-3))->rat.num == -3);
+
+  const Number *n = num_get(N("-1.25"));
+  assert(n->kind == NUM_RAT && n->rat.num == -5 && n->rat.den == 4);
+  assert(num_get(N("123456789012345678901234567890"))->kind == NUM_BIG);
+
+  char s[] = "3.25x";
+  assert(num_parse(s, s + 3) == N("3.2"));
+
+  printf("%s passed\n", __func__);
+}
+
+void test_num_exact(void) {
+  NumId sum = apply(num_add, N("0.1"), N("0.2"));
+  assert(sum == N("0.3"));
+  assert(apply(num_sub, sum, N("0.3")) == num_from_int(0));
+  assert(apply(num_div, num_from_int(1), num_from_int(3)) ==
+         apply(num_div, num_from_int(2), num_from_int(6)));
+  assert(apply(num_div, num_from_int(1), num_from_int(0)) == (NumId)-1);
+
+  /* Past int64_t and back again. */
+  NumId big = apply(num_mul, N("9e18"), N("9e18"));
+  assert(num_get(big)->kind == NUM_BIG);
+  assert(apply(num_div, big, N("9e18")) == N("9e18"));
+  assert(apply(num_sub, apply(num_add, big, num_from_int(1)), big) ==
+         num_from_int(1));
+
+  printf("%s passed\n", __func__);
+}
+
+void test_num_pow(void) {
+  assert(apply(num_pow, num_from_int(2), num_from_int(10)) ==
+         num_from_int(1024));
+  assert(apply(num_pow, num_from_int(2), num_from_int(-2)) == N("0.25"));
+  assert(apply(num_pow, N("1.5"), num_from_int(0)) == num_from_int(1));
+  assert(num_get(apply(num_pow, num_from_int(10), num_from_int(40)))->kind ==
+         NUM_BIG);
+  assert(apply(num_pow, num_from_int(2), N("0.5")) == (NumId)-1);
+  assert(apply(num_pow, num_from_int(0), num_from_int(-1)) == (NumId)-1);
+
+  /* Bignums stop being exact past NUM_BIG_LIMBS. */
+  NumId big = apply(num_add, N("18446744073709551616"), num_from_int(1));
+  NumId pow = apply(num_pow, big, num_from_int(32));
+  assert(num_get(pow)->kind == NUM_BIG);
+  assert(apply(num_pow, big, num_from_int(64)) == (NumId)-1);
+  assert(apply(num_pow, pow, num_from_int(-2)) == (NumId)-1);
+  assert(apply(num_mul, pow, pow) == (NumId)-1);
+  assert(apply(num_add, pow, pow) != (NumId)-1);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_num_real(void) {
+  assert(num_from_scalar(3) == num_from_int(3));
+  NumId r = num_from_scalar((Scalar)3.14159);
+  assert(!num_is_exact(num_get(r)));
+  assert(num_from_scalar((Scalar)3.14159) == r);
+  assert(num_from_scalar(NAN) == num_from_scalar(NAN));
+
+  assert(num_to_scalar(num_get(N("0.1"))) == (Scalar)0.1L);
+  assert(num_to_scalar(num_get(N("1e-3"))) == (Scalar)1e-3L);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_num_cmp(void) {
+  assert(num_cmp(N("0.1"), N("0.2")) < 0);
+  assert(num_cmp(N("-3"), N("-4")) > 0);
+  assert(num_cmp(N("7"), N("7.0")) == 0);
+  assert(num_cmp(N("1e30"), N("1e29")) > 0);
+  assert(num_cmp(num_from_scalar((Scalar)3.14159), N("3")) > 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void run_tests(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  num_set_init();
+  test_num_parse();
+  test_num_exact();
+  test_num_pow();
+  test_num_real();
+  test_num_cmp();
+  num_set_cleanup();
+}
+
+int main(void) {
+  run_tests();
+  return 0;
+}
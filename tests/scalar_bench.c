@@ -0,0 +1,89 @@
+#include "scalar.c"
+#include "scalar.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_LITERALS 1000000
+#define NUM_ROUNDS 5
+
+/* The literal conversion used by the lexer before scalar_parse. */
+static float sec_atof(const char *restrict s0, const char *restrict s1) {
+  char temp[s1 - s0 + 1];
+  strncpy(temp, s0, s1 - s0);
+  temp[s1 - s0] = '\0';
+  return atof(temp);
+}
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Literals shaped like those in generated expressions: mostly short integers
+ * and decimals, some negative, with the odd long one. */
+static char *corpus_create(const char *spans[]) {
+  char *corpus = malloc(NUM_LITERALS * 32);
+  char *p = corpus;
+  srand(1);
+  for (size_t i = 0; i < NUM_LITERALS; i++) {
+    spans[i] = p;
+    if (rand() % 4 == 0) {
+      *p++ = '-';
+    }
+    int int_digits = 1 + rand() % (rand() % 16 == 0 ? 12 : 3);
+    int frac_digits = rand() % 3 ? rand() % 4 : 0;
+    for (int j = 0; j < int_digits; j++) {
+      *p++ = '0' + rand() % 10;
+    }
+    if (frac_digits) {
+      *p++ = '.';
+    }
+    for (int j = 0; j < frac_digits; j++) {
+      *p++ = '0' + rand() % 10;
+    }
+    *p++ = ' ';
+  }
+  spans[NUM_LITERALS] = p;
+  return corpus;
+}
+
+static double bench(Scalar (*parse)(const char *restrict, const char *restrict),
+                    const char *spans[], Scalar *sum) {
+  double best = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    double start = now();
+    for (size_t i = 0; i < NUM_LITERALS; i++) {
+      *sum += parse(spans[i], spans[i + 1] - 1);
+    }
+    double elapsed = now() - start;
+    best = !round || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+int main(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  static const char *spans[NUM_LITERALS + 1];
+  char *corpus = corpus_create(spans);
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < NUM_LITERALS; i++) {
+    mismatches += scalar_parse(spans[i], spans[i + 1] - 1) !=
+                  sec_atof(spans[i], spans[i + 1] - 1);
+  }
+
+  Scalar sum = 0;
+  double t_atof = bench(sec_atof, spans, &sum);
+  double t_parse = bench(scalar_parse, spans, &sum);
+  printf("sec_atof:     %6.1f ns/literal\n", t_atof * 1e9 / NUM_LITERALS);
+  printf("scalar_parse: %6.1f ns/literal (%.1fx)\n",
+         t_parse * 1e9 / NUM_LITERALS, t_atof / t_parse);
+  printf("mismatches:   %zu of %d (checksum %g)\n", mismatches, NUM_LITERALS,
+         (double)sum);
+
+  free(corpus);
+  return 0;
+}
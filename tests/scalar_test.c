@@ -0,0 +1,68 @@
+#include "scalar.c"
+#include "scalar.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static Scalar parse(const char s[]) { return scalar_parse(s, s + strlen(s)); }
+
+void test_scalar_parse(void) {
+  assert(parse("0") == 0);
+  assert(parse("11") == 11);
+  assert(parse("-13.6") == -13.6f);
+  assert(parse("0.1") == 0.1f);
+  assert(parse("-.5") == -0.5f);
+  assert(parse("5.") == 5);
+  assert(parse("1.2.3") == 1.2f);
+  assert(parse("-.") == 0);
+  assert(signbit(parse("-0")));
+
+  char s[] = "3.25x";
+  assert(scalar_parse(s, s + 3) == 3.2f);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_scalar_parse_exponent(void) {
+  assert(parse("1e3") == 1000);
+  assert(parse("2.5E-1") == 0.25f);
+  assert(parse("7e+2") == 700);
+  assert(parse("3e") == 3);
+  assert(parse("1e39") == INFINITY);
+  assert(parse("1e-50") == 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_scalar_parse_rounding(void) {
+  /* Beyond the exact fast path. */
+  assert(parse("123456789012345678901234567890") == 1.2345679e29f);
+  assert(parse("0.00000000000000000000000000000000000000000000140129846432"
+               "4817") == FLT_TRUE_MIN);
+  assert(parse("3.4028234663852886e38") == FLT_MAX);
+  /* Ties to even. */
+  assert(parse("16777217") == 16777216.0f);
+  assert(parse("16777219") == 16777220.0f);
+  /* Just above the halfway point between 1 and the next float, which rounds
+   * to the halfway point and then down to 1 when going through double. */
+  assert(parse("1.00000005960464477550") == 1.00000012f);
+  assert(parse("1.00000005960464477539062500000000000000000000000000000000000"
+               "0000000000000000000000000000000000000000000000000000000000000"
+               "0000000000000000000000000000000000000001") == 1.00000012f);
+  assert(parse("1.000000059604644775390625") == 1);
+
+  printf("%s passed\n", __func__);
+}
+
+void run_tests(void) {
+  printf("\n\n%s\n\n", __FILE__);
+  test_scalar_parse();
+  test_scalar_parse_exponent();
+  test_scalar_parse_rounding();
+}
+
+int main(void) {
+  run_tests();
+  return 0;
+}
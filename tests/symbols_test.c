@@ -3,28 +3,56 @@
 #include <assert.h>
 #include <stdio.h>
 
-extern OpMap *opr_set;
+OprSet *opr_set;
 
-void test_opr_set_init(void) {
-  opr_set_init();
-
-  OpBucket *buckets = opr_set->data;
-  assert(buckets[0].key == '+');
-  assert(buckets[4].key == '^');
-  assert(buckets[3].value.arity == 2);
-  assert(buckets[1].value.repr[0] == '-');
+void test_opr_table(void) {
+  const Opr *oprs = opr_table;
+  assert(oprs[0].repr[0] == '+');
+  assert(oprs[4].repr[0] == '^');
+  assert(oprs[3].arity == 2);
+  assert(oprs[1].repr[0] == '-');
 
   printf("%s passed\n", __func__);
 }
 
 void test_opr_get(void) {
-  Opr *add = opr_get("+");
+  const Opr *add = opr_get("+");
 
   assert(add->repr[0] == '+');
   assert(add->arity == 2);
   assert(opr_get("q") == NULL);
   assert(opr_get("sin"));
   assert(opr_get("sin")->arity == 1);
+  assert(opr_get("sqrt") && opr_get("sqrt") != opr_get("sin"));
+  assert(opr_get("s") == NULL);
+  assert(opr_get("sinx") == NULL);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_opr_probe(void) {
+  char s[] = "sqrt(";
+  int state = OPR_PROBE_START;
+  state = opr_probe(opr_set, state, 's');
+  assert(state != OPR_PROBE_NONE);
+  assert(!opr_probe_get(opr_set, state));
+  state = opr_probe(opr_set, opr_probe(opr_set, state, 'i'), 'n');
+  assert(opr_probe_get(opr_set, state) == opr_get("sin"));
+  assert(opr_probe(opr_set, state, 'q') == OPR_PROBE_NONE);
+  assert(!opr_probe_get(opr_set, opr_probe(opr_set, state, 'q')));
+
+  assert(opr_span_get(opr_set, s, s + 4) == opr_get("sqrt"));
+  assert(!opr_span_get(opr_set, s, s + 5));
+
+  printf("%s passed\n", __func__);
+}
+
+void test_opr_set_builtin(void) {
+  assert(opr_set_builtin.nodes_length == opr_set->nodes_length);
+  assert(!memcmp(opr_set_builtin.nodes, opr_set->nodes,
+                 sizeof(opr_set->nodes)));
+  char s[] = "cos";
+  assert(opr_span_get(&opr_set_builtin, s, s + 3) == opr_get("cos"));
 
   printf("%s passed\n", __func__);
 }
@@ -37,13 +65,107 @@ void test_opr_cmp(void) {
   printf("%s passed\n", __func__);
 }
 
+void test_tok_is_equal(void) {
+  Token sin = {.token_type = OPR};
+  sin.opr_id = opr_id(opr_get("sin"));
+  Token sqrt = {.token_type = OPR};
+  sqrt.opr_id = opr_id(opr_get("sqrt"));
+  Token x = {.token_type = VAR};
+  x.var = var_get("x");
+
+  assert(tok_opr(sin) == opr_get("sin"));
+  assert(tok_is_equal(sin, sin));
+  assert(!tok_is_equal(sin, sqrt));
+  assert(!tok_is_equal(sin, x));
+  assert(tok_is_equal((Token){SCALAR, {num_parse_str("2.5")}},
+                      (Token){SCALAR, {num_parse_str("2.5")}}));
+
+  printf("%s passed\n", __func__);
+}
+
+void test_var_intern(void) {
+  char s[] = "xy+x";
+  Var xy = var_intern(s, s + 2);
+  Var x = var_intern(s, s + 1);
+
+  assert(xy != x);
+  assert(var_get("xy") == xy);
+  assert(var_intern(s + 3, s + 4) == x);
+  assert(!strcmp(var_name(xy), "xy"));
+  assert(!var_is_pattern(x));
+
+  Var f = patt_var_get("x");
+  assert(var_is_pattern(f));
+  assert(f != x);
+  assert(!strcmp(var_name(f), "x"));
+  assert(!strcmp(var_name(f | VAR_SCALAR), "x"));
+  assert(f == patt_var_letter('x'));
+
+  /* Ids stay dense and names stay put as the table grows. */
+  char name[8];
+  for (int i = 0; i < 1000; i++) {
+    sprintf(name, "v%d", i);
+    assert(var_get(name) == x + 1 + i);
+  }
+  assert(var_get("v999") == x + 1000);
+  assert(!strcmp(var_name(x + 1000), "v999"));
+  assert(var_get("xy") == xy);
+
+  printf("%s passed\n", __func__);
+}
+
+#define THREADS 4
+#define THREAD_VARS 2000
+
+static int intern_vars(void *arg) {
+  Var *vars = arg;
+  char name[8];
+  for (int i = 0; i < THREAD_VARS; i++) {
+    sprintf(name, "t%d", i);
+    vars[i] = var_get(name);
+  }
+  return 0;
+}
+
+void test_var_intern_threads(void) {
+  static Var vars[THREADS][THREAD_VARS];
+  thrd_t threads[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    thrd_create(&threads[t], intern_vars, vars[t]);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    thrd_join(threads[t], NULL);
+  }
+
+  char name[8];
+  for (int i = 0; i < THREAD_VARS; i++) {
+    sprintf(name, "t%d", i);
+    for (int t = 0; t < THREADS; t++) {
+      assert(vars[t][i] == vars[0][i]);
+    }
+    assert(!strcmp(var_name(vars[0][i]), name));
+  }
+
+  printf("%s passed\n", __func__);
+}
+
 void run_tests(void) {
   printf("\n\n%s\n\n", __FILE__);
-  test_opr_set_init();
+  opr_set = opr_set_create();
+  test_opr_table();
   test_opr_get();
+  test_opr_probe();
+  test_opr_set_builtin();
   test_opr_cmp();
+  var_set_init();
+  num_set_init();
+  test_var_intern();
+  test_var_intern_threads();
+  test_tok_is_equal();
 
-  opr_set_cleanup();
+  num_set_cleanup();
+  var_set_cleanup();
+  opr_set_destroy(opr_set);
 }
 
 int main(void) {
@@ -1,3 +1,4 @@
+#include "alloc.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +9,39 @@
 #define T_DEBUG
 #include "tree.h"
 
+/* Counts live allocations and bytes, to check every node and iterator from an
+ * instantiation with an allocator is freed through it, with its size. */
+struct Count {
+  long allocs;
+  long bytes;
+};
+
+static void *count_alloc(void *ctx, size_t size) {
+  struct Count *count = ctx;
+  count->allocs++;
+  count->bytes += size;
+  return malloc(size);
+}
+
+static void count_free(void *ctx, void *p, size_t size) {
+  struct Count *count = ctx;
+  count->allocs--;
+  count->bytes -= size;
+  free(p);
+}
+
+static struct Count count;
+static const Allocator count_allocator = {&count, count_alloc, NULL,
+                                          count_free};
+
+#define T_TYPE int
+#define T_PREFIX c
+#define T_STRUCT_PREFIX C
+#define T_ALLOC (&count_allocator)
+#define T_HASH(value) ((size_t)(value))
+#define T_FLAT
+#include "tree.h"
+
 #define ASSERT_STRUCT(cond, struct_val, printer_fn)                            \
   do {                                                                         \
     if (!(cond)) {                                                             \
@@ -152,7 +186,7 @@ void test_iter_create(void) {
   I_Iter *it = i_iter_create(node7, T_POST);
   ASSERT_STRUCT(it->root == node7, it, iter_print);
 
-  free(it);
+  i_iter_destroy(it);
   TEST_TREE_TEARDOWN();
   printf("%s passed\n", __func__);
 }
@@ -166,16 +200,16 @@ void test_begin(void) {
   ASSERT_STRUCT(it->tail == node1, it, iter_print);
   first = i_begin(it);
   ASSERT_STRUCT(first == node1, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node6, T_POST);
   ASSERT_STRUCT(i_begin(it) == node5, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
 
   I_Node *leaf = i_leaf(11);
   it = i_iter_create(leaf, T_POST);
   ASSERT_STRUCT(i_begin(it) == leaf, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
   free(leaf);
 
   TEST_TREE_TEARDOWN();
@@ -208,7 +242,7 @@ void test_next(void) {
   ASSERT_STRUCT(i_next(it) == NULL, it, iter_print);
   ASSERT_STRUCT(it->tail == NULL, it, iter_print);
 
-  free(it);
+  i_iter_destroy(it);
   TEST_TREE_TEARDOWN();
   printf("%s passed\n", __func__);
 }
@@ -222,14 +256,14 @@ void test_iter(void) {
   for (node = i_begin(it), i = 1; !i_end(it); node = i_next(it), i++) {
     ASSERT_STRUCT(node->value == i, it, iter_print);
   }
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node5, T_POST);
   for (node = i_begin(it), i = 5; !i_end(it); node = i_next(it), i++) {
     ASSERT_STRUCT(node->value == 5, it, iter_print);
   }
   assert(i == 6);
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node7, T_POST);
   i = 0;
@@ -238,10 +272,10 @@ void test_iter(void) {
     for (i_begin(it2); !i_end(it2); i_next(it2)) {
       i++;
     }
-    free(it2);
+    i_iter_destroy(it2);
   }
   assert(i == 18);
-  free(it);
+  i_iter_destroy(it);
 
   TEST_TREE_TEARDOWN();
   printf("%s passed\n", __func__);
@@ -299,16 +333,16 @@ void test_begin_pre(void) {
   I_Iter *it = i_iter_create(node7, T_PRE);
   I_Node *first = i_begin(it);
   ASSERT_STRUCT(first == node7, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node6, T_PRE);
   ASSERT_STRUCT(i_begin(it) == node6, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
 
   I_Node *leaf = i_leaf(11);
   it = i_iter_create(leaf, T_PRE);
   ASSERT_STRUCT(i_begin(it) == leaf, it, iter_print);
-  free(it);
+  i_iter_destroy(it);
   free(leaf);
 
   TEST_TREE_TEARDOWN();
@@ -329,7 +363,7 @@ void test_next_pre(void) {
   ASSERT_STRUCT(i_next(it) == node5, it, iter_print);
   ASSERT_STRUCT(i_next(it) == NULL, it, iter_print);
 
-  free(it);
+  i_iter_destroy(it);
   TEST_TREE_TEARDOWN();
   printf("%s passed\n", __func__);
 }
@@ -345,14 +379,14 @@ void test_iter_pre(void) {
   for (node = i_begin(it), i = 0; !i_end(it); node = i_next(it), i++) {
     ASSERT_STRUCT(node->value == a[i], it, iter_print);
   }
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node5, T_PRE);
   for (node = i_begin(it), i = 5; !i_end(it); node = i_next(it), i++) {
     ASSERT_STRUCT(node->value == 5, it, iter_print);
   }
   assert(i == 6);
-  free(it);
+  i_iter_destroy(it);
 
   it = i_iter_create(node7, T_PRE);
   i = 0;
@@ -361,15 +395,115 @@ void test_iter_pre(void) {
     for (i_begin(it2); !i_end(it2); i_next(it2)) {
       i++;
     }
-    free(it2);
+    i_iter_destroy(it2);
   }
   assert(i == 18);
-  free(it);
+  i_iter_destroy(it);
 
   TEST_TREE_TEARDOWN();
   printf("%s passed\n", __func__);
 }
 
+static void assert_no_allocs(C_Node *node, void *ctx) {
+  (void)node;
+  (void)ctx;
+  assert(count.allocs == 8);
+}
+
+void test_alloc(void) {
+  C_Node *root = c_join(1, c_join(2, c_leaf(3), NULL), c_leaf(4));
+  C_Node *other = c_join(1, c_join(2, c_leaf(3), NULL), c_leaf(4));
+  assert(count.allocs == 8);
+  assert(count.bytes == 8 * (long)sizeof(C_Node));
+  assert(c_height(root) == 2);
+  C_Iter *it = c_iter_create(root, T_POST);
+  assert(count.allocs == 9);
+  c_iter_destroy(it);
+  C_Iter stack_it;
+  c_iter_init(&stack_it, root, T_PRE);
+  assert(c_begin(&stack_it) == root && c_next(&stack_it) == root->lchild);
+  assert(c_is_equal(root, other, int_is_equal));
+  c_iter_apply(root, T_POST, assert_no_allocs, NULL);
+  assert(count.allocs == 8);
+  c_destroy(root);
+  c_destroy(other);
+  assert(count.allocs == 0 && count.bytes == 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_flat(void) {
+  C_Node *root = c_join(7, c_join(4, c_leaf(1), c_join(3, c_leaf(2), NULL)),
+                        c_join(6, NULL, c_leaf(5)));
+  C_Flat *flat = c_flat_create(1);
+  uint32_t l = c_flat_leaf(flat, 8);
+  uint32_t top = c_flat_join(flat, 9, l, T_NONE);
+  assert(flat->parents[l] == top && flat->parents[top] == T_NONE);
+
+  uint32_t i = c_flat_from_nodes(flat, root);
+  assert(i == 2 && flat->length == 9 && flat->cap >= 9);
+  const int pre[] = {7, 4, 1, 3, 2, 6, 5};
+  for (uint32_t j = 0; j < 7; j++) {
+    assert(flat->values[i + j] == pre[j]);
+  }
+  assert(flat->links[i].lchild == i + 1 && flat->links[i].rchild == i + 5);
+  assert(flat->links[i + 3].rchild == T_NONE);
+  assert(flat->parents[i + 6] == i + 5 && flat->parents[i] == T_NONE);
+
+  C_Flat *copy = c_flat_copy(flat);
+  c_flat_destroy(flat);
+  C_Node *nodes = c_flat_to_nodes(copy, i);
+  assert(c_is_equal(nodes, root, int_is_equal));
+  C_Node *leaf = c_flat_to_nodes(copy, l);
+  assert(c_is_leaf(leaf) && leaf->value == 8);
+  c_destroy(nodes);
+  c_destroy(leaf);
+  c_flat_destroy(copy);
+  c_destroy(root);
+  assert(count.allocs == 0 && count.bytes == 0);
+
+  printf("%s passed\n", __func__);
+}
+
+void test_hash(void) {
+  C_Node *root = c_join(7, c_join(4, c_leaf(1), c_join(3, c_leaf(2), NULL)),
+                        c_join(6, NULL, c_leaf(5)));
+  C_Node *other = c_join(7, c_join(4, c_leaf(1), c_join(3, c_leaf(2), NULL)),
+                         c_join(6, NULL, c_leaf(5)));
+  assert(c_size(root) == 7 && c_size(root->rchild) == 2);
+  assert(c_hash(root) == c_hash(other));
+  assert(c_hash(root->lchild->rchild) != c_hash(root->rchild));
+
+  /* Moving a leaf between sides changes the hash, and moving it back restores
+   * it. */
+  C_Node *leaf = root->rchild->rchild;
+  c_detach(leaf);
+  assert(c_size(root) == 6 && !c_is_equal(root, other, int_is_equal));
+  c_attach(leaf, root->rchild);
+  assert(root->rchild->lchild == leaf && c_hash(root) != c_hash(other));
+  c_detach(leaf);
+  root->rchild->rchild = leaf;
+  leaf->parent = root->rchild;
+  c_touch(root->rchild);
+  assert(c_hash(root) == c_hash(other) && c_size(root) == 7);
+  assert(c_is_equal(root, other, int_is_equal));
+
+  root->lchild->lchild->value = 9;
+  c_touch(root->lchild->lchild);
+  assert(c_hash(root) != c_hash(other));
+  assert(!c_is_equal(root, other, int_is_equal));
+
+  C_Flat *flat = c_flat_create(8);
+  C_Node *copy = c_flat_to_nodes(flat, c_flat_from_nodes(flat, other));
+  assert(c_hash(copy) == c_hash(other) && c_size(copy) == 7);
+  c_flat_destroy(flat);
+  c_destroy(copy);
+  c_destroy(root);
+  c_destroy(other);
+
+  printf("%s passed\n", __func__);
+}
+
 void run_tests(void) {
   printf("\n\n%s\n\n", __FILE__);
   test_leaf();
@@ -389,6 +523,9 @@ void run_tests(void) {
   test_begin_pre();
   test_iter_pre();
   test_is_equal();
+  test_alloc();
+  test_flat();
+  test_hash();
 }
 
 int main(void) {
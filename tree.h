@@ -34,9 +34,18 @@
  *
  * 		i_is_equal(root1, root2, cmp);
  *
- * 	Create an iterator for the tree at root with:
+ * 	Initialise an iterator for the tree at root, on the stack, with:
  *
- * 		i_Iter *it = i_iter_create(root)
+ * 		i_Iter it;
+ * 		i_iter_init(&it, root, order);
+ *
+ * 	Or create one on the heap with:
+ *
+ * 		i_Iter *it = i_iter_create(root, order)
+ *
+ * 	and free it with:
+ *
+ * 		i_iter_destroy(it);
  *
  * 	Use the iterator in a for loop:
  *
@@ -54,6 +63,34 @@
  *
  * 		i_iter_apply(root, func(node, context), context);
  *
+ * 	Optionally allocate nodes and iterators with an allocator from alloc.h, by
+ * 	defining T_ALLOC before including this file:
+ *
+ * 		#define T_ALLOC (&pool_allocator)
+ *
+ * 	Optionally keep a structural hash and node count in every node, so
+ * 	is_equal rejects most unequal trees without walking them, by defining
+ * 	T_HASH as a hash of values before including this file:
+ *
+ * 		#define T_HASH(value) ((size_t)(value))
+ *
+ * 	and read them with:
+ *
+ * 		i_hash(root);
+ * 		i_size(root);
+ *
+ * 	Optionally also instantiate flat trees, by defining T_FLAT before
+ * 	including this file. A flat holds any number of trees in one block of
+ * 	arrays, each node addressed by a 32 bit index:
+ *
+ * 		i_Flat *flat = i_flat_create(cap);
+ * 		uint32_t l = i_flat_leaf(flat, 1);
+ * 		uint32_t root = i_flat_join(flat, 5, l, T_NONE);
+ * 		uint32_t index = i_flat_from_nodes(flat, node_root);
+ * 		i_Node *node_root = i_flat_to_nodes(flat, root);
+ * 		i_Flat *copy = i_flat_copy(flat);
+ * 		i_flat_destroy(flat);
+ *
  * 	Other functions:
  *
  * 		i_is_leaf(node);
@@ -90,6 +127,24 @@ typedef int T_DEBUG_TYPE;
 
 #include <stdlib.h>
 
+/* Optionally define T_ALLOC as an expression giving the const Allocator * that
+ * nodes and iterators are allocated with, as in alloc.h. */
+#ifdef T_ALLOC
+#include "alloc.h"
+#define T_MALLOC(size) alloc_alloc(T_ALLOC, (size))
+#define T_FREE(p, size) alloc_free(T_ALLOC, (p), (size))
+#else
+#define T_MALLOC(size) malloc(size)
+#define T_FREE(p, size) free(p)
+#endif
+
+/* Optionally define T_HASH as an expression of a value giving a size_t hash,
+ * equal for values the comparators passed to is_equal find equal, to keep a
+ * structural hash and node count in every node. */
+#ifdef T_HASH
+#include <stdint.h>
+#endif
+
 /* ------------------------------- *
  * BASIC DEFINITIONS AND FUNCTIONS *
  * ------------------------------- */
@@ -100,20 +155,85 @@ struct P_Node {
   P_Node *parent;
   P_Node *lchild;
   P_Node *rchild;
+#ifdef T_HASH
+  uint32_t hash;
+  uint32_t size;
+#endif
 };
 
+#ifdef T_HASH
+
+/* The hash and size of a node are recomputed when read after its subtree
+ * changed. A change marks the node and its ancestors stale, by a size of 0,
+ * up to the first already stale, as stale nodes only have stale ancestors. So
+ * rewriting a tree in a pass costs no more than reading its hashes after. */
+static void T_CONCAT(T_PREFIX, rehash)(P_Node *node) {
+  uint32_t lhash = 0;
+  uint32_t rhash = 0;
+  node->size = 1;
+  if (node->lchild) {
+    if (!node->lchild->size) {
+      T_CONCAT(T_PREFIX, rehash)(node->lchild);
+    }
+    lhash = node->lchild->hash;
+    node->size += node->lchild->size;
+  }
+  if (node->rchild) {
+    if (!node->rchild->size) {
+      T_CONCAT(T_PREFIX, rehash)(node->rchild);
+    }
+    rhash = node->rchild->hash;
+    node->size += node->rchild->size;
+  }
+  uint64_t h = (uint64_t)(T_HASH(node->value)) * 0x9E3779B97F4A7C15u;
+  h = (h ^ lhash) * 0x9E3779B97F4A7C15u;
+  h = (h ^ rhash) * 0x9E3779B97F4A7C15u;
+  node->hash = h >> 32;
+}
+
+static uint32_t T_CONCAT(T_PREFIX, hash)(P_Node *node) {
+  if (!node->size) {
+    T_CONCAT(T_PREFIX, rehash)(node);
+  }
+  return node->hash;
+}
+
+/* Number of nodes in the tree at node. */
+static uint32_t T_CONCAT(T_PREFIX, size)(P_Node *node) {
+  if (!node->size) {
+    T_CONCAT(T_PREFIX, rehash)(node);
+  }
+  return node->size;
+}
+
+/* Marks the hashes of node and its ancestors stale. Must be called after
+ * changing the value or links of node other than through this file. */
+static void T_CONCAT(T_PREFIX, touch)(P_Node *node) {
+  for (; node && node->size; node = node->parent) {
+    node->size = 0;
+  }
+}
+
+#define T_TOUCH(node) T_CONCAT(T_PREFIX, touch)(node)
+#define T_REHASH(node) T_CONCAT(T_PREFIX, rehash)(node)
+#else
+#define T_TOUCH(node)
+#define T_REHASH(node)
+#endif
+
 static P_Node *T_CONCAT(T_PREFIX, leaf)(T_TYPE value) {
-  P_Node *p = malloc(sizeof(*p));
+  P_Node *p = T_MALLOC(sizeof(*p));
   p->value = value;
   p->parent = NULL;
   p->lchild = NULL;
   p->rchild = NULL;
+  T_REHASH(p);
   return p;
 }
 
 static P_Node *T_CONCAT(T_PREFIX, join)(T_TYPE value, P_Node *lchild,
                                         P_Node *rchild) {
-  P_Node *p = malloc(sizeof(*p));
+  P_Node *p = T_MALLOC(sizeof(*p));
   p->value = value;
   p->parent = NULL;
   p->lchild = lchild;
@@ -124,15 +244,25 @@ static P_Node *T_CONCAT(T_PREFIX, join)(T_TYPE value, P_Node *lchild,
   if (rchild) {
     rchild->parent = p;
   }
+  T_REHASH(p);
   return p;
 }
 
+/* Shared by every instantiation. */
+#ifndef T_COMMON
+#define T_COMMON
+
 #define t_is_leaf(node) (!node->lchild && !node->rchild)
 
 #define t_is_root(node) (!node->parent)
 
 #define t_num_children(node) ((node->lchild != NULL) + (node->rchild != NULL))
 
+typedef enum { LPARENT, RPARENT, LCHILD, RCHILD } CURR_DIR;
+typedef enum { T_PRE, T_POST } ORDER;
+
+#endif
+
 static int T_CONCAT(T_PREFIX, is_leaf)(P_Node *node) { return t_is_leaf(node); }
 
 static int T_CONCAT(T_PREFIX, is_root)(P_Node *node) { return t_is_root(node); }
@@ -143,6 +273,7 @@ static int T_CONCAT(T_PREFIX, num_children)(P_Node *node) {
 
 /* Detach node from its parent */
 static void T_CONCAT(T_PREFIX, detach)(P_Node *node) {
+  T_TOUCH(node->parent);
   if (node->parent->lchild == node) {
     node->parent->lchild = NULL;
   } else if (node->parent->rchild == node) {
@@ -159,6 +290,7 @@ static void T_CONCAT(T_PREFIX, attach)(P_Node *child, P_Node *parent) {
     parent->rchild = child;
   }
   child->parent = parent;
+  T_TOUCH(parent);
 }
 
 /* ----------------------- *
@@ -169,9 +301,6 @@ static void T_CONCAT(T_PREFIX, attach)(P_Node *child, P_Node *parent) {
 
 #define P_Iter T_CONCAT(T_STRUCT_PREFIX, Iter)
 
-typedef enum { LPARENT, RPARENT, LCHILD, RCHILD } CURR_DIR;
-typedef enum { T_PRE, T_POST } ORDER;
-
 typedef struct {
   P_Node *root;
   P_Node *tail;
@@ -195,13 +324,24 @@ static CURR_DIR T_CONCAT(T_PREFIX, tail_dir)(P_Node *tail, P_Node *head) {
   }
 }
 
+/* Initialises an iterator anywhere, usually on the stack, needing no
+ * cleanup. */
+static void T_CONCAT(T_PREFIX, iter_init)(P_Iter *it, P_Node *root,
+                                          ORDER order) {
+  it->root = root;
+  it->order = order;
+}
+
 static P_Iter *T_CONCAT(T_PREFIX, iter_create)(P_Node *root, ORDER order) {
-  P_Iter *p = malloc(sizeof(*p));
-  p->root = root;
-  p->order = order;
+  P_Iter *p = T_MALLOC(sizeof(*p));
+  T_CONCAT(T_PREFIX, iter_init)(p, root, order);
   return p;
 }
 
+static void T_CONCAT(T_PREFIX, iter_destroy)(P_Iter *it) {
+  T_FREE(it, sizeof(*it));
+}
+
 /* Walks the tree one adjacent node at a time, depth first and left to right. */
 static P_Node *T_CONCAT(T_PREFIX, traverse)(P_Iter *it) {
   if (it->tail == it->root && it->tail->parent == it->head) {
@@ -304,22 +444,23 @@ static P_Node *T_CONCAT(T_PREFIX, begin)(P_Iter *it) {
 static void T_CONCAT(T_PREFIX, iter_apply)(P_Node *root, ORDER order,
                                            void (*func)(P_Node *, void *),
                                            void *ctx) {
-  P_Iter *it = T_CONCAT(T_PREFIX, iter_create)(root, order);
+  P_Iter it;
+  T_CONCAT(T_PREFIX, iter_init)(&it, root, order);
   P_Node *node;
-  for (node = T_CONCAT(T_PREFIX, begin)(it); !T_CONCAT(T_PREFIX, end)(it);
-       node = T_CONCAT(T_PREFIX, next)(it)) {
+  for (node = T_CONCAT(T_PREFIX, begin)(&it); !T_CONCAT(T_PREFIX, end)(&it);
+       node = T_CONCAT(T_PREFIX, next)(&it)) {
     func(node, ctx);
   }
-  free(it);
 }
 
 static size_t T_CONCAT(T_PREFIX, height)(P_Node *root) {
-  P_Iter *it = T_CONCAT(T_PREFIX, iter_create)(root, T_PRE);
+  P_Iter it;
+  T_CONCAT(T_PREFIX, iter_init)(&it, root, T_PRE);
   size_t height = 0;
   size_t max = 1;
-  for (T_CONCAT(T_PREFIX, start)(it); !T_CONCAT(T_PREFIX, end)(it);
-       T_CONCAT(T_PREFIX, traverse)(it)) {
-    switch (it->dir) {
+  for (T_CONCAT(T_PREFIX, start)(&it); !T_CONCAT(T_PREFIX, end)(&it);
+       T_CONCAT(T_PREFIX, traverse)(&it)) {
+    switch (it.dir) {
     case LPARENT:
     case RPARENT:
       height++;
@@ -331,32 +472,40 @@ static size_t T_CONCAT(T_PREFIX, height)(P_Node *root) {
     }
     max = max >= height ? max : height;
   }
-  free(it);
   return max - 1;
 }
 
 static void T_CONCAT(T_PREFIX, destroy)(P_Node *root) {
-  P_Iter *it = T_CONCAT(T_PREFIX, iter_create)(root, T_POST);
+  P_Iter it;
+  T_CONCAT(T_PREFIX, iter_init)(&it, root, T_POST);
   P_Node *node1 = NULL;
   P_Node *node2 = NULL;
-  for (T_CONCAT(T_PREFIX, begin)(it); !T_CONCAT(T_PREFIX, end)(it);
-       T_CONCAT(T_PREFIX, next)(it)) {
-    node2 = it->tail;
+  for (T_CONCAT(T_PREFIX, begin)(&it); !T_CONCAT(T_PREFIX, end)(&it);
+       T_CONCAT(T_PREFIX, next)(&it)) {
+    node2 = it.tail;
     if (node1) {
-      free(node1);
+      T_FREE(node1, sizeof(*node1));
     }
     node1 = node2;
   }
-  free(node1);
-  free(it);
+  T_FREE(node1, sizeof(*node1));
 }
 
 /* v_is_equal(u, v) should return 1 if equal, 0 if not. */
 static int T_CONCAT(T_PREFIX, is_equal)(P_Node *root1, P_Node *root2,
                                         int (*v_is_equal)(T_TYPE, T_TYPE)) {
+#ifdef T_HASH
+  if (T_CONCAT(T_PREFIX, hash)(root1) != T_CONCAT(T_PREFIX, hash)(root2) ||
+      T_CONCAT(T_PREFIX, size)(root1) != T_CONCAT(T_PREFIX, size)(root2)) {
+    return 0;
+  }
+#endif
   int return_val = 1;
-  P_Iter *it1 = T_CONCAT(T_PREFIX, iter_create)(root1, T_PRE);
-  P_Iter *it2 = T_CONCAT(T_PREFIX, iter_create)(root2, T_PRE);
+  P_Iter iter1, iter2;
+  P_Iter *it1 = &iter1;
+  P_Iter *it2 = &iter2;
+  T_CONCAT(T_PREFIX, iter_init)(it1, root1, T_PRE);
+  T_CONCAT(T_PREFIX, iter_init)(it2, root2, T_PRE);
   T_CONCAT(T_PREFIX, start)(it1);
   T_CONCAT(T_PREFIX, start)(it2);
   while (1) {
@@ -378,11 +527,194 @@ static int T_CONCAT(T_PREFIX, is_equal)(P_Node *root1, P_Node *root2,
       break;
     };
   }
-  free(it1);
-  free(it2);
   return return_val;
 }
 
+#ifdef T_FLAT
+
+/* ---------- *
+ * FLAT TREES *
+ * ---------- */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef T_FLAT_COMMON
+#define T_FLAT_COMMON
+
+/* The index of no node, for missing children and the parents of roots. */
+#define T_NONE UINT32_MAX
+
+typedef struct {
+  uint32_t lchild;
+  uint32_t rchild;
+} T_Links;
+
+#endif
+
+#define P_Flat T_CONCAT(T_STRUCT_PREFIX, Flat)
+
+/* The nodes of a flat are spread over three arrays of cap elements in one
+ * block: values and children, read on every walk down, first, then parents,
+ * only read going back up. An index is half a pointer, so a node takes 8 bytes
+ * besides its value, not 24, and a whole flat is copied with one memcpy. The
+ * arrays are laid out as members of a struct of the three would be, so a flat
+ * can also point into static data, which is only ever read. */
+typedef struct {
+  uint32_t length;
+  uint32_t cap;
+  T_TYPE *values;
+  T_Links *links;
+  uint32_t *parents;
+} P_Flat;
+
+static size_t T_CONCAT(T_PREFIX, flat_links_offset)(uint32_t cap) {
+  size_t align = _Alignof(T_Links);
+  return (cap * sizeof(T_TYPE) + align - 1) / align * align;
+}
+
+static size_t T_CONCAT(T_PREFIX, flat_block_size)(uint32_t cap) {
+  return T_CONCAT(T_PREFIX, flat_links_offset)(cap) +
+         cap * (sizeof(T_Links) + sizeof(uint32_t));
+}
+
+static void T_CONCAT(T_PREFIX, flat_layout)(P_Flat *flat, void *block,
+                                            uint32_t cap) {
+  flat->cap = cap;
+  flat->values = block;
+  flat->links = (T_Links *)((char *)block +
+                            T_CONCAT(T_PREFIX, flat_links_offset)(cap));
+  flat->parents = (uint32_t *)(flat->links + cap);
+}
+
+static P_Flat *T_CONCAT(T_PREFIX, flat_create)(uint32_t cap) {
+  P_Flat *flat = T_MALLOC(sizeof(*flat));
+  cap = cap ? cap : 1;
+  flat->length = 0;
+  T_CONCAT(T_PREFIX, flat_layout)
+  (flat, T_MALLOC(T_CONCAT(T_PREFIX, flat_block_size)(cap)), cap);
+  return flat;
+}
+
+static void T_CONCAT(T_PREFIX, flat_destroy)(P_Flat *flat) {
+  T_FREE(flat->values, T_CONCAT(T_PREFIX, flat_block_size)(flat->cap));
+  T_FREE(flat, sizeof(*flat));
+}
+
+/* Doubles cap. Each array moves to a new offset, so is copied on its own. */
+static void T_CONCAT(T_PREFIX, flat_grow)(P_Flat *flat) {
+  P_Flat old = *flat;
+  T_CONCAT(T_PREFIX, flat_layout)
+  (flat, T_MALLOC(T_CONCAT(T_PREFIX, flat_block_size)(2 * old.cap)),
+   2 * old.cap);
+  memcpy(flat->values, old.values, old.length * sizeof(*old.values));
+  memcpy(flat->links, old.links, old.length * sizeof(*old.links));
+  memcpy(flat->parents, old.parents, old.length * sizeof(*old.parents));
+  T_FREE(old.values, T_CONCAT(T_PREFIX, flat_block_size)(old.cap));
+}
+
+/* Appends a node with the roots lchild and rchild of the flat as children,
+ * either of which may be T_NONE, and returns its index. */
+static uint32_t T_CONCAT(T_PREFIX, flat_join)(P_Flat *flat, T_TYPE value,
+                                              uint32_t lchild,
+                                              uint32_t rchild) {
+  if (flat->length == flat->cap) {
+    T_CONCAT(T_PREFIX, flat_grow)(flat);
+  }
+  uint32_t i = flat->length++;
+  flat->values[i] = value;
+  flat->links[i].lchild = lchild;
+  flat->links[i].rchild = rchild;
+  flat->parents[i] = T_NONE;
+  if (lchild != T_NONE) {
+    flat->parents[lchild] = i;
+  }
+  if (rchild != T_NONE) {
+    flat->parents[rchild] = i;
+  }
+  return i;
+}
+
+static uint32_t T_CONCAT(T_PREFIX, flat_leaf)(P_Flat *flat, T_TYPE value) {
+  return T_CONCAT(T_PREFIX, flat_join)(flat, value, T_NONE, T_NONE);
+}
+
+static P_Flat *T_CONCAT(T_PREFIX, flat_copy)(const P_Flat *flat) {
+  size_t size = T_CONCAT(T_PREFIX, flat_block_size)(flat->cap);
+  P_Flat *copy = T_MALLOC(sizeof(*copy));
+  void *block = T_MALLOC(size);
+  memcpy(block, flat->values, size);
+  copy->length = flat->length;
+  T_CONCAT(T_PREFIX, flat_layout)(copy, block, flat->cap);
+  return copy;
+}
+
+/* Appends the tree at root in pre-order, so every subtree of it takes a range
+ * of indices starting at its root, and returns the index of root. */
+static uint32_t T_CONCAT(T_PREFIX, flat_from_nodes)(P_Flat *flat,
+                                                    P_Node *root) {
+  uint32_t top = T_CONCAT(T_PREFIX, flat_leaf)(flat, root->value);
+  uint32_t curr = top;
+  P_Iter iter;
+  P_Iter *it = &iter;
+  T_CONCAT(T_PREFIX, iter_init)(it, root, T_PRE);
+  for (T_CONCAT(T_PREFIX, start)(it), T_CONCAT(T_PREFIX, traverse)(it);
+       !T_CONCAT(T_PREFIX, end)(it); T_CONCAT(T_PREFIX, traverse)(it)) {
+    uint32_t i;
+    switch (it->dir) {
+    case LPARENT:
+      i = T_CONCAT(T_PREFIX, flat_leaf)(flat, it->head->value);
+      flat->links[curr].lchild = i;
+      flat->parents[i] = curr;
+      curr = i;
+      break;
+    case RPARENT:
+      i = T_CONCAT(T_PREFIX, flat_leaf)(flat, it->head->value);
+      flat->links[curr].rchild = i;
+      flat->parents[i] = curr;
+      curr = i;
+      break;
+    case LCHILD:
+    case RCHILD:
+      curr = flat->parents[curr];
+      break;
+    }
+  }
+  return top;
+}
+
+/* Returns a node tree equal to the tree at root in the flat. */
+static P_Node *T_CONCAT(T_PREFIX, flat_to_nodes)(const P_Flat *flat,
+                                                 uint32_t root) {
+  P_Node *top = T_CONCAT(T_PREFIX, leaf)(flat->values[root]);
+  P_Node *node = top;
+  uint32_t i = root;
+  while (1) {
+    uint32_t l = flat->links[i].lchild;
+    uint32_t r = flat->links[i].rchild;
+    if (l != T_NONE && !node->lchild) {
+      node->lchild = T_CONCAT(T_PREFIX, leaf)(flat->values[l]);
+      node->lchild->parent = node;
+      T_TOUCH(node);
+      node = node->lchild;
+      i = l;
+    } else if (r != T_NONE && !node->rchild) {
+      node->rchild = T_CONCAT(T_PREFIX, leaf)(flat->values[r]);
+      node->rchild->parent = node;
+      T_TOUCH(node);
+      node = node->rchild;
+      i = r;
+    } else if (i == root) {
+      return top;
+    } else {
+      node = node->parent;
+      i = flat->parents[i];
+    }
+  }
+}
+
+#endif
+
 #ifdef T_DEBUG
 
 #include <stdio.h>
@@ -401,7 +733,9 @@ static void T_CONCAT(T_PREFIX, DEBUG_PRINT)(P_Node *root,
   }
   printf("\n\n");
 
-  P_Iter *it = T_CONCAT(T_PREFIX, iter_create)(root, T_POST);
+  P_Iter iter;
+  P_Iter *it = &iter;
+  T_CONCAT(T_PREFIX, iter_init)(it, root, T_POST);
   for (T_CONCAT(T_PREFIX, begin)(it); !T_CONCAT(T_PREFIX, end)(it);
        T_CONCAT(T_PREFIX, next)(it)) {
     v_print(it->tail->value);
@@ -419,7 +753,6 @@ static void T_CONCAT(T_PREFIX, DEBUG_PRINT)(P_Node *root,
     }
     printf("\n");
   }
-  free(it);
 }
 
 #endif
@@ -428,12 +761,20 @@ static void T_CONCAT(T_PREFIX, DEBUG_PRINT)(P_Node *root,
 #undef T_PREFIX
 #undef T_STRUCT_PREFIX
 #undef T_DEBUG
+#undef T_ALLOC
+#undef T_FLAT
+#undef T_HASH
+#undef T_TOUCH
+#undef T_REHASH
+#undef T_MALLOC
+#undef T_FREE
 
 #undef T_CONCAT
 #undef T_CONCAT_2
 
 #undef P_Node
 #undef P_Iter
+#undef P_Flat
 
 #endif
 #endif